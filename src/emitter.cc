@@ -36,12 +36,15 @@
 #include <errno.h>
 
 #include "./fluent/emitter.hpp"
+#include "./fluent/text.hpp"
+#include "./fluent/reader.hpp"
 #include "./debug.h"
 
 namespace fluent {
   // ----------------------------------------------------------------
   // Emitter
-  Emitter::Emitter() {
+  Emitter::Emitter() :
+    running_(false), lost_(0), batch_bytes_(0), pool_(nullptr) {
   }
 
   Emitter::~Emitter() {
@@ -50,13 +53,58 @@ namespace fluent {
   bool Emitter::emit(Message *msg) {
     debug(DBG, "emit %p", msg);
     bool rc = this->queue_.push(msg);
+    if (!rc) {
+      this->lost_++;
+      this->release(msg);
+    }
     return rc;
   }
 
+  void Emitter::release(Message *root) {
+    MessagePool *pool = this->pool_;
+    if (pool) {
+      pool->put(root);
+    } else {
+      delete root;
+    }
+  }
+
+  bool Emitter::flush(int timeout_msec) {
+    if (!this->running_) {
+      return (this->queue_.count() == 0);
+    }
+    return this->queue_.wait_drain(timeout_msec);
+  }
+
+  size_t Emitter::shutdown(int timeout_msec) {
+    if (this->running_) {
+      this->queue_.term(true);
+      this->queue_.wait_drain(timeout_msec);
+      this->abort();
+      ::pthread_join(this->th_, nullptr);
+      this->running_ = false;
+    }
+    return this->lost();
+  }
+
+  void Emitter::abort() {
+    this->queue_.abort();
+  }
+
   void Emitter::set_queue_limit(size_t limit) {
     this->queue_.set_limit(limit);
   }
 
+  void Emitter::set_linger(int linger_usec, size_t batch_count,
+                           size_t batch_bytes) {
+    this->queue_.set_linger(linger_usec, batch_count);
+    this->batch_bytes_ = batch_bytes;
+  }
+
+  void Emitter::set_spin(size_t spin) {
+    this->queue_.set_spin(spin);
+  }
+
   void* Emitter::run_thread(void *obj) {
     Emitter *emitter = static_cast<Emitter*>(obj);
     emitter->worker();
@@ -64,12 +112,17 @@ namespace fluent {
   }
 
   void Emitter::start_worker() {
-    ::pthread_create(&(this->th_), NULL, Emitter::run_thread, this);    
+    this->running_ =
+      (0 == ::pthread_create(&(this->th_), NULL, Emitter::run_thread, this));
   }
   void Emitter::stop_worker() {
+    if (!this->running_) {
+      return;
+    }
     // ::pthread_cancel(this->th_);
     this->queue_.term();
     ::pthread_join(this->th_, nullptr);
+    this->running_ = false;
   }
 
   // ----------------------------------------------------------------
@@ -110,7 +163,7 @@ namespace fluent {
     for (size_t i = 0; this->retry_limit_ == 0 || i < this->retry_limit_;
          i++) {
 
-      if (this->queue_.is_term()) {
+      if (this->queue_.is_abort()) {
         // Going to shutdown.
         return false;
       }
@@ -127,66 +180,102 @@ namespace fluent {
       int wait_msec = rand_dist(mt_rand) % wait_msec_max;
 
       debug(DBG, "reconnect after %d msec...", wait_msec);
-      usleep(wait_msec * 1000);
+      if (this->queue_.wait_abort(wait_msec)) {
+        return false;
+      }
     }
 
     this->set_errmsg(this->sock_->errmsg());
-    delete this->sock_;
-    this->sock_ = nullptr;
     return false;
   }
 
+  bool InetEmitter::send(const void *data, size_t len) {
+    while (true) {
+      if (!this->sock_->is_connected() && !this->connect()) {
+        return false;
+      }
+      if (this->sock_->send(data, len)) {
+        return true;
+      }
+      debug(DBG, "socket error: %s", this->sock_->errmsg().c_str());
+    }
+  }
+
+  void InetEmitter::abort() {
+    this->Emitter::abort();
+    this->sock_->abort();
+  }
+
   void InetEmitter::worker() {
     if (!this->sock_->is_connected()) {
       this->connect(); // TODO: handle failure of retry
     }
 
+    msgpack::sbuffer buf;
+    msgpack::packer <msgpack::sbuffer> pk(&buf);
     Message *root;
-    bool abort_loop = false;
-    
     while (nullptr != (root = this->queue_.bulk_pop())) {
+      size_t pending = 0;
       for(Message *msg = root; msg; msg = msg->next()) {
-        msgpack::sbuffer buf;
-        msgpack::packer <msgpack::sbuffer> pk(&buf);
         msg->to_msgpack(&pk);
+        pending++;
 
-        debug(DBG, "sending msg %p", msg);
-        while(!this->sock_->send(buf.data(), buf.size())) {
-          debug(DBG, "socket error: %s", this->sock_->errmsg().c_str());
-          // std::cerr << "socket error: " << this->sock_->errmsg() << std::endl;
-          if (!this->connect()) {
-            abort_loop = true;
-            break;
+        // Send the batch at once, or by chunk of batch_bytes.
+        if (msg->next() == nullptr || this->is_full(buf.size())) {
+          debug(DBG, "sending %zu msgs, %zu bytes", pending, buf.size());
+          if (!this->send(buf.data(), buf.size())) {
+            // Gave up to connect, the messages are dropped.
+            this->lost_ += pending;
           }
+          buf.clear();
+          pending = 0;
         }
-
-        if (abort_loop) {
-          break;
-        }
-        
-        debug(false, "sent %p", msg);
       }
-      delete root;
+      this->release(root);
     }
   }
 
   // ----------------------------------------------------------------
   // FileEmitter
   FileEmitter::FileEmitter(const std::string &fname, Format fmt) :
-    Emitter(), enabled_(false), opened_(false), format_(fmt) {
+    FileEmitter(fname, fmt, "", 0) {
+  }
+  FileEmitter::FileEmitter(const std::string &fname, Format fmt,
+                           const std::string &index_fname,
+                           size_t index_every) :
+    Emitter(), enabled_(false), opened_(false), format_(fmt), index_fd_(-1),
+    index_every_(index_every > 0 ? index_every : 1) {
     // Setup socket.
 
     this->fd_ = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
     if (this->fd_ < 0) {
       this->set_errmsg(strerror(errno));
-    } else {
-      this->opened_ = true;
-      this->enabled_ = true;
-      this->start_worker();
+      return;
     }
+
+    if (!index_fname.empty()) {
+      this->index_fd_ = ::open(index_fname.c_str(),
+                               O_WRONLY | O_CREAT | O_APPEND, 0644);
+      struct stat st;
+      if (this->index_fd_ < 0 || fstat(this->index_fd_, &st) < 0 ||
+          (st.st_size == 0 &&
+           !write(this->index_fd_, DumpIndex::MAGIC,
+                  sizeof(DumpIndex::MAGIC)))) {
+        // Entries are written without index.
+        this->set_errmsg(strerror(errno));
+        if (this->index_fd_ >= 0) {
+          ::close(this->index_fd_);
+          this->index_fd_ = -1;
+        }
+      }
+    }
+    this->opened_ = true;
+    this->enabled_ = true;
+    this->start_worker();
   }
   FileEmitter::FileEmitter(int fd, Format fmt) :
-       Emitter(), fd_(fd), enabled_(false), opened_(false), format_(fmt) {
+       Emitter(), fd_(fd), enabled_(false), opened_(false), format_(fmt),
+       index_fd_(-1), index_every_(0) {
        
 #ifndef _WIN32
     if (fcntl(fd, F_GETFL) < 0 && errno == EBADF) {
@@ -204,39 +293,153 @@ namespace fluent {
     if (this->enabled_ && this->opened_) {
       ::close(this->fd_);
     }
+    if (this->index_fd_ >= 0) {
+      ::close(this->index_fd_);
+    }
   }
 
+  // Blocks of DumpIndex for entries written by FileEmitter.
+  class IndexBuilder {
+  private:
+    DumpIndex::Block block_;
+    time_t ts_;
+    size_t count_;
+    size_t every_;
+    std::string data_;
+
+  public:
+    explicit IndexBuilder(size_t every) : ts_(0), count_(0), every_(every) {}
+    // Entry of time ts at offset of the file.
+    void add(uint64_t offset, time_t ts) {
+      if (this->count_ > 0 &&
+          (this->count_ >= this->every_ || ts != this->ts_)) {
+        this->close(offset);
+      }
+      if (this->count_ == 0) {
+        this->block_.offset = offset;
+        this->block_.min_ts = this->block_.max_ts = ts;
+        this->ts_ = ts;
+      } else if (ts < this->block_.min_ts) {
+        this->block_.min_ts = ts;
+      } else if (ts > this->block_.max_ts) {
+        this->block_.max_ts = ts;
+      }
+      this->count_++;
+    }
+    // Finish the block at the end offset of entries.
+    void close(uint64_t end) {
+      if (this->count_ == 0) {
+        return;
+      }
+      this->block_.length = end - this->block_.offset;
+      char buf[DumpIndex::BLOCK_SIZE];
+      DumpIndex::encode(this->block_, buf);
+      this->data_.append(buf, sizeof(buf));
+      this->count_ = 0;
+    }
+    std::string& data() { return this->data_; }
+    // Discard blocks, to start over after entries are lost.
+    void reset() {
+      this->count_ = 0;
+      this->data_.clear();
+    }
+  };
+
   void FileEmitter::worker() {
     assert(this->enabled_);
     
+    msgpack::sbuffer buf;
+    msgpack::packer <msgpack::sbuffer> pk(&buf);
+    TextEncoder text;
+    // Offset of the end of file, to index entries.
+    IndexBuilder index(this->index_every_);
+    uint64_t offset = 0;
+    if (this->index_fd_ >= 0) {
+      off_t end = lseek(this->fd_, 0, SEEK_END);
+      offset = (end > 0) ? end : 0;
+    }
     Message *root;
     while (nullptr != (root = this->queue_.bulk_pop())) {
+      size_t pending = 0;
       for(Message *msg = root; msg; msg = msg->next()) {
-        int rc;
+        if (this->index_fd_ >= 0) {
+          index.add(offset +
+                    ((this->format_ == MsgPack) ? buf.size() : text.size()),
+                    msg->ts());
+        }
+        bool encoded = true;
         switch(this->format_) {
-          case MsgPack: {
-            msgpack::sbuffer buf;
-            msgpack::packer <msgpack::sbuffer> pk(&buf);
-            msg->to_msgpack(&pk);
+          case MsgPack: msg->to_msgpack(&pk); break;
+          case Text: encoded = text.encode(*msg); break;
+          case Json: encoded = text.encode_json(*msg); break;
+          case Ltsv: encoded = text.encode_ltsv(*msg); break;
+        }
+        const char *data = (this->format_ == MsgPack) ? buf.data() : text.data();
+        size_t size = (this->format_ == MsgPack) ? buf.size() : text.size();
+        if (encoded) {
+          pending++;
+        } else {
+          // Broken fields of Template or Builder, the line is dropped.
+          this->lost_++;
+        }
 
-            rc = ::write(this->fd_, buf.data(), buf.size());
-            break;
+        // Write the batch at once, or by chunk of batch_bytes.
+        if (msg->next() == nullptr || this->is_full(size)) {
+          if (this->write(data, size)) {
+            offset += size;
+          } else {
+            this->set_errmsg(strerror(errno));
+            this->lost_ += pending;
+            off_t end = lseek(this->fd_, 0, SEEK_END);
+            offset = (end > 0) ? end : 0;
+            // Blocks may point to the lost entries, index from the new end.
+            index.reset();
           }
-          case Text: {
-            std::stringstream ss;
-            msg->to_ostream(ss);
-            const std::string& s = ss.str();
-            rc = ::write(this->fd_, s.c_str(), s.length());
-            break;
+          // Blocks of index after their entries.
+          if (this->index_fd_ >= 0 && !index.data().empty()) {
+            this->write_index(&index.data());
           }
+          buf.clear();
+          text.clear();
+          pending = 0;
         }
-        
-        if (rc < 0) {
-          this->set_errmsg(strerror(errno));
+      }
+      this->release(root);
+    }
+
+    if (this->index_fd_ >= 0) {
+      index.close(offset);
+      this->write_index(&index.data());
+    }
+  }
+
+  void FileEmitter::write_index(std::string *blocks) {
+    if (!write(this->index_fd_, blocks->data(), blocks->size())) {
+      // Entries are written without index from now on.
+      this->set_errmsg(strerror(errno));
+      ::close(this->index_fd_);
+      this->index_fd_ = -1;
+    }
+    blocks->clear();
+  }
+
+  bool FileEmitter::write(const char *data, size_t len) {
+    return write(this->fd_, data, len);
+  }
+
+  bool FileEmitter::write(int fd, const char *data, size_t len) {
+    while (len > 0) {
+      ssize_t rc = ::write(fd, data, len);
+      if (rc < 0) {
+        if (errno == EINTR) {
+          continue;
         }
+        return false;
       }
-      delete root;
+      data += rc;
+      len  -= rc;
     }
+    return true;
   }
 
 
@@ -250,7 +453,12 @@ namespace fluent {
     // nothing to do.
   } 
   bool QueueEmitter::emit(Message *msg) {
-    return this->q_->push(msg);
+    bool rc = this->q_->push(msg);
+    if (!rc) {
+      this->lost_++;
+      this->release(msg);
+    }
+    return rc;
   }
   
 }
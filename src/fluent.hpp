@@ -30,6 +30,7 @@
 #include "./fluent/logger.hpp"
 #include "./fluent/message.hpp"
 #include "./fluent/queue.hpp"
+#include "./fluent/server.hpp"
 #include "./fluent/exception.hpp"
 
 #endif
@@ -30,13 +30,16 @@
 #include <string>
 #include <pthread.h>
 #include <random>
+#include <atomic>
 #include "./socket.hpp"
 #include "./queue.hpp"
+#include "./pool.hpp"
 
 namespace fluent {
   class Emitter {
   private:
     pthread_t th_;
+    bool running_;
     std::string errmsg_;
     
     static void* run_thread(void *obj);
@@ -45,17 +48,47 @@ namespace fluent {
   protected:
     static const bool DBG = false;
     MsgThreadQueue queue_;
+    // Number of messages dropped by full queue, shutdown or write error.
+    std::atomic<size_t> lost_;
+    std::atomic<size_t> batch_bytes_;
+    std::atomic<MessagePool*> pool_;
+    // Return written messages to pool if available, or delete them.
+    void release(Message *root);
+    bool is_full(size_t encoded) const {
+      return (this->batch_bytes_ > 0 && encoded >= this->batch_bytes_);
+    }
     void set_errmsg(const std::string &errmsg) {
       this->errmsg_ = errmsg;
     }
     void start_worker();
     void stop_worker();
+    // Called by shutdown() when the deadline passed to stop the worker
+    // in a blocking operation.
+    virtual void abort();
 
   public:
     Emitter();
     virtual ~Emitter();
     void set_queue_limit(size_t limit);
+    // Let the worker wait up to linger_usec for following messages and
+    // write them at once. The batch is written earlier when batch_count
+    // messages are queued, and split into writes of about batch_bytes.
+    // 0 means no limit.
+    void set_linger(int linger_usec, size_t batch_count=0,
+                    size_t batch_bytes=0);
+    // See MsgThreadQueue::set_spin().
+    void set_spin(size_t spin);
+    // Recycle messages via pool after writing them. pool must outlive
+    // the emitter, and may be set while the worker is running.
+    void set_pool(MessagePool *pool) { this->pool_ = pool; }
+    // Emitter takes ownership of msg even if emit() fails.
     virtual bool emit(Message *msg);
+    // Wait until queued messages are written. Return false on timeout.
+    virtual bool flush(int timeout_msec);
+    // Stop the worker after draining the queue up to timeout_msec, then
+    // abandon the rest. Return the number of lost messages.
+    size_t shutdown(int timeout_msec);
+    size_t lost() const { return this->lost_; }
     const std::string& errmsg() const { return this->errmsg_; }
   };
 
@@ -72,6 +105,10 @@ namespace fluent {
     Socket *sock_;
     size_t retry_limit_;
     bool connect();
+    bool send(const void *data, size_t len);
+
+  protected:
+    void abort();
 
   public:
     InetEmitter(const std::string &host, int port);
@@ -85,6 +122,8 @@ namespace fluent {
     enum Format {
       MsgPack,
       Text,
+      Json,     // A line of JSON (NDJSON) for each message.
+      Ltsv,     // A line of LTSV for each message.
     };
     
    private:
@@ -92,9 +131,20 @@ namespace fluent {
     bool enabled_;
     bool opened_;
     Format format_;
+    // Sparse time index, see DumpIndex.
+    int index_fd_;
+    size_t index_every_;
+    bool write(const char *data, size_t len);
+    static bool write(int fd, const char *data, size_t len);
+    // Write and clear blocks of index, or close the index on failure.
+    void write_index(std::string *blocks);
 
    public:
     FileEmitter(const std::string &fname, Format fmt=MsgPack);
+    // Write index of time to index_fname as well, a block for every
+    // index_every entries or for each second of time.
+    FileEmitter(const std::string &fname, Format fmt,
+                const std::string &index_fname, size_t index_every=1000);
     FileEmitter(int fd, Format fmt=MsgPack);
     ~FileEmitter();
     void worker();
@@ -107,7 +157,8 @@ namespace fluent {
     explicit QueueEmitter(MsgQueue *q);
     ~QueueEmitter();
     void worker();
-    bool emit(Message *msg);    
+    bool emit(Message *msg);
+    bool flush(int timeout_msec) { return true; }
   };
   
 }
@@ -30,13 +30,16 @@
 #include <set>
 #include <string>
 #include <vector>
+#include "./schema.hpp"
+#include "./template.hpp"
 
 namespace fluent {
   class Message;
   class Socket;
   class Emitter;
   class MsgQueue;
-  
+  class MessagePool;
+
   class Logger {
   private:
     std::set<Message*> msg_set_;
@@ -44,6 +47,15 @@ namespace fluent {
     std::string errmsg_;
     std::vector<MsgQueue*> queue_;
     std::string tag_prefix_;
+    Message::KeyOrder key_order_;
+    bool event_time_;
+    MessagePool *pool_;
+    std::vector<const Template*> template_;
+
+    Message* new_message(const std::string &tag) const;
+    // Append emitter, recycling messages via the pool if set.
+    void add_emitter(Emitter *e);
+    bool dispatch(Message *msg);
     
   public:
     Logger();
@@ -53,14 +65,60 @@ namespace fluent {
     void new_forward(const std::string &host, const std::string &port);
     void new_dumpfile(const std::string &fname);
     void new_dumpfile(int fd);
+    // Dumpfile with sparse index of time, that DumpReader uses to read
+    // entries of a time range. See DumpIndex.
+    void new_dumpfile(const std::string &fname, const std::string &index_fname,
+                      size_t index_every=1000);
     void new_textfile(const std::string &fname);
     void new_textfile(int fd);
+    void new_jsonfile(const std::string &fname);
+    void new_jsonfile(int fd);
+    void new_ltsvfile(const std::string &fname);
+    void new_ltsvfile(int fd);
     MsgQueue* new_msgqueue();
     Message* retain_message(const std::string &tag);
+    // Fields of base are encoded once into the template, owned by Logger.
+    const Template* new_template(const Message &base);
+    // Message with static fields of tmpl, only own fields are encoded
+    // per event.
+    Message* retain_message(const std::string &tag, const Template *tmpl);
     bool emit(Message *msg);
+    // Emit fixed-shape event encoded by schema. Message is created and
+    // dispatched internally, so retain_message() is not required.
+    template <typename... T>
+    bool emit(const std::string &tag, const Schema<T...> &schema,
+              const typename SchemaArg<T>::type&... vals) {
+      Message *msg = this->new_message(tag);
+      schema.encode(msg, vals...);
+      return this->dispatch(msg);
+    }
     const std::string& errmsg() const { return this->errmsg_; }
     void set_queue_limit(size_t limit);
+    // See Emitter::set_linger().
+    void set_linger(int linger_usec, size_t batch_count=0,
+                    size_t batch_bytes=0);
+    // See MsgThreadQueue::set_spin().
+    void set_spin(size_t spin);
     void set_tag_prefix(const std::string &prefix);
+    // Key order of messages created by retain_message(). Default is
+    // Message::SortedKeys.
+    void set_key_order(Message::KeyOrder order);
+    // Send timestamp as EventTime with nanoseconds. fluentd >= 0.14 is
+    // required.
+    void set_event_time(bool enable);
+    // Recycle messages written by emitters for retain_message(), keeping
+    // up to size messages. It applies to emitters added before and after.
+    void set_pool_size(size_t size);
+
+    // Wait until all emitters write out queued messages, up to
+    // timeout_msec. Return false on timeout. Total number of lost messages
+    // is stored into lost if given.
+    bool flush(int timeout_msec, size_t *lost=nullptr);
+    // Drain queues up to timeout_msec and stop all emitters. Messages not
+    // written by then are abandoned. Return total number of lost messages.
+    // Logger does not accept messages any more after shutdown().
+    size_t shutdown(int timeout_msec);
+    size_t lost() const;
   };
 
 }
@@ -29,11 +29,18 @@
 
 #include <msgpack.hpp>
 #include <iostream>
-#include <map>
+#include <vector>
+#include <atomic>
 #include <assert.h>
 #include "./exception.hpp"
 
 namespace fluent {
+  template <typename... T> class Schema;
+  class MessagePool;
+  class Template;
+  class TextEncoder;
+  class DumpReader;
+
   class Message {
   public:
     class Object;
@@ -41,25 +48,71 @@ namespace fluent {
     class Map;
     class String;
     class Fixnum;
+    class Ufixnum;
     class Float;
     class Bool;
+    class Binary;
+    class Ext;
+    class Builder;
+    class Key;
+
+    // Order of keys in serialized map. fluentd does not require sorted
+    // keys, and InsertionOrder makes building wide records cheaper.
+    enum KeyOrder {
+      SortedKeys,
+      InsertionOrder,
+    };
     
-    Message(const std::string &tag);
+    Message(const std::string &tag, KeyOrder order=SortedKeys);
     ~Message();
     
-    // Set timestamp.
+    // Set timestamp. Constructor sets the current time with nanoseconds
+    // from coarse clock that is read without syscall (vDSO), so the
+    // resolution is a few milliseconds.
     void set_ts(time_t ts);
+    void set_ts(time_t sec, long nsec);
     time_t ts() const { return this->ts_; }
+    long ts_nsec() const { return this->ts_nsec_; }
+    // Encode timestamp as EventTime of forward protocol (ext type 0,
+    // seconds and nanoseconds) instead of integer seconds.
+    void set_event_time(bool enable) { this->event_time_ = enable; }
+    bool event_time() const { return this->event_time_; }
+    // Current time by the same clock as constructor.
+    static void now(time_t *sec, long *nsec);
     const std::string& tag() const { return this->tag_; }
 
     // Set message data.
     bool set(const std::string &key, const std::string &val);
     bool set(const std::string &key, const char *val);
+    // val is moved into message without copy.
+    bool set(const std::string &key, std::string &&val);
+    bool set(const std::string &key, const char *val, size_t len);
     bool set(const std::string &key, int val);
+    bool set(const std::string &key, long val);
+    bool set(const std::string &key, long long val);
     bool set(const std::string &key, unsigned int val);
+    bool set(const std::string &key, unsigned long val);
+    bool set(const std::string &key, unsigned long long val);
     bool set(const std::string &key, double val);
     bool set(const std::string &key, bool val);
     bool set_nil(const std::string &key);
+    // msgpack bin and ext type.
+    bool set_bin(const std::string &key, const void *data, size_t len);
+    bool set_ext(const std::string &key, int8_t type, const void *data,
+                 size_t len);
+    bool set(const Key &key, const std::string &val);
+    bool set(const Key &key, const char *val);
+    bool set(const Key &key, std::string &&val);
+    bool set(const Key &key, const char *val, size_t len);
+    bool set(const Key &key, int val);
+    bool set(const Key &key, long val);
+    bool set(const Key &key, long long val);
+    bool set(const Key &key, unsigned int val);
+    bool set(const Key &key, unsigned long val);
+    bool set(const Key &key, unsigned long long val);
+    bool set(const Key &key, double val);
+    bool set(const Key &key, bool val);
+    bool set_nil(const Key &key);
     bool del(const std::string &key);
     Map *retain_map(const std::string &key);
     Array *retain_array(const std::string &key);
@@ -73,6 +126,7 @@ namespace fluent {
 
     // Convert to msgpack data format.
     void to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) const;
+    // Write a line of text by TextEncoder.
     void to_ostream(std::ostream &os) const;
     friend std::ostream& operator<<(std::ostream& os, const Message& msg) {
       msg.to_ostream(os);
@@ -83,26 +137,140 @@ namespace fluent {
     void attach(Message *next);
     Message* detach();
     Message* next() const { return this->next_; };
+    // Fields are shared with the clone and copied on modification, so
+    // cloning is cheap. Map and Array got by retain_map()/retain_array()
+    // before clone() must be retained again to modify them after that.
     Message* clone(Message *base=nullptr) const;
+    // Encode fields of tmpl before own fields. See Template.
+    void set_template(const Template *tmpl);
+    const Template* get_template() const { return this->tmpl_; }
+
+    // -----------------------------------------------------------------
+    // Builder class
+    // Encodes key and value into msgpack format directly as they are set,
+    // without creating Object. Encoded fields are emitted before fields of
+    // set(), so keys should not be duplicated among them, and can not be
+    // read by get(). To get the same data as Map, set keys in sorted order.
+    class Builder {
+      template <typename... T> friend class fluent::Schema;
+    private:
+      Message *msg_;
+      msgpack::packer<msgpack::sbuffer> pk_;
+      static msgpack::sbuffer* buffer(Message *msg, size_t reserve);
+      Builder& key(const std::string &key);
+      // Key already encoded in msgpack format.
+      Builder& packed_key(const std::string &packed);
+      Builder& value(const std::string &val);
+      Builder& value(const char *val);
+      Builder& value(int val);
+      Builder& value(long val);
+      Builder& value(long long val);
+      Builder& value(unsigned int val);
+      Builder& value(unsigned long val);
+      Builder& value(unsigned long long val);
+      Builder& value(double val);
+      Builder& value(bool val);
+      
+    public:
+      explicit Builder(Message *msg, size_t reserve=256);
+      Builder& set(const std::string &key, const std::string &val);
+      Builder& set(const std::string &key, const char *val);
+      Builder& set(const std::string &key, int val);
+      Builder& set(const std::string &key, long val);
+      Builder& set(const std::string &key, long long val);
+      Builder& set(const std::string &key, unsigned int val);
+      Builder& set(const std::string &key, unsigned long val);
+      Builder& set(const std::string &key, unsigned long long val);
+      Builder& set(const std::string &key, double val);
+      Builder& set(const std::string &key, bool val);
+      Builder& set_nil(const std::string &key);
+      size_t count() const { return this->msg_->raw_count_; }
+    };
+
+    // -----------------------------------------------------------------
+    // Key class
+    // Interned map key. It holds the key string with its msgpack encoding
+    // and hash, so set() with Key neither copies nor hashes the string,
+    // and to_msgpack() just copies the encoded bytes. Map compares Key by
+    // pointer first. Messages refer to Key without copying it, so Key must
+    // live longer than all messages using it, e.g. as a static constant.
+    class Key {
+    private:
+      std::string str_;
+      std::string packed_;
+      uint32_t hash_;
+      Key(const Key&);
+      Key& operator=(const Key&);
+
+    public:
+      explicit Key(const std::string &str);
+      const std::string& str() const { return this->str_; }
+      const std::string& packed() const { return this->packed_; }
+      uint32_t hash() const { return this->hash_; }
+    };
 
     // -----------------------------------------------------------------
     // Object class
     // Parent class for any object such as map, array, string, etc.
     class Object {
     public:
-      Object() {}
+      // Type tag of concrete class, used by is() and as() instead of
+      // RTTI.
+      enum Type {
+        MapType,
+        ArrayType,
+        StringType,
+        FixnumType,
+        UfixnumType,
+        FloatType,
+        BoolType,
+        BinaryType,
+        ExtType,
+        NilType,
+      };
+
+    private:
+      Type tag_;
+      // Reference count. Nested objects are shared among clones of Map
+      // and Array, and copied when modified (copy on write). Top level
+      // object returned by clone() or from_msgpack() is owned by caller
+      // and can be deleted as before.
+      mutable std::atomic<uint32_t> ref_;
+      friend class Message;
+      friend class Map;
+      friend class Array;
+      void retain() const {
+        this->ref_.fetch_add(1, std::memory_order_relaxed);
+      }
+      bool shared() const {
+        return this->ref_.load(std::memory_order_acquire) > 1;
+      }
+      static void release(const Object *obj) {
+        if (obj->ref_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          delete obj;
+        }
+      }
+
+    public:
+      explicit Object(Type tag) : tag_(tag), ref_(1) {}
       virtual ~Object() {}
+      // Type tag, not to be confused with the ext type of Ext::type().
+      Type tag() const { return this->tag_; }
+      // Decode one msgpack object from data[*offset] and move *offset
+      // forward. Return nullptr if the data is broken or not enough.
+      static Object* from_msgpack(const char *data, size_t len,
+                                  size_t *offset);
       virtual void to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) 
         const = 0;
-      virtual void to_ostream(std::ostream &os) const = 0;
+      // Write JSON text by TextEncoder, as Message::to_ostream().
+      void to_ostream(std::ostream &os) const;
       
       virtual Object* clone() const = 0;
       virtual bool has_value() const { return true; }
       virtual bool is_nil() const { return false; }
       template <typename T> const T& as() const {
-        const T* ptr = dynamic_cast<const T*>(this);
-        if (ptr) {
-          return *ptr;
+        if (this->is<T>()) {
+          return static_cast<const T&>(*this);
         } else {
           std::string msg = "Can not convert to ";
           msg += typeid(T).name();
@@ -110,39 +278,110 @@ namespace fluent {
         }
       }
       template <typename T> bool is() const {
-        const T* ptr = dynamic_cast<const T*>(this);
-        return (ptr != nullptr);
+        return (this->tag_ == T::TYPE);
       }      
     };
 
     // -----------------------------------------------------------------
     // Map class
     // Key value type data map, a.k.a. Hash map
+    // Entries are kept in a flat vector sorted by key. Records have a few
+    // dozen keys at most, so binary search on contiguous memory is faster
+    // than std::map and needs no node allocation per key.
+    // With InsertionOrder, entries are appended instead, and keys are
+    // found by hash: linear scan while the map is small, and open
+    // addressing index after it grows over INDEX_THRESHOLD.
     class Map : public Object {
+      friend class Message;
+      friend class fluent::Template;
+      friend class fluent::TextEncoder;
     private:
-      std::map<std::string, Object*> map_;
+      struct Entry {
+        // key is empty if ikey is set.
+        std::string key;
+        const Key *ikey;
+        uint32_t hash;
+        Object *val;
+        const std::string& name() const {
+          return this->ikey ? this->ikey->str() : this->key;
+        }
+      };
+      std::vector<Entry> map_;
+      KeyOrder order_;
+      // Value objects kept by clear() to be reused by set().
+      std::vector<Object*> spare_;
+      static const size_t SPARE_MAX;
+      template <typename T> T* reuse();
+      Object* new_fixnum(int64_t val);
+      Object* new_ufixnum(uint64_t val);
+      Object* new_float(double val);
+      Object* new_bool(bool val);
+      Object* new_string(const char *val, size_t len);
+      Object* new_string(std::string &&val);
+      void clear();
+      // Entry position + 1 for each slot, 0 means empty slot.
+      std::vector<uint32_t> index_;
       static const bool DBG;
+      static const size_t INDEX_THRESHOLD;
+      void pack_entries(msgpack::packer<msgpack::sbuffer> *pk) const;
+      // Return position of key, or where key should be inserted. ikey is
+      // optional and makes comparison and hashing cheaper.
+      size_t lookup(const std::string &key, const Key *ikey, uint32_t *hash,
+                    bool *found) const;
+      void insert(size_t pos, const std::string &key, const Key *ikey,
+                  uint32_t hash, Object *obj);
+      void rebuild_index();
+      bool set(const std::string &key, const Key *ikey, Object *obj);
 
     public:
-      Map();
+      static const Type TYPE = MapType;
+      explicit Map(KeyOrder order=SortedKeys);
       ~Map();
       Map *retain_map(const std::string &key);
       Array *retain_array(const std::string &key);
       bool set(const std::string &key, const std::string &val);
       bool set(const std::string &key, const char *val);
+      bool set(const std::string &key, std::string &&val);
+      bool set(const std::string &key, const char *val, size_t len);
       bool set(const std::string &key, int val);
+      bool set(const std::string &key, long val);
+      bool set(const std::string &key, long long val);
       bool set(const std::string &key, unsigned int val);
+      bool set(const std::string &key, unsigned long val);
+      bool set(const std::string &key, unsigned long long val);
       bool set(const std::string &key, double val);
       bool set(const std::string &key, bool val);
       bool set(const std::string &key, Object *obj);
       bool set_nil(const std::string &key);
+      bool set_bin(const std::string &key, const void *data, size_t len);
+      bool set_ext(const std::string &key, int8_t type, const void *data,
+                   size_t len);
+      bool set(const Key &key, const std::string &val);
+      bool set(const Key &key, const char *val);
+      bool set(const Key &key, std::string &&val);
+      bool set(const Key &key, const char *val, size_t len);
+      bool set(const Key &key, int val);
+      bool set(const Key &key, long val);
+      bool set(const Key &key, long long val);
+      bool set(const Key &key, unsigned int val);
+      bool set(const Key &key, unsigned long val);
+      bool set(const Key &key, unsigned long long val);
+      bool set(const Key &key, double val);
+      bool set(const Key &key, bool val);
+      bool set(const Key &key, Object *obj);
+      bool set_nil(const Key &key);
       bool del(const std::string &key);
       bool has_key(const std::string &key) const {
-        return (this->map_.find(key) != this->map_.end());
+        uint32_t h;
+        bool found;
+        this->lookup(key, nullptr, &h, &found);
+        return found;
       }
+      static uint32_t hash(const std::string &key);
       const Object& get(const std::string &key) const;
+      size_t size() const { return this->map_.size(); }
+      KeyOrder order() const { return this->order_; }
       void to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) const;
-      void to_ostream(std::ostream &os) const;      
       Object* clone() const;
     };
 
@@ -150,40 +389,54 @@ namespace fluent {
     // Array class
     // 
     class Array : public Object {
+      friend class fluent::TextEncoder;
       std::vector<Object*> array_;
+      // Key order of Map created by retain_map().
+      KeyOrder order_;
     public:
-      Array() {}
+      static const Type TYPE = ArrayType;
+      explicit Array(KeyOrder order=SortedKeys) :
+        Object(ArrayType), order_(order) {}
       ~Array();
       Map *retain_map();
       Array *retain_array();
       void push(const std::string &val);
       void push(const char *val);
+      void push(std::string &&val);
+      void push(const char *val, size_t len);
       void push(int val);
+      void push(long val);
+      void push(long long val);
       void push(unsigned int val);
+      void push(unsigned long val);
+      void push(unsigned long long val);
       void push(double val);
       void push(bool val);
       void push(Object *obj);
       void push_nil();
+      void push_bin(const void *data, size_t len);
+      void push_ext(int8_t type, const void *data, size_t len);
       size_t size() const { return this->array_.size(); }
       const Object& get(size_t idx) const;
       void to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) const;
-      void to_ostream(std::ostream &os) const;      
       Object* clone() const;
     };
 
     // -----------------------------------------------------------------
     // String class
-    // based on std::string
+    // based on std::string, that keeps short value inline (SSO) without
+    // heap allocation.
     class String : public Object {
+      friend class Map;
     private:
       std::string val_;
     public:
+      static const Type TYPE = StringType;
       String(const std::string &val);
       String(const char *val);
+      String(std::string &&val);
+      String(const char *val, size_t len);
       void to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) const;
-      void to_ostream(std::ostream &os) const {
-        os << '"' << this->val_ << '"';
-      }
       Object* clone() const { return new String(this->val_); }
       const std::string &val() const { return this->val_; }
     };
@@ -192,43 +445,45 @@ namespace fluent {
     // Fixed Number class
     // 
     class Fixnum : public Object {
+      friend class Map;
     private:
-      int val_;
+      int64_t val_;
       
     public:
-      Fixnum(int val);
-      Fixnum(unsigned int val);
+      static const Type TYPE = FixnumType;
+      Fixnum(int64_t val);
       void to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) const;
-      void to_ostream(std::ostream &os) const { os << this->val_; }
       Object* clone() const { return new Fixnum(this->val_); }
-      int val() const { return this->val_; }
+      int64_t val() const { return this->val_; }
     };
 
     // -----------------------------------------------------------------
     // Unsigned Fixed Number class
     // 
     class Ufixnum : public Object {
+      friend class Map;
     private:
-      unsigned int val_;
+      uint64_t val_;
       
     public:
-      Ufixnum(unsigned int val);
+      static const Type TYPE = UfixnumType;
+      Ufixnum(uint64_t val);
       void to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) const;
-      void to_ostream(std::ostream &os) const { os << this->val_; }
       Object* clone() const { return new Ufixnum(this->val_); }
-      unsigned int val() const { return this->val_; }
+      uint64_t val() const { return this->val_; }
     };
     
     // -----------------------------------------------------------------
     // Float Number Class
     // 
     class Float : public Object {
+      friend class Map;
     private:
       double val_;
     public:
+      static const Type TYPE = FloatType;
       Float(double val);
       void to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) const;
-      void to_ostream(std::ostream &os) const { os << this->val_; }
       Object* clone() const { return new Float(this->val_); }
       double val() const { return this->val_; }
     };
@@ -237,34 +492,86 @@ namespace fluent {
     // Boolean Class
     // 
     class Bool : public Object {
+      friend class Map;
     private:
       bool val_;
     public:
+      static const Type TYPE = BoolType;
       Bool(bool val);
       void to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) const;
-      void to_ostream(std::ostream &os) const { os << this->val_; }
       Object* clone() const { return new Bool(this->val_); }
       bool val() const { return this->val_; }
     };
 
+    // -----------------------------------------------------------------
+    // Binary Class
+    // msgpack bin type, raw bytes.
+    class Binary : public Object {
+    private:
+      std::string val_;
+    public:
+      static const Type TYPE = BinaryType;
+      Binary(const void *data, size_t len);
+      Binary(std::string &&val);
+      void to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) const;
+      Object* clone() const { return new Binary(this->val_.data(),
+                                                this->val_.size()); }
+      const std::string &val() const { return this->val_; }
+    };
+
+    // -----------------------------------------------------------------
+    // Ext Class
+    // msgpack ext type, application defined type and raw bytes.
+    class Ext : public Object {
+    private:
+      int8_t type_;
+      std::string data_;
+    public:
+      static const Type TYPE = ExtType;
+      Ext(int8_t type, const void *data, size_t len);
+      void to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) const;
+      Object* clone() const { return new Ext(this->type_, this->data_.data(),
+                                             this->data_.size()); }
+      int8_t type() const { return this->type_; }
+      const std::string &data() const { return this->data_; }
+    };
+
     // -----------------------------------------------------------------
     // Nil class
     // That should be used for only static & const instance.
     class Nil : public Object {
     public:
-      Nil() {};
+      static const Type TYPE = NilType;
+      Nil() : Object(NilType) {};
       ~Nil() {};
       void to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) const;
-      void to_ostream(std::ostream &os) const { os << "(nil)"; }
       Object* clone() const { return new Nil(); }
       bool is_nil() const { return true; }
     };
     
   private:    
+    friend class MessagePool;
+    friend class Template;
+    friend class TextEncoder;
+    friend class DumpReader;
+    // Take root map of reference count 1 for clone().
+    Message(const std::string &tag, Map *root);
+    // Drop fields keeping allocated memory for reuse by MessagePool, and
+    // renew it as a new message.
+    void clear();
+    void renew(const std::string &tag, KeyOrder order);
+    // Root map to modify, copied first if it is shared with clones.
+    Map* root();
     time_t ts_;
+    long ts_nsec_;
+    bool event_time_;
     std::string tag_;
     Map *root_;
     Message *next_;    
+    // Map entries encoded by Builder, without map header.
+    msgpack::sbuffer *raw_;
+    size_t raw_count_;
+    const Template *tmpl_;
   };
 }
 
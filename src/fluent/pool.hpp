@@ -0,0 +1,68 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __FLUENT_POOL_HPP__
+#define __FLUENT_POOL_HPP__
+
+#include <string>
+#include <atomic>
+#include "./message.hpp"
+
+namespace fluent {
+  // Free list of Message to recycle them between emitter workers and
+  // producer. Workers return sent messages by put() from any thread, and
+  // get() takes all of them at once by a single atomic exchange, so it
+  // needs no lock and is free from ABA problem. get() must be called by
+  // one thread at a time, Logger does it in retain_message().
+  // Returned messages keep memory of map entries, values and encoded
+  // buffer, so steady state logging does not allocate.
+  class MessagePool {
+  private:
+    // Pushed by put(), linked by Message::next_.
+    std::atomic<Message*> returned_;
+    // Taken from returned_, used only by get().
+    Message *free_;
+    std::atomic<size_t> count_;
+    std::atomic<size_t> limit_;
+    std::atomic<size_t> reused_;
+
+  public:
+    explicit MessagePool(size_t limit=1024);
+    ~MessagePool();
+    Message* get(const std::string &tag,
+                 Message::KeyOrder order=Message::SortedKeys);
+    // Take linked messages from root. Messages over the limit are deleted.
+    void put(Message *root);
+    // May be called while workers put() messages.
+    void set_limit(size_t limit) { this->limit_ = limit; }
+    // Number of pooled messages.
+    size_t count() const { return this->count_; }
+    // Number of messages reused by get().
+    size_t reused() const { return this->reused_; }
+  };
+}
+
+#endif   // __FLUENT_POOL_HPP__
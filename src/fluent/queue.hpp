@@ -28,7 +28,9 @@
 #define __FLUENT_QUEUE_HPP__
 
 #include <string>
+#include <atomic>
 #include <pthread.h>
+#include <time.h>
 #include "./message.hpp"
 
 namespace fluent {
@@ -58,7 +60,21 @@ namespace fluent {
     static const bool DBG;
     pthread_mutex_t mutex_;
     pthread_cond_t cond_;
+    pthread_cond_t drain_cond_;
     bool term_;
+    bool drain_;  // keep delivering after term() until abort()
+    bool abort_;
+    bool busy_;   // consumer is handling messages returned by bulk_pop()
+    int flushing_;  // number of threads waiting in wait_drain()
+    int linger_usec_;
+    size_t linger_count_;
+    struct timespec first_ts_;  // arrival of the oldest queued message
+    size_t batch_count() const;
+    bool parked_;   // consumer is sleeping on cond_
+    size_t spin_;
+    std::atomic<size_t> avail_;  // count() readable without lock
+    size_t signal_count_;
+    size_t park_count_;
     
   public:
     MsgThreadQueue();
@@ -66,9 +82,29 @@ namespace fluent {
     bool push(Message *msg);
     Message *bulk_pop();
     void set_limit(size_t limit);
+    // bulk_pop() waits up to linger_usec after the first message arrived
+    // until batch_count messages are queued. 0 disables lingering (default).
+    // batch_count 0 means the queue limit.
+    void set_linger(int linger_usec, size_t batch_count=0);
+    // bulk_pop() polls the empty queue up to spin iterations before
+    // sleeping. push() signals the consumer only when it is sleeping.
+    void set_spin(size_t spin);
+    // Number of wakeup signals sent to and sleeps of the consumer.
+    size_t signal_count();
+    size_t park_count();
     
-    void term();
-    bool is_term();    
+    // Stop accepting messages. If drain is false, the consumer is expected
+    // to give up delivery as soon as it can not write (see is_abort()).
+    void term(bool drain=false);
+    bool is_term();
+    // Tell the consumer to abandon remaining messages.
+    void abort();
+    bool is_abort();
+    // Sleep up to msec, wake up early when the queue is aborted.
+    bool wait_abort(int msec);
+    // Wait until the queue is empty and the consumer finished handling
+    // the last popped messages. Return false on timeout.
+    bool wait_drain(int timeout_msec);
   };
 }
 
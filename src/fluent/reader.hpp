@@ -0,0 +1,228 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __FLUENT_READER_HPP__
+#define __FLUENT_READER_HPP__
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <stdint.h>
+#include <time.h>
+#include "./message.hpp"
+
+namespace fluent {
+  class DumpIndex;
+
+  // DumpReader reads entries of [tag, time, record] from msgpack dumpfile
+  // written by Logger::new_dumpfile(). Regular file is mapped into memory
+  // and others, e.g. pipe, are read by chunk, and an entry is decoded only
+  // when it is requested, so the whole file is never decoded at once.
+  // next() returns a view of the entry without copy, and next_message()
+  // decodes it into Message.
+  //
+  // Incomplete entry at the end of file, e.g. one being written, is not
+  // an error but is reported by truncated(). Broken data stops reading
+  // and sets errmsg().
+  class DumpReader {
+  public:
+    // View of an entry, valid until the next call of next(),
+    // next_message() or close().
+    struct Entry {
+      const char *tag;
+      size_t tag_len;
+      time_t ts;
+      long ts_nsec;
+      bool event_time;
+      // msgpack map of record.
+      const char *record;
+      size_t record_len;
+      // Position and length of entry in the file.
+      uint64_t offset;
+      size_t size;
+    };
+
+  private:
+    const char *data_;
+    size_t size_;
+    // Position of next entry in data_, and offset of data_ in the file.
+    size_t pos_;
+    uint64_t base_;
+    // Mapped file, or buffer to read fd_ into.
+    void *map_;
+    size_t map_len_;
+    char *buf_;
+    size_t buf_cap_;
+    int fd_;
+    bool own_fd_;
+    bool eof_;
+    bool truncated_;
+    std::string errmsg_;
+    // Time range of set_time_range(), and spans of data to read in it.
+    bool ranged_;
+    time_t range_start_;
+    time_t range_end_;
+    std::vector<std::pair<uint64_t, uint64_t> > spans_;
+    size_t span_;
+    DumpReader(const DumpReader&);
+    DumpReader& operator=(const DumpReader&);
+
+    // Read more data from fd_ keeping data from pos_.
+    bool fill();
+    // Move to the next span of spans_ if pos_ is at the end of span.
+    bool next_span();
+    bool next_entry(Entry *entry);
+
+  public:
+    // An entry larger than this is an error when reading fd.
+    static const size_t ENTRY_MAX = 256 * 1024 * 1024;
+
+    DumpReader();
+    ~DumpReader();
+    bool open(const std::string &fname);
+    // Read from fd that is not closed by reader.
+    bool open(int fd);
+    // Read entries from memory that must live until close().
+    bool open(const char *data, size_t len);
+    void close();
+
+    // Read only entries of start <= time < end. With index of the file,
+    // data of blocks out of the range is skipped. index is used only for
+    // file or memory, not for fd, and is not kept by reader.
+    void set_time_range(time_t start, time_t end,
+                        const DumpIndex *index=nullptr);
+
+    // Return false at the end of data or if data is broken.
+    bool next(Entry *entry);
+    // Message of the next entry owned by caller, or nullptr as next().
+    Message* next_message();
+    // Message of entry, or nullptr if record has keys other than string.
+    static Message* decode(const Entry &entry);
+    // Set time and record of entry to msg, e.g. one got by
+    // Logger::retain_message(). Record is copied as encoded fields of
+    // Message::Builder without decoding, so fields can not be read by
+    // get() but are sent as they are.
+    static void load(const Entry &entry, Message *msg);
+    // Offset of the next entry in the file.
+    uint64_t offset() const { return this->base_ + this->pos_; }
+    bool truncated() const { return this->truncated_; }
+    const std::string& errmsg() const { return this->errmsg_; }
+  };
+
+  // DumpIndex reads sparse time index of dumpfile, written by FileEmitter
+  // as it appends to the file. Index is a header of MAGIC and then blocks
+  // of 32 bytes, offset and length of entries in the file and the minimum
+  // and maximum of their time, as big endian integers. A block is written
+  // after the entries of it are written, every N entries or when time of
+  // entry changes to another second, so entries at the end of the file
+  // may not be indexed yet.
+  class DumpIndex {
+  public:
+    struct Block {
+      uint64_t offset;
+      uint64_t length;
+      int64_t min_ts;
+      int64_t max_ts;
+    };
+    static const char MAGIC[8];
+    static const size_t BLOCK_SIZE = 32;
+    static void encode(const Block &block, char *buf);
+    static void decode(const char *buf, Block *block);
+
+  private:
+    std::vector<Block> blocks_;
+    // Maximum time of blocks from the first one, for binary search.
+    std::vector<int64_t> max_until_;
+    // Data not covered by blocks, and the end of blocks.
+    std::vector<std::pair<uint64_t, uint64_t> > gaps_;
+    uint64_t end_;
+    std::string errmsg_;
+
+  public:
+    DumpIndex() : end_(0) {}
+    bool open(const std::string &fname);
+    const std::vector<Block>& blocks() const { return this->blocks_; }
+    // Spans of [offset, end) in dumpfile of size that may have entries of
+    // start <= time < end, that are blocks of the time and data not
+    // covered by blocks, in order of file.
+    std::vector<std::pair<uint64_t, uint64_t> >
+    spans(time_t start, time_t end, uint64_t size) const;
+    const std::string& errmsg() const { return this->errmsg_; }
+  };
+
+  // DumpScanner scans a mapped dumpfile by byte ranges on worker threads.
+  // A range starts at the first entry boundary in it, where a few entries
+  // in a row can be parsed, and ends before the first entry beyond it.
+  // Start of each range is checked to be the end of the previous range
+  // before its entries are used, and the range is scanned again from
+  // there if not. So entries are exactly the ones DumpReader reads, even if
+  // a record contains bytes that look like entries, and stop at broken or
+  // truncated data in the same way.
+  class DumpScanner {
+  private:
+    const char *data_;
+    size_t size_;
+    void *map_;
+    size_t map_len_;
+    size_t threads_;
+    size_t range_size_;
+    size_t count_;
+    bool truncated_;
+    std::string errmsg_;
+    DumpScanner(const DumpScanner&);
+    DumpScanner& operator=(const DumpScanner&);
+
+    bool run(const std::function<void(const DumpReader::Entry&)> *handler,
+             const std::function<void(Message*)> *ordered);
+
+  public:
+    // threads 0 is the number of CPUs. Ranges in progress are kept up to
+    // twice of threads.
+    explicit DumpScanner(size_t threads=0,
+                         size_t range_size=4 * 1024 * 1024);
+    ~DumpScanner();
+    bool open(const std::string &fname);
+    // Scan memory that must live until close().
+    bool open(const char *data, size_t len);
+    void close();
+
+    // Call handler for each entry on worker threads, in no particular
+    // order. Entries are valid until close(). Return false if data is
+    // broken, after calling handler for all entries before it.
+    bool scan(const std::function<void(const DumpReader::Entry&)> &handler);
+    // Decode entries into Message on worker threads, and call handler with
+    // them in order of the file on the calling thread. Handler owns
+    // messages.
+    bool scan_ordered(const std::function<void(Message*)> &handler);
+    // Number of entries of the last scan.
+    size_t count() const { return this->count_; }
+    bool truncated() const { return this->truncated_; }
+    const std::string& errmsg() const { return this->errmsg_; }
+  };
+}
+
+#endif   // __FLUENT_READER_HPP__
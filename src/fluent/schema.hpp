@@ -0,0 +1,93 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __FLUENT_SCHEMA_HPP__
+#define __FLUENT_SCHEMA_HPP__
+
+#include <array>
+#include <string>
+#include <msgpack.hpp>
+#include "./message.hpp"
+
+namespace fluent {
+  // Schema declares keys of fixed-shape event with value types.
+  //
+  //   fluent::Schema<std::string, int, double> schema("url", "status",
+  //                                                    "latency_us");
+  //   schema.encode(msg, "/index.html", 200, 1.5);
+  //
+  // Keys are encoded into msgpack format once by constructor, so encode()
+  // just copies them and encodes values with Message::Builder. Available
+  // value types are the same as Message::Builder::set().
+  template <typename... T>
+  class Schema {
+  private:
+    std::array<std::string, sizeof...(T)> keys_;
+    size_t reserve_;
+
+    template <size_t I>
+    void put(Message::Builder *b) const {
+    }
+    template <size_t I, typename V, typename... Rest>
+    void put(Message::Builder *b, const V &val, const Rest&... rest) const {
+      b->packed_key(this->keys_[I]).value(val);
+      this->template put<I + 1>(b, rest...);
+    }
+
+  public:
+    template <typename... K>
+    explicit Schema(const K&... keys) : reserve_(0) {
+      static_assert(sizeof...(K) == sizeof...(T),
+                    "number of keys and types must be same");
+      const std::string k[] = {std::string(keys)...};
+      for (size_t i = 0; i < sizeof...(T); i++) {
+        msgpack::sbuffer buf;
+        msgpack::packer<msgpack::sbuffer> pk(&buf);
+        pk.pack_str(k[i].size());
+        pk.pack_str_body(k[i].data(), k[i].size());
+        this->keys_[i].assign(buf.data(), buf.size());
+        // key and roughly 16 bytes for value.
+        this->reserve_ += buf.size() + 16;
+      }
+    }
+
+    const std::string& packed_key(size_t idx) const {
+      return this->keys_[idx];
+    }
+    void encode(Message *msg, const T&... vals) const {
+      Message::Builder b(msg, this->reserve_);
+      this->template put<0>(&b, vals...);
+    }
+  };
+
+  // Keeps argument types of Logger::emit() with Schema out of deduction,
+  // so that e.g. string literal is accepted for std::string.
+  template <typename T> struct SchemaArg {
+    typedef T type;
+  };
+}
+
+#endif   // __FLUENT_SCHEMA_HPP__
@@ -0,0 +1,115 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __FLUENT_SERVER_HPP__
+#define __FLUENT_SERVER_HPP__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <functional>
+#include <pthread.h>
+#include "./message.hpp"
+#include "./queue.hpp"
+#include "./reader.hpp"
+
+namespace fluent {
+  // Receiver of forward protocol. A thread accepts connections and reads
+  // them by epoll (poll on other systems), decodes Message, Forward and
+  // PackedForward mode into Message, and answers ack when the option has
+  // chunk. CompressedPackedForward and handshake are not supported.
+  class ForwardServer {
+  public:
+    typedef std::function<void(Message *msg)> Handler;
+    typedef std::function<void(const DumpReader::Entry &entry)> EntryHandler;
+
+  private:
+    struct Conn;
+    class Poller;
+    static const bool DBG = false;
+    int listen_fd_;
+    int wake_fd_[2];    // stop() wakes up the loop by pipe.
+    pthread_t th_;
+    bool running_;
+    bool ack_;
+    Handler handler_;
+    EntryHandler entry_handler_;
+    MsgQueue *queue_;
+    Poller *poller_;
+    std::map<int, Conn*> conns_;
+    std::vector<DumpReader::Entry> entries_;
+    std::atomic<size_t> count_;
+    std::atomic<size_t> bytes_;
+    std::atomic<size_t> lost_;
+    std::atomic<size_t> broken_;
+    std::string errmsg_;
+    ForwardServer(const ForwardServer&);
+    ForwardServer& operator=(const ForwardServer&);
+
+    static void* run_thread(void *obj);
+    void loop();
+    void accept_conns();
+    bool read_conn(Conn *conn);
+    bool write_conn(Conn *conn);
+    void close_conn(Conn *conn);
+    bool decode(Conn *conn);
+    void deliver();
+
+  public:
+    ForwardServer();
+    ~ForwardServer();
+    // Bind and listen host:port. Port 0 takes a free port, see port().
+    bool listen(const std::string &host, int port=0);
+    int port() const;
+    // Handler owns messages, and is called on the server thread.
+    void set_handler(const Handler &handler) { this->handler_ = handler; }
+    // Push messages to q instead of handler. q must be MsgThreadQueue if
+    // other thread pops it. Messages are lost if q is full.
+    void set_queue(MsgQueue *q) { this->queue_ = q; }
+    // Call handler with entries instead of decoding them into messages.
+    // Entries are valid only in the call.
+    void set_entry_handler(const EntryHandler &handler) {
+      this->entry_handler_ = handler;
+    }
+    // Answer ack to chunk option (default true).
+    void set_ack(bool ack) { this->ack_ = ack; }
+    // Without any handler nor queue, entries are counted and dropped, as
+    // a sink for benchmark. Settings above must be done before start().
+    bool start();
+    void stop();
+    // Number of received entries, bytes, entries failed to deliver, and
+    // connections closed because of broken data.
+    size_t count() const { return this->count_; }
+    size_t bytes() const { return this->bytes_; }
+    size_t lost() const { return this->lost_; }
+    size_t broken() const { return this->broken_; }
+    // Valid after stop().
+    const std::string& errmsg() const { return this->errmsg_; }
+  };
+}
+
+#endif   // __FLUENT_SERVER_HPP__
@@ -28,22 +28,29 @@
 #define __FLUENT_SOCKET_HPP__
 
 #include <string>
+#include <atomic>
 
 namespace fluent {
   class Socket {
   private:
+    // A blocking write wakes up at this interval to check abort().
+    static const int SEND_TIMEOUT_MSEC;
     int sock_;
     std::string host_;
     std::string port_;
     std::string errmsg_;
     bool is_connected_;
+    std::atomic<bool> aborted_;
+    void close();
     
   public:
     Socket(const std::string &host, const std::string &port);
     ~Socket();
     bool connect();
     bool is_connected() const { return this->is_connected_; }
-    bool send(void *data, size_t len);
+    bool send(const void *data, size_t len);
+    // Make send() in progress give up. Can be called from other thread.
+    void abort() { this->aborted_ = true; }
     const std::string& errmsg() const { return this->errmsg_; }
   };
 
@@ -0,0 +1,73 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __FLUENT_TEMPLATE_HPP__
+#define __FLUENT_TEMPLATE_HPP__
+
+#include <string>
+#include <atomic>
+#include "./message.hpp"
+
+namespace fluent {
+  // Template is static part of records, e.g. host, region and build of the
+  // service, shared by many messages.
+  //
+  //   fluent::Message base("base");
+  //   base.set("host", "web01");
+  //   base.set("region", "ap-northeast-1");
+  //   const fluent::Template *tmpl = logger->new_template(base);
+  //   fluent::Message *msg = logger->retain_message("web.access", tmpl);
+  //   msg->set("status", 200);
+  //
+  // Fields of base message are encoded into msgpack format once by
+  // constructor, and to_msgpack() of the message copies them before own
+  // fields. Template fields can not be read by get(), and keys should not
+  // be set again to the message. Template is reference counted, messages
+  // using it hold a reference so that it lives until they are deleted.
+  class Template {
+  private:
+    std::string data_;
+    size_t count_;
+    mutable std::atomic<uint32_t> ref_;
+    ~Template() {}
+    Template(const Template&);
+    Template& operator=(const Template&);
+
+  public:
+    // Reference count is 1, release() it when not used any more.
+    explicit Template(const Message &base);
+    // Encoded map entries without map header.
+    const std::string& data() const { return this->data_; }
+    // Number of map entries.
+    size_t count() const { return this->count_; }
+    void retain() const {
+      this->ref_.fetch_add(1, std::memory_order_relaxed);
+    }
+    static void release(const Template *tmpl);
+  };
+}
+
+#endif   // __FLUENT_TEMPLATE_HPP__
@@ -0,0 +1,147 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __FLUENT_TEXT_HPP__
+#define __FLUENT_TEXT_HPP__
+
+#include <string>
+#include <string.h>
+#include <time.h>
+#include "./message.hpp"
+
+namespace fluent {
+  // TextEncoder writes messages as lines of text into a reusable buffer.
+  //
+  //   2017-12-30T11:29:55+00:00<TAB>tag<TAB>{"key": "value", "n": 1}<LF>
+  //
+  // Record is JSON. Strings are escaped, integers and floating point
+  // numbers are formatted without stream and locale, and floating point
+  // numbers are the shortest ones that read back to the same value.
+  // Fields are written in the same order as to_msgpack(). bin and ext
+  // values are written as strings of their bytes, and NaN or infinity
+  // as null. Invalid UTF-8 bytes in strings are replaced with U+FFFD.
+  // Buffer is kept by clear(), so steady state encoding does not
+  // allocate, and date and time are formatted only when the second
+  // changes.
+  //
+  // encode_json() writes a line of JSON (NDJSON) and encode_ltsv() a line
+  // of LTSV instead, see below.
+  class TextEncoder {
+  private:
+    char *buf_;
+    size_t size_;
+    size_t cap_;
+    // "YYYY-MM-DDTHH:MM:SS" of time_sec_, formatted once for each second.
+    // Years out of 0-9999 take more digits.
+    time_t time_sec_;
+    bool time_valid_;
+    char time_[40];
+    size_t time_len_;
+    TextEncoder(const TextEncoder&);
+    TextEncoder& operator=(const TextEncoder&);
+
+    void grow(size_t need);
+    char* reserve(size_t len) {
+      if (this->size_ + len > this->cap_) {
+        this->grow(this->size_ + len);
+      }
+      return this->buf_ + this->size_;
+    }
+    void put(char c) {
+      *this->reserve(1) = c;
+      this->size_++;
+    }
+    void put(const char *data, size_t len) {
+      memcpy(this->reserve(len), data, len);
+      this->size_ += len;
+    }
+    void put_int(int64_t val);
+    void put_uint(uint64_t val);
+    void put_double(double val);
+    void put_string(const char *data, size_t len);
+    // "key": of map entry.
+    void put_key(const std::string &key);
+    void put_time(time_t sec, long nsec, bool event_time);
+    void put_object(const Message::Object *obj);
+    // Bytes of LTSV label or value, with TAB, LF, CR and backslash escaped.
+    // ':' of label is replaced with '_' as it ends the label.
+    void put_ltsv(const char *data, size_t len, bool label = false);
+    // LTSV value of object: string as it is and others as JSON.
+    void put_ltsv_object(const Message::Object *obj);
+    const char* put_ltsv_packed(const char *p, const char *end, bool label);
+    // Transcode msgpack data, return position after the object or nullptr
+    // if data is broken.
+    const char* put_packed(const char *p, const char *end, int depth);
+    // Map key, quoted as JSON string if it is not a string.
+    const char* put_packed_key(const char *p, const char *end, int depth);
+    // Transcode count map entries without map header.
+    bool put_packed_entries(const char *data, size_t len, size_t count,
+                            bool ltsv, bool *first);
+    // Fields of message, as entries of JSON object or LTSV fields. Return
+    // false if encoded fields of Template or Builder are broken.
+    bool put_fields(const Message &msg, bool ltsv);
+
+  public:
+    // Strings are scanned by block for bytes to escape and non-ASCII bytes
+    // to validate, with SIMD instructions selected by CPU at runtime.
+    enum Scanner {
+      ScalarScanner,
+      SSE2Scanner,
+      AVX2Scanner,
+    };
+    // Select scanner for all encoders, e.g. for tests and benchmark.
+    // Return false if CPU does not support it.
+    static bool set_scanner(Scanner scanner);
+    static Scanner scanner();
+
+    explicit TextEncoder(size_t reserve=4096);
+    ~TextEncoder();
+    // Append a line of message. Nothing is appended and false is returned
+    // if encoded fields of Template or Builder are broken. So are
+    // encode_json() and encode_ltsv().
+    bool encode(const Message &msg);
+    // Append a line of JSON, tag and time are set to "tag" and "time"
+    // and fields to "record".
+    //
+    //   {"tag": "tag", "time": "2017-12-30T11:29:55+00:00",
+    //    "record": {"key": "value", "n": 1}}<LF>
+    bool encode_json(const Message &msg);
+    // Append a line of LTSV, labeled "time" and "tag" and then fields.
+    // Strings are written as they are except TAB, LF, CR and backslash,
+    // which are escaped as \t, \n, \r and \\, and other values as JSON.
+    // ':' in labels is replaced with '_'.
+    //
+    //   time:2017-12-30T11:29:55+00:00<TAB>tag:tag<TAB>key:value<TAB>n:1<LF>
+    bool encode_ltsv(const Message &msg);
+    // Append JSON text of object.
+    void encode(const Message::Object &obj);
+    const char* data() const { return this->buf_; }
+    size_t size() const { return this->size_; }
+    void clear() { this->size_ = 0; }
+  };
+}
+
+#endif   // __FLUENT_TEXT_HPP__
@@ -33,10 +33,12 @@
 #include "./fluent/logger.hpp"
 #include "./fluent/message.hpp"
 #include "./fluent/emitter.hpp"
+#include "./fluent/pool.hpp"
 #include "./debug.h"
 
 namespace fluent {
-  Logger::Logger() {
+  Logger::Logger() :
+    key_order_(Message::SortedKeys), event_time_(false), pool_(nullptr) {
 #ifdef _WIN32
 #ifndef FLUENTSKIPSTARTWINSOCK
     WORD wVersionRequested;
@@ -54,6 +56,10 @@ namespace fluent {
     for (size_t i = 0; i < this->emitter_.size(); i++) {
       delete this->emitter_[i];
     }
+    // Workers of emitters may return messages until they are deleted.
+    delete this->pool_;
+    std::for_each(this->template_.begin(), this->template_.end(),
+                  [](const Template *x) { Template::release(x); });
     std::for_each(this->queue_.begin(), this->queue_.end(),
                   [](MsgQueue* const &x) { delete x; });
 
@@ -66,50 +72,100 @@ namespace fluent {
 
   void Logger::new_forward(const std::string &host, int port) {
     Emitter *e = new InetEmitter(host, port);
-    this->emitter_.push_back(e);
+    this->add_emitter(e);
   }
   void Logger::new_forward(const std::string &host, const std::string &port) {
     Emitter *e = new InetEmitter(host, port);
-    this->emitter_.push_back(e);
+    this->add_emitter(e);
   }
   void Logger::new_dumpfile(const std::string &fname) {
     Emitter *e = new FileEmitter(fname, FileEmitter::MsgPack);
-    this->emitter_.push_back(e);
+    this->add_emitter(e);
   }
   void Logger::new_dumpfile(int fd) {
     Emitter *e = new FileEmitter(fd, FileEmitter::MsgPack);
-    this->emitter_.push_back(e);
+    this->add_emitter(e);
+  }
+  void Logger::new_dumpfile(const std::string &fname,
+                            const std::string &index_fname,
+                            size_t index_every) {
+    Emitter *e = new FileEmitter(fname, FileEmitter::MsgPack, index_fname,
+                                 index_every);
+    this->add_emitter(e);
   }
   void Logger::new_textfile(const std::string &fname) {
     Emitter *e = new FileEmitter(fname, FileEmitter::Text);
-    this->emitter_.push_back(e);
+    this->add_emitter(e);
   }
   void Logger::new_textfile(int fd) {
     Emitter *e = new FileEmitter(fd, FileEmitter::Text);
+    this->add_emitter(e);
+  }
+  void Logger::new_jsonfile(const std::string &fname) {
+    Emitter *e = new FileEmitter(fname, FileEmitter::Json);
+    this->add_emitter(e);
+  }
+  void Logger::new_jsonfile(int fd) {
+    Emitter *e = new FileEmitter(fd, FileEmitter::Json);
+    this->add_emitter(e);
+  }
+  void Logger::new_ltsvfile(const std::string &fname) {
+    Emitter *e = new FileEmitter(fname, FileEmitter::Ltsv);
+    this->add_emitter(e);
+  }
+  void Logger::new_ltsvfile(int fd) {
+    Emitter *e = new FileEmitter(fd, FileEmitter::Ltsv);
+    this->add_emitter(e);
+  }
+  void Logger::add_emitter(Emitter *e) {
+    if (this->pool_) {
+      e->set_pool(this->pool_);
+    }
     this->emitter_.push_back(e);
   }
+
   MsgQueue* Logger::new_msgqueue() {
     MsgQueue *q = new MsgQueue();
     this->queue_.push_back(q);
     Emitter *e = new QueueEmitter(q);
-    this->emitter_.push_back(e);
+    this->add_emitter(e);
     return q;
   }
   
   
-  Message* Logger::retain_message(const std::string &tag) {
+  Message* Logger::new_message(const std::string &tag) const {
     Message *msg;
     if (this->tag_prefix_.empty()) {
-      msg = new Message(tag);
+      msg = this->pool_ ? this->pool_->get(tag, this->key_order_) :
+        new Message(tag, this->key_order_);
     } else {
       std::string cattag = this->tag_prefix_ + "." + tag;
-      msg = new Message(cattag);
+      msg = this->pool_ ? this->pool_->get(cattag, this->key_order_) :
+        new Message(cattag, this->key_order_);
     }
+    msg->set_event_time(this->event_time_);
+    return msg;
+  }
 
+  Message* Logger::retain_message(const std::string &tag) {
+    Message *msg = this->new_message(tag);
     this->msg_set_.insert(msg);
     return msg;
   }
 
+  const Template* Logger::new_template(const Message &base) {
+    Template *tmpl = new Template(base);
+    this->template_.push_back(tmpl);
+    return tmpl;
+  }
+
+  Message* Logger::retain_message(const std::string &tag,
+                                  const Template *tmpl) {
+    Message *msg = this->new_message(tag);
+    msg->set_template(tmpl);
+    this->msg_set_.insert(msg);
+    return msg;
+  }
 
   bool Logger::emit(Message *msg) {
     if (this->msg_set_.find(msg) == this->msg_set_.end()) {
@@ -119,7 +175,10 @@ namespace fluent {
     }
 
     this->msg_set_.erase(msg);
+    return this->dispatch(msg);
+  }
 
+  bool Logger::dispatch(Message *msg) {
     bool rc = true;
     if (this->emitter_.size() == 1) {
       rc = this->emitter_[0]->emit(msg);
@@ -131,7 +190,11 @@ namespace fluent {
       rc &= this->emitter_[this->emitter_.size() - 1]->emit(msg);
     } else {
       // no output
-      delete msg;
+      if (this->pool_) {
+        this->pool_->put(msg);
+      } else {
+        delete msg;
+      }
     }
     
     return rc;
@@ -143,7 +206,83 @@ namespace fluent {
     }
   }
 
+  void Logger::set_linger(int linger_usec, size_t batch_count,
+                          size_t batch_bytes) {
+    for (size_t i = 0; i < this->emitter_.size(); i++) {
+      this->emitter_[i]->set_linger(linger_usec, batch_count, batch_bytes);
+    }
+  }
+
+  void Logger::set_spin(size_t spin) {
+    for (size_t i = 0; i < this->emitter_.size(); i++) {
+      this->emitter_[i]->set_spin(spin);
+    }
+  }
+
   void Logger::set_tag_prefix(const std::string &tag_prefix) {
     this->tag_prefix_ = tag_prefix;
   }
+
+  void Logger::set_key_order(Message::KeyOrder order) {
+    this->key_order_ = order;
+  }
+
+  void Logger::set_event_time(bool enable) {
+    this->event_time_ = enable;
+  }
+
+  void Logger::set_pool_size(size_t size) {
+    if (this->pool_ == nullptr) {
+      this->pool_ = new MessagePool(size);
+    } else {
+      this->pool_->set_limit(size);
+    }
+    for (size_t i = 0; i < this->emitter_.size(); i++) {
+      this->emitter_[i]->set_pool(this->pool_);
+    }
+  }
+
+  static int remaining_msec(const struct timeval &start, int timeout_msec) {
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    long elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+      (now.tv_usec - start.tv_usec) / 1000;
+    return (elapsed < timeout_msec) ?
+      static_cast<int>(timeout_msec - elapsed) : 0;
+  }
+
+  bool Logger::flush(int timeout_msec, size_t *lost) {
+    struct timeval start;
+    gettimeofday(&start, nullptr);
+
+    // All workers are running in parallel, so waiting for them one by one
+    // with the same deadline is enough.
+    bool rc = true;
+    for (size_t i = 0; i < this->emitter_.size(); i++) {
+      int remain = remaining_msec(start, timeout_msec);
+      rc &= this->emitter_[i]->flush(remain);
+    }
+
+    if (lost) {
+      *lost = this->lost();
+    }
+    return rc;
+  }
+
+  size_t Logger::shutdown(int timeout_msec) {
+    this->flush(timeout_msec);
+    size_t lost = 0;
+    for (size_t i = 0; i < this->emitter_.size(); i++) {
+      lost += this->emitter_[i]->shutdown(0);
+    }
+    return lost;
+  }
+
+  size_t Logger::lost() const {
+    size_t lost = 0;
+    for (size_t i = 0; i < this->emitter_.size(); i++) {
+      lost += this->emitter_[i]->lost();
+    }
+    return lost;
+  }
 }
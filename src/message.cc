@@ -26,73 +26,241 @@
 
 #include <time.h>
 #include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
 #include "./fluent/message.hpp"
+#include "./fluent/template.hpp"
+#include "./fluent/text.hpp"
 #include "./debug.h"
+#include "./scan.h"
 
 namespace fluent {
-  Message::Message(const std::string &tag) :
-    tag_(tag), root_(new Map()), next_(nullptr) {
-    this->ts_ = time(nullptr);
+  Message::Message(const std::string &tag, KeyOrder order) :
+    event_time_(false), tag_(tag), root_(new Map(order)), next_(nullptr),
+    raw_(nullptr), raw_count_(0), tmpl_(nullptr) {
+    Message::now(&this->ts_, &this->ts_nsec_);
+  };
+  Message::Message(const std::string &tag, Map *root) :
+    event_time_(false), tag_(tag), root_(root), next_(nullptr),
+    raw_(nullptr), raw_count_(0), tmpl_(nullptr) {
+    Message::now(&this->ts_, &this->ts_nsec_);
   };
   Message::~Message() {
-    delete this->root_;
+    Object::release(this->root_);
+    delete this->raw_;
+    Template::release(this->tmpl_);
     delete this->next_;
   }
 
+  Message::Map* Message::root() {
+    // Copy on write: root map is shared with clones until modified.
+    if (this->root_->shared()) {
+      Map *map = static_cast<Map*>(this->root_->clone());
+      Object::release(this->root_);
+      this->root_ = map;
+    }
+    return this->root_;
+  }
+
+  void Message::clear() {
+    assert(this->next_ == nullptr);
+    if (this->root_->shared()) {
+      KeyOrder order = this->root_->order_;
+      Object::release(this->root_);
+      this->root_ = new Map(order);
+    } else {
+      this->root_->clear();
+    }
+    if (this->raw_) {
+      this->raw_->clear();
+    }
+    this->raw_count_ = 0;
+    Template::release(this->tmpl_);
+    this->tmpl_ = nullptr;
+    this->event_time_ = false;
+  }
+
+  void Message::renew(const std::string &tag, KeyOrder order) {
+    this->tag_ = tag;
+    this->root_->order_ = order;
+    Message::now(&this->ts_, &this->ts_nsec_);
+  }
+
   void Message::set_ts(time_t ts) {
     this->ts_ = ts;
+    this->ts_nsec_ = 0;
+  }
+  void Message::set_ts(time_t sec, long nsec) {
+    this->ts_ = sec;
+    this->ts_nsec_ = nsec;
+  }
+
+  void Message::now(time_t *sec, long *nsec) {
+#if defined(CLOCK_REALTIME_COARSE)
+    // Linux: read from vDSO without syscall, updated every tick.
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    *sec = ts.tv_sec;
+    *nsec = ts.tv_nsec;
+#elif defined(CLOCK_REALTIME)
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    *sec = ts.tv_sec;
+    *nsec = ts.tv_nsec;
+#else
+    *sec = time(nullptr);
+    *nsec = 0;
+#endif
   }
   
   bool Message::set(const std::string &key, const std::string &val) {
-    return this->root_->set(key, val);
+    return this->root()->set(key, val);
   }
   bool Message::set(const std::string &key, const char *val){
-    return this->root_->set(key, val);
+    return this->root()->set(key, val);
+  }
+  bool Message::set(const std::string &key, std::string &&val) {
+    return this->root()->set(key, std::move(val));
+  }
+  bool Message::set(const std::string &key, const char *val, size_t len) {
+    return this->root()->set(key, val, len);
   }
   bool Message::set(const std::string &key, int val){
-    return this->root_->set(key, val);
+    return this->root()->set(key, val);
+  }
+  bool Message::set(const std::string &key, long val) {
+    return this->root()->set(key, val);
+  }
+  bool Message::set(const std::string &key, long long val) {
+    return this->root()->set(key, val);
+  }
+  bool Message::set(const std::string &key, unsigned long val) {
+    return this->root()->set(key, val);
+  }
+  bool Message::set(const std::string &key, unsigned long long val) {
+    return this->root()->set(key, val);
+  }
+  bool Message::set_bin(const std::string &key, const void *data,
+                        size_t len) {
+    return this->root()->set_bin(key, data, len);
+  }
+  bool Message::set_ext(const std::string &key, int8_t type,
+                        const void *data, size_t len) {
+    return this->root()->set_ext(key, type, data, len);
   }
   bool Message::set(const std::string &key, unsigned int val){
-    return this->root_->set(key, val);
+    return this->root()->set(key, val);
   }
   bool Message::set(const std::string &key, double val){
-    return this->root_->set(key, val);
+    return this->root()->set(key, val);
   }
   bool Message::set(const std::string &key, bool val){
-    return this->root_->set(key, val);
+    return this->root()->set(key, val);
   }
   bool Message::set_nil(const std::string &key){
-    return this->root_->set_nil(key);
+    return this->root()->set_nil(key);
+  }
+  bool Message::set(const Key &key, const std::string &val) {
+    return this->root()->set(key, val);
+  }
+  bool Message::set(const Key &key, const char *val) {
+    return this->root()->set(key, val);
+  }
+  bool Message::set(const Key &key, std::string &&val) {
+    return this->root()->set(key, std::move(val));
+  }
+  bool Message::set(const Key &key, const char *val, size_t len) {
+    return this->root()->set(key, val, len);
+  }
+  bool Message::set(const Key &key, int val) {
+    return this->root()->set(key, val);
+  }
+  bool Message::set(const Key &key, long val) {
+    return this->root()->set(key, val);
+  }
+  bool Message::set(const Key &key, long long val) {
+    return this->root()->set(key, val);
+  }
+  bool Message::set(const Key &key, unsigned long val) {
+    return this->root()->set(key, val);
+  }
+  bool Message::set(const Key &key, unsigned long long val) {
+    return this->root()->set(key, val);
+  }
+  bool Message::set(const Key &key, unsigned int val) {
+    return this->root()->set(key, val);
+  }
+  bool Message::set(const Key &key, double val) {
+    return this->root()->set(key, val);
+  }
+  bool Message::set(const Key &key, bool val) {
+    return this->root()->set(key, val);
+  }
+  bool Message::set_nil(const Key &key) {
+    return this->root()->set_nil(key);
   }
   bool Message::del(const std::string &key){
-    return this->root_->del(key);
+    return this->root()->del(key);
   }
   Message::Map* Message::retain_map(const std::string &key) {
-    return this->root_->retain_map(key);
+    return this->root()->retain_map(key);
   }
   Message::Array* Message::retain_array(const std::string &key) { 
-    return this->root_->retain_array(key);
+    return this->root()->retain_array(key);
   }
 
   
   void Message::to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) const {
     pk->pack_array(3);          // [?, ?, ?]
     pk->pack(this->tag_);       // [tag, ?, ?]
-    pk->pack(this->ts_);        // [tag, timestamp, ?]
-    this->root_->to_msgpack(pk);
+    if (this->event_time_) {
+      // EventTime: fixext8 of 32bit seconds and nanoseconds, big endian.
+      char buf[8];
+      uint32_t sec = static_cast<uint32_t>(this->ts_);
+      uint32_t nsec = static_cast<uint32_t>(this->ts_nsec_);
+      for (int i = 0; i < 4; i++) {
+        buf[i] = static_cast<char>(sec >> (24 - i * 8));
+        buf[4 + i] = static_cast<char>(nsec >> (24 - i * 8));
+      }
+      pk->pack_ext(sizeof(buf), 0);
+      pk->pack_ext_body(buf, sizeof(buf));
+    } else {
+      pk->pack(this->ts_);      // [tag, timestamp, ?]
+    }
+    if (this->raw_ || this->tmpl_) {
+      // Encoded fields of Template and Builder first, and then fields of
+      // Map.
+      size_t count = this->raw_count_ + this->root_->size();
+      if (this->tmpl_) {
+        count += this->tmpl_->count();
+      }
+      pk->pack_map(count);
+      if (this->tmpl_) {
+        pk->pack_str_body(this->tmpl_->data().data(),
+                          this->tmpl_->data().size());
+      }
+      if (this->raw_) {
+        pk->pack_str_body(this->raw_->data(), this->raw_->size());
+      }
+      this->root_->pack_entries(pk);
+    } else {
+      this->root_->to_msgpack(pk);
+    }
     return ;
   }
   void Message::to_ostream(std::ostream &os) const {
-    struct tm time;
-    gmtime_r(&(this->ts_), &time);
-    char buf[128];
-    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S+00:00", &time);
+    TextEncoder enc(0);
+    enc.encode(*this);
+    os.write(enc.data(), enc.size());
+  }
 
-    os << buf << "\t" << this->tag_ << "\t";
-    this->root_->to_ostream(os);
-    os << "\n";
+  void Message::Object::to_ostream(std::ostream &os) const {
+    TextEncoder enc(0);
+    enc.encode(*this);
+    os.write(enc.data(), enc.size());
   }
-  
+
   void Message::attach(Message *next) {
     assert(this->next_ == nullptr);
     this->next_ = next;
@@ -107,62 +275,439 @@ namespace fluent {
   }
 
   Message* Message::clone(Message *base) const {
-    Message *msg = new Message(this->tag_);
+    // Share root map, it is copied when either message is modified.
+    this->root_->retain();
+    Message *msg = new Message(this->tag_, this->root_);
     if (this->next_) {
       this->next_->clone(msg);
     }
     if (base) {
       base->attach(msg);
     }
-    msg->set_ts(this->ts_);
-
-    delete msg->root_;
-    msg->root_ = dynamic_cast<Map*>(this->root_->clone());
+    msg->set_ts(this->ts_, this->ts_nsec_);
+    msg->event_time_ = this->event_time_;
+    if (this->raw_) {
+      msg->raw_ = new msgpack::sbuffer(this->raw_->size());
+      msg->raw_->write(this->raw_->data(), this->raw_->size());
+      msg->raw_count_ = this->raw_count_;
+    }
+    msg->set_template(this->tmpl_);
     return msg;
   }
 
+  void Message::set_template(const Template *tmpl) {
+    if (tmpl) {
+      tmpl->retain();
+    }
+    Template::release(this->tmpl_);
+    this->tmpl_ = tmpl;
+  }
+
+  
+  Message::Key::Key(const std::string &str) :
+    str_(str), hash_(Map::hash(str)) {
+    msgpack::sbuffer buf;
+    msgpack::packer<msgpack::sbuffer> pk(&buf);
+    pk.pack_str(str.size());
+    pk.pack_str_body(str.data(), str.size());
+    this->packed_.assign(buf.data(), buf.size());
+  }
+
+  
+  msgpack::sbuffer* Message::Builder::buffer(Message *msg, size_t reserve) {
+    if (msg->raw_ == nullptr) {
+      msg->raw_ = new msgpack::sbuffer(reserve);
+    }
+    return msg->raw_;
+  }
+  Message::Builder::Builder(Message *msg, size_t reserve) :
+    msg_(msg), pk_(buffer(msg, reserve)) {
+  }
+  Message::Builder& Message::Builder::key(const std::string &key) {
+    this->msg_->raw_count_++;
+    this->pk_.pack_str(key.size());
+    this->pk_.pack_str_body(key.data(), key.size());
+    return *this;
+  }
+  Message::Builder& Message::Builder::packed_key(const std::string &packed) {
+    this->msg_->raw_count_++;
+    this->pk_.pack_str_body(packed.data(), packed.size());
+    return *this;
+  }
+  Message::Builder& Message::Builder::value(const std::string &val) {
+    this->pk_.pack_str(val.size());
+    this->pk_.pack_str_body(val.data(), val.size());
+    return *this;
+  }
+  Message::Builder& Message::Builder::value(const char *val) {
+    size_t len = strlen(val);
+    this->pk_.pack_str(len);
+    this->pk_.pack_str_body(val, len);
+    return *this;
+  }
+  Message::Builder& Message::Builder::value(int val) {
+    this->pk_.pack(val);
+    return *this;
+  }
+  Message::Builder& Message::Builder::value(long val) {
+    this->pk_.pack(val);
+    return *this;
+  }
+  Message::Builder& Message::Builder::value(long long val) {
+    this->pk_.pack(val);
+    return *this;
+  }
+  Message::Builder& Message::Builder::value(unsigned long val) {
+    this->pk_.pack(val);
+    return *this;
+  }
+  Message::Builder& Message::Builder::value(unsigned long long val) {
+    this->pk_.pack(val);
+    return *this;
+  }
+  Message::Builder& Message::Builder::value(unsigned int val) {
+    this->pk_.pack(val);
+    return *this;
+  }
+  Message::Builder& Message::Builder::value(double val) {
+    this->pk_.pack(val);
+    return *this;
+  }
+  Message::Builder& Message::Builder::value(bool val) {
+    this->pk_.pack(val);
+    return *this;
+  }
+
+  Message::Builder& Message::Builder::set(const std::string &key,
+                                          const std::string &val) {
+    return this->key(key).value(val);
+  }
+  Message::Builder& Message::Builder::set(const std::string &key,
+                                          const char *val) {
+    return this->key(key).value(val);
+  }
+  Message::Builder& Message::Builder::set(const std::string &key, int val) {
+    return this->key(key).value(val);
+  }
+  Message::Builder& Message::Builder::set(const std::string &key,
+                                          long val) {
+    return this->key(key).value(val);
+  }
+  Message::Builder& Message::Builder::set(const std::string &key,
+                                          long long val) {
+    return this->key(key).value(val);
+  }
+  Message::Builder& Message::Builder::set(const std::string &key,
+                                          unsigned long val) {
+    return this->key(key).value(val);
+  }
+  Message::Builder& Message::Builder::set(const std::string &key,
+                                          unsigned long long val) {
+    return this->key(key).value(val);
+  }
+  Message::Builder& Message::Builder::set(const std::string &key,
+                                          unsigned int val) {
+    return this->key(key).value(val);
+  }
+  Message::Builder& Message::Builder::set(const std::string &key,
+                                          double val) {
+    return this->key(key).value(val);
+  }
+  Message::Builder& Message::Builder::set(const std::string &key, bool val) {
+    return this->key(key).value(val);
+  }
+  Message::Builder& Message::Builder::set_nil(const std::string &key) {
+    this->key(key);
+    this->pk_.pack_nil();
+    return *this;
+  }
+
+
+  // Encode object by switch on type tag. Scalar values are packed here
+  // without virtual call, and only containers go through to_msgpack().
+  static void pack_object(const Message::Object *obj,
+                          msgpack::packer<msgpack::sbuffer> *pk) {
+    switch (obj->tag()) {
+      case Message::Object::StringType: {
+        const std::string &v = static_cast<const Message::String*>(obj)
+          ->val();
+        pk->pack_str(v.size());
+        pk->pack_str_body(v.data(), v.size());
+        break;
+      }
+      case Message::Object::FixnumType:
+        pk->pack_int64(static_cast<const Message::Fixnum*>(obj)->val());
+        break;
+      case Message::Object::UfixnumType:
+        pk->pack_uint64(static_cast<const Message::Ufixnum*>(obj)->val());
+        break;
+      case Message::Object::FloatType:
+        pk->pack_double(static_cast<const Message::Float*>(obj)->val());
+        break;
+      case Message::Object::BoolType:
+        if (static_cast<const Message::Bool*>(obj)->val()) {
+          pk->pack_true();
+        } else {
+          pk->pack_false();
+        }
+        break;
+      case Message::Object::NilType:
+        pk->pack_nil();
+        break;
+      default:
+        obj->to_msgpack(pk);
+        break;
+    }
+  }
 
   
   const bool Message::Map::DBG(false);
-  Message::Map::Map() {
+  const size_t Message::Map::INDEX_THRESHOLD = 8;
+  const size_t Message::Map::SPARE_MAX = 64;
+
+  template <typename T> T* Message::Map::reuse() {
+    for (size_t i = this->spare_.size(); i > 0; i--) {
+      if (this->spare_[i - 1]->is<T>()) {
+        T *obj = static_cast<T*>(this->spare_[i - 1]);
+        this->spare_[i - 1] = this->spare_.back();
+        this->spare_.pop_back();
+        return obj;
+      }
+    }
+    return nullptr;
+  }
+
+  Message::Object* Message::Map::new_fixnum(int64_t val) {
+    Fixnum *obj = this->reuse<Fixnum>();
+    if (obj == nullptr) {
+      return new Fixnum(val);
+    }
+    obj->val_ = val;
+    return obj;
+  }
+  Message::Object* Message::Map::new_ufixnum(uint64_t val) {
+    Ufixnum *obj = this->reuse<Ufixnum>();
+    if (obj == nullptr) {
+      return new Ufixnum(val);
+    }
+    obj->val_ = val;
+    return obj;
+  }
+  Message::Object* Message::Map::new_float(double val) {
+    Float *obj = this->reuse<Float>();
+    if (obj == nullptr) {
+      return new Float(val);
+    }
+    obj->val_ = val;
+    return obj;
+  }
+  Message::Object* Message::Map::new_bool(bool val) {
+    Bool *obj = this->reuse<Bool>();
+    if (obj == nullptr) {
+      return new Bool(val);
+    }
+    obj->val_ = val;
+    return obj;
+  }
+  Message::Object* Message::Map::new_string(const char *val, size_t len) {
+    String *obj = this->reuse<String>();
+    if (obj == nullptr) {
+      return new String(val, len);
+    }
+    // assign() keeps capacity of the string.
+    obj->val_.assign(val, len);
+    return obj;
+  }
+  Message::Object* Message::Map::new_string(std::string &&val) {
+    String *obj = this->reuse<String>();
+    if (obj == nullptr) {
+      return new String(std::move(val));
+    }
+    obj->val_ = std::move(val);
+    return obj;
+  }
+
+  void Message::Map::clear() {
+    for (auto it = this->map_.begin(); it != this->map_.end(); it++) {
+      Object *v = it->val;
+      bool scalar = (v->is<Fixnum>() || v->is<Ufixnum>() || v->is<Float>() ||
+                     v->is<Bool>() || v->is<String>());
+      if (scalar && !v->shared() && this->spare_.size() < SPARE_MAX) {
+        this->spare_.push_back(v);
+      } else {
+        Object::release(v);
+      }
+    }
+    this->map_.clear();
+    this->index_.clear();
+  }
+  Message::Map::Map(KeyOrder order) : Object(MapType), order_(order) {
   }
   Message::Map::~Map() {
     for (auto it = this->map_.begin(); it != this->map_.end(); it++) {
-      delete it->second;
+      Object::release(it->val);
+    }
+    for (auto it = this->spare_.begin(); it != this->spare_.end(); it++) {
+      delete *it;
+    }
+  }
+
+  uint32_t Message::Map::hash(const std::string &key) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < key.size(); i++) {
+      h ^= static_cast<uint8_t>(key[i]);
+      h *= 16777619u;
+    }
+    return h;
+  }
+
+  size_t Message::Map::lookup(const std::string &key, const Key *ikey,
+                              uint32_t *hash, bool *found) const {
+    *found = false;
+    if (this->order_ == InsertionOrder) {
+      uint32_t h = ikey ? ikey->hash() : Map::hash(key);
+      *hash = h;
+      if (this->index_.empty()) {
+        for (size_t i = 0; i < this->map_.size(); i++) {
+          const Entry &e = this->map_[i];
+          if ((ikey && e.ikey == ikey) ||
+              (e.hash == h && e.name() == key)) {
+            *found = true;
+            return i;
+          }
+        }
+      } else {
+        size_t mask = this->index_.size() - 1;
+        for (size_t s = h & mask; this->index_[s] != 0; s = (s + 1) & mask) {
+          const Entry &e = this->map_[this->index_[s] - 1];
+          if ((ikey && e.ikey == ikey) ||
+              (e.hash == h && e.name() == key)) {
+            *found = true;
+            return this->index_[s] - 1;
+          }
+        }
+      }
+      return this->map_.size();
+    }
+
+    *hash = ikey ? ikey->hash() : 0;
+    size_t lo = 0, hi = this->map_.size();
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      const Entry &e = this->map_[mid];
+      int cmp = (ikey && e.ikey == ikey) ? 0 : e.name().compare(key);
+      if (cmp == 0) {
+        *found = true;
+        return mid;
+      } else if (cmp < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  void Message::Map::insert(size_t pos, const std::string &key,
+                            const Key *ikey, uint32_t hash, Object *obj) {
+    if (this->map_.empty()) {
+      this->map_.reserve(8);
+    }
+    Entry e;
+    if (ikey == nullptr) {
+      e.key = key;
+    }
+    e.ikey = ikey;
+    e.hash = hash;
+    e.val = obj;
+    this->map_.insert(this->map_.begin() + pos, std::move(e));
+
+    if (this->order_ == InsertionOrder &&
+        this->map_.size() > INDEX_THRESHOLD) {
+      // Keep load factor of index under 1/2.
+      if (this->index_.size() < this->map_.size() * 2) {
+        this->rebuild_index();
+      } else {
+        size_t mask = this->index_.size() - 1;
+        size_t s = hash & mask;
+        while (this->index_[s] != 0) {
+          s = (s + 1) & mask;
+        }
+        this->index_[s] = static_cast<uint32_t>(pos + 1);
+      }
+    }
+  }
+
+  void Message::Map::rebuild_index() {
+    this->index_.clear();
+    if (this->map_.size() <= INDEX_THRESHOLD) {
+      return;
+    }
+    size_t slots = 16;
+    while (slots < this->map_.size() * 4) {
+      slots *= 2;
+    }
+    this->index_.resize(slots, 0);
+    size_t mask = slots - 1;
+    for (size_t i = 0; i < this->map_.size(); i++) {
+      size_t s = this->map_[i].hash & mask;
+      while (this->index_[s] != 0) {
+        s = (s + 1) & mask;
+      }
+      this->index_[s] = static_cast<uint32_t>(i + 1);
     }
   }
 
   Message::Map* Message::Map::retain_map(const std::string &key) {
-    auto it = this->map_.find(key);
-    if (it == this->map_.end()) {
-      Map *obj = new Map();
-      this->map_.insert(std::make_pair(key, obj));
+    uint32_t h;
+    bool found;
+    size_t pos = this->lookup(key, nullptr, &h, &found);
+    if (!found) {
+      Map *obj = new Map(this->order_);
+      this->insert(pos, key, nullptr, h, obj);
       return obj;
     } else {
-      if (it->second->is<Map>()) {
-        return dynamic_cast<Map*>(it->second);
+      Entry &e = this->map_[pos];
+      if (e.val->is<Map>()) {
+        if (e.val->shared()) {
+          // Copy on write, the map is shared with clones.
+          Object *obj = e.val->clone();
+          Object::release(e.val);
+          e.val = obj;
+        }
+        return static_cast<Map*>(e.val);
       } else {
-        Map *obj = new Map();
-        delete it->second;
-        it->second = obj;
+        Map *obj = new Map(this->order_);
+        Object::release(e.val);
+        e.val = obj;
         return obj;
       }
     }
   }
 
   Message::Array* Message::Map::retain_array(const std::string &key) {
-    auto it = this->map_.find(key);
-    if (it == this->map_.end()) {
-      Array *obj = new Array();
-      this->map_.insert(std::make_pair(key, obj));
+    uint32_t h;
+    bool found;
+    size_t pos = this->lookup(key, nullptr, &h, &found);
+    if (!found) {
+      Array *obj = new Array(this->order_);
+      this->insert(pos, key, nullptr, h, obj);
       return obj;
     } else {
-      if (it->second->is<Array>()) {
-        return dynamic_cast<Array*>(it->second);
+      Entry &e = this->map_[pos];
+      if (e.val->is<Array>()) {
+        if (e.val->shared()) {
+          // Copy on write, the array is shared with clones.
+          Object *obj = e.val->clone();
+          Object::release(e.val);
+          e.val = obj;
+        }
+        return static_cast<Array*>(e.val);
       } else {
-        Array *obj = new Array();
-        delete it->second;
-        it->second = obj;
+        Array *obj = new Array(this->order_);
+        Object::release(e.val);
+        e.val = obj;
         return obj;
       }
     }
@@ -170,40 +715,74 @@ namespace fluent {
   
   // TODO: refactoring to merge set int, string, float, bool
   bool Message::Map::set(const std::string &key, int val) {
-    Object *n = new Fixnum(val);
+    Object *n = this->new_fixnum(val);
+    return this->set(key, n);
+  }
+  bool Message::Map::set(const std::string &key, long val) {
+    Object *n = this->new_fixnum(val);
+    return this->set(key, n);
+  }
+  bool Message::Map::set(const std::string &key, long long val) {
+    Object *n = this->new_fixnum(val);
+    return this->set(key, n);
+  }
+  bool Message::Map::set(const std::string &key, unsigned long val) {
+    Object *n = this->new_ufixnum(val);
+    return this->set(key, n);
+  }
+  bool Message::Map::set(const std::string &key, unsigned long long val) {
+    Object *n = this->new_ufixnum(val);
     return this->set(key, n);
   }
   bool Message::Map::set(const std::string &key, unsigned int val) {
-    Object *n = new Ufixnum(val);
+    Object *n = this->new_ufixnum(val);
     return this->set(key, n);
   }  
   bool Message::Map::set(const std::string &key, const char *val) {
-    Object *v = new String(val);
+    Object *v = this->new_string(val, strlen(val));
     return this->set(key, v);
   }
   bool Message::Map::set(const std::string &key, const std::string &val) {
-    Object *v = new String(val);
+    Object *v = this->new_string(val.data(), val.size());
+    return this->set(key, v);
+  }
+  bool Message::Map::set(const std::string &key, std::string &&val) {
+    Object *v = this->new_string(std::move(val));
+    return this->set(key, v);
+  }
+  bool Message::Map::set(const std::string &key, const char *val,
+                         size_t len) {
+    Object *v = this->new_string(val, len);
     return this->set(key, v);
   }
   bool Message::Map::set(const std::string &key, double val) {
-    Object *v = new Float(val);
+    Object *v = this->new_float(val);
     return this->set(key, v);
   }
   bool Message::Map::set(const std::string &key, bool val) {
-    Object *v = new Bool(val);
+    Object *v = this->new_bool(val);
     return this->set(key, v);
   }
   bool Message::Map::set(const std::string &key, Object *obj) {
-    auto it = this->map_.find(key);
+    return this->set(key, nullptr, obj);
+  }
+  bool Message::Map::set(const Key &key, Object *obj) {
+    return this->set(key.str(), &key, obj);
+  }
+  bool Message::Map::set(const std::string &key, const Key *ikey,
+                         Object *obj) {
+    uint32_t h;
+    bool found;
+    size_t pos = this->lookup(key, ikey, &h, &found);
 
     // Allow overwrite
-    if (it != this->map_.end()) {
+    if (found) {
       // Delete and put value
-      delete it->second;
-      it->second = obj;
+      Object::release(this->map_[pos].val);
+      this->map_[pos].val = obj;
     } else {
       // Create and insert value
-      this->map_.insert(std::make_pair(key, obj));
+      this->insert(pos, key, ikey, h, obj);
     }
     
     return true;
@@ -213,13 +792,69 @@ namespace fluent {
     Nil *obj = new Nil();
     return this->set(key, obj);
   }
+
+  bool Message::Map::set_bin(const std::string &key, const void *data,
+                             size_t len) {
+    Object *v = new Binary(data, len);
+    return this->set(key, v);
+  }
+  bool Message::Map::set_ext(const std::string &key, int8_t type,
+                             const void *data, size_t len) {
+    Object *v = new Ext(type, data, len);
+    return this->set(key, v);
+  }
+
+  bool Message::Map::set(const Key &key, int val) {
+    return this->set(key, this->new_fixnum(val));
+  }
+  bool Message::Map::set(const Key &key, long val) {
+    return this->set(key, this->new_fixnum(val));
+  }
+  bool Message::Map::set(const Key &key, long long val) {
+    return this->set(key, this->new_fixnum(val));
+  }
+  bool Message::Map::set(const Key &key, unsigned long val) {
+    return this->set(key, this->new_ufixnum(val));
+  }
+  bool Message::Map::set(const Key &key, unsigned long long val) {
+    return this->set(key, this->new_ufixnum(val));
+  }
+  bool Message::Map::set(const Key &key, unsigned int val) {
+    return this->set(key, this->new_ufixnum(val));
+  }
+  bool Message::Map::set(const Key &key, const char *val) {
+    return this->set(key, this->new_string(val, strlen(val)));
+  }
+  bool Message::Map::set(const Key &key, const std::string &val) {
+    return this->set(key, this->new_string(val.data(), val.size()));
+  }
+  bool Message::Map::set(const Key &key, std::string &&val) {
+    return this->set(key, this->new_string(std::move(val)));
+  }
+  bool Message::Map::set(const Key &key, const char *val, size_t len) {
+    return this->set(key, this->new_string(val, len));
+  }
+  bool Message::Map::set(const Key &key, double val) {
+    return this->set(key, this->new_float(val));
+  }
+  bool Message::Map::set(const Key &key, bool val) {
+    return this->set(key, this->new_bool(val));
+  }
+  bool Message::Map::set_nil(const Key &key) {
+    return this->set(key, static_cast<Object*>(new Nil()));
+  }
   
   bool Message::Map::del(const std::string &key) {
-    auto it = this->map_.find(key);
-    if (it != this->map_.end()) {
-      // Create and insert value
-      delete it->second;
-      this->map_.erase(key);
+    uint32_t h;
+    bool found;
+    size_t pos = this->lookup(key, nullptr, &h, &found);
+    if (found) {
+      Object::release(this->map_[pos].val);
+      this->map_.erase(this->map_.begin() + pos);
+      if (!this->index_.empty()) {
+        // Positions after pos are shifted.
+        this->rebuild_index();
+      }
       return true;
     } else {
       // Not exists.
@@ -228,11 +863,13 @@ namespace fluent {
   }
 
   const Message::Object& Message::Map::get(const std::string &key) const {
-    auto it = this->map_.find(key);
-    if (it == this->map_.end()) {
+    uint32_t h;
+    bool found;
+    size_t pos = this->lookup(key, nullptr, &h, &found);
+    if (!found) {
       throw Exception::KeyError(key);
     } else {
-      return *(it->second);
+      return *(this->map_[pos].val);
     }
   }
   
@@ -240,39 +877,46 @@ namespace fluent {
   void Message::Map::to_msgpack(msgpack::packer<msgpack::sbuffer> *pk)
     const {
     pk->pack_map(this->map_.size());
+    this->pack_entries(pk);
+  }
+
+  void Message::Map::pack_entries(msgpack::packer<msgpack::sbuffer> *pk)
+    const {
     // Iterate all key and value to convert msgpack.
     for(auto it = this->map_.begin(); it != this->map_.end(); it++) {
-      pk->pack(it->first);
-      (it->second)->to_msgpack(pk);
+      if (it->ikey) {
+        const std::string &packed = it->ikey->packed();
+        pk->pack_str_body(packed.data(), packed.size());
+      } else {
+        pk->pack_str(it->key.size());
+        pk->pack_str_body(it->key.data(), it->key.size());
+      }
+      pack_object(it->val, pk);
     }
   }
 
-  void Message::Map::to_ostream(std::ostream &os) const {
-    os << "{";
-    if (this->map_.size() > 0) {
-      const std::string &fkey = this->map_.begin()->first; // first key
-      std::for_each(this->map_.begin(), this->map_.end(),
-                    [&](std::pair <std::string, Object*> e) {
-                      os << ((fkey != e.first) ? ", " : "")
-                         << "\"" << e.first << "\": ";
-                      (e.second)->to_ostream(os);
-                    });
-    }
-    os << "}";
-  }
-  
-
   Message::Object* Message::Map::clone() const {
-    Map *map = new Map();
+    Map *map = new Map(this->order_);
+    // Entries are already in order, just append them. Values are shared
+    // and copied by retain_map()/retain_array() when modified. Clone is
+    // usually stamped with a few more fields, so reserve room for them.
+    map->map_.reserve(this->map_.size() + 4);
     for(auto it = this->map_.begin(); it != this->map_.end(); it++) {
-      map->set(it->first, (it->second)->clone());
+      Entry e;
+      e.key = it->key;
+      e.ikey = it->ikey;
+      e.hash = it->hash;
+      e.val = it->val;
+      e.val->retain();
+      map->map_.push_back(std::move(e));
     }
+    map->index_ = this->index_;
     return map;
   }
 
   Message::Array::~Array() {
     for (auto it : this->array_) {
-      delete it;
+      Object::release(it);
     }
   }
 
@@ -284,10 +928,34 @@ namespace fluent {
     Object *v = new String(val);
     this->array_.push_back(v);
   }
+  void Message::Array::push(std::string &&val) {
+    Object *v = new String(std::move(val));
+    this->array_.push_back(v);
+  }
+  void Message::Array::push(const char *val, size_t len) {
+    Object *v = new String(val, len);
+    this->array_.push_back(v);
+  }
   void Message::Array::push(int val) {
     Object *v = new Fixnum(val);
     this->array_.push_back(v);
   }
+  void Message::Array::push(long val) {
+    Object *v = new Fixnum(val);
+    this->array_.push_back(v);
+  }
+  void Message::Array::push(long long val) {
+    Object *v = new Fixnum(val);
+    this->array_.push_back(v);
+  }
+  void Message::Array::push(unsigned long val) {
+    Object *v = new Ufixnum(val);
+    this->array_.push_back(v);
+  }
+  void Message::Array::push(unsigned long long val) {
+    Object *v = new Ufixnum(val);
+    this->array_.push_back(v);
+  }
   void Message::Array::push(unsigned int val) {
     Object *v = new Ufixnum(val);
     this->array_.push_back(v);
@@ -307,42 +975,38 @@ namespace fluent {
     Object *v = new Nil();
     this->array_.push_back(v);
   }
+  void Message::Array::push_bin(const void *data, size_t len) {
+    Object *v = new Binary(data, len);
+    this->array_.push_back(v);
+  }
+  void Message::Array::push_ext(int8_t type, const void *data, size_t len) {
+    Object *v = new Ext(type, data, len);
+    this->array_.push_back(v);
+  }
   void Message::Array::to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) const {
     pk->pack_array(this->array_.size());
     for(size_t i = 0; i < this->array_.size(); i++) {
-      this->array_[i]->to_msgpack(pk);
+      pack_object(this->array_[i], pk);
     }
   }
 
-  void Message::Array::to_ostream(std::ostream &os) const {
-    os << "[";
-    if (this->array_.size() > 0) {
-      Object *fobj = this->array_[0];
-      std::for_each(this->array_.begin(), this->array_.end(),
-                    [&](Object *obj) {
-                      os << ((fobj != obj) ? ", " : "");
-                      obj->to_ostream(os);
-                    });
-    }
-    os << "]";
-  }
-  
-
   Message::Object* Message::Array::clone() const {
-    Array *array = new Array();
+    Array *array = new Array(this->order_);
+    array->array_.reserve(this->array_.size());
     for(size_t i = 0; i < this->array_.size(); i++) {
-      array->push(this->array_[i]->clone());
+      this->array_[i]->retain();
+      array->array_.push_back(this->array_[i]);
     }
     return array;
   }    
   
   Message::Map* Message::Array::retain_map() {
-    Map *map = new Map();
+    Map *map = new Map(this->order_);
     this->array_.push_back(map);
     return map;
   }
   Message::Array* Message::Array::retain_array() {
-    Array *arr = new Array();
+    Array *arr = new Array(this->order_);
     this->array_.push_back(arr);
     return arr;
   }
@@ -356,38 +1020,157 @@ namespace fluent {
   }
 
 
-  Message::Fixnum::Fixnum(int val) : val_(val) {}
+  Message::Fixnum::Fixnum(int64_t val) : Object(FixnumType), val_(val) {}
   void Message::Fixnum::to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) 
     const {
-    pk->pack(this->val_);
+    pk->pack_int64(this->val_);
   }  
 
-  Message::Ufixnum::Ufixnum(unsigned int val) : val_(val) {}
+  Message::Ufixnum::Ufixnum(uint64_t val) :
+    Object(UfixnumType), val_(val) {}
   void Message::Ufixnum::to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) 
     const {
-    pk->pack(this->val_);
+    pk->pack_uint64(this->val_);
   }  
   
-  Message::String::String(const std::string &val) : val_(val) {}
-  Message::String::String(const char *val) : val_(val) {}
+  Message::String::String(const std::string &val) :
+    Object(StringType), val_(val) {}
+  Message::String::String(const char *val) :
+    Object(StringType), val_(val) {}
+  Message::String::String(std::string &&val) :
+    Object(StringType), val_(std::move(val)) {}
+  Message::String::String(const char *val, size_t len) :
+    Object(StringType), val_(val, len) {}
   void Message::String::to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) 
     const {
     pk->pack(this->val_);
   }
 
-  Message::Float::Float(double val) : val_(val) {}
+  Message::Float::Float(double val) : Object(FloatType), val_(val) {}
   void Message::Float::to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) 
     const {
     pk->pack(this->val_);
   }  
 
-  Message::Bool::Bool(bool val) : val_(val) {}
+  Message::Bool::Bool(bool val) : Object(BoolType), val_(val) {}
   void Message::Bool::to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) 
     const {
     pk->pack(this->val_);
   }
 
+  Message::Binary::Binary(const void *data, size_t len) :
+    Object(BinaryType), val_(static_cast<const char*>(data), len) {}
+  Message::Binary::Binary(std::string &&val) :
+    Object(BinaryType), val_(std::move(val)) {}
+  void Message::Binary::to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) 
+    const {
+    pk->pack_bin(this->val_.size());
+    pk->pack_bin_body(this->val_.data(), this->val_.size());
+  }
+
+  Message::Ext::Ext(int8_t type, const void *data, size_t len) :
+    Object(ExtType), type_(type), data_(static_cast<const char*>(data), len) {}
+  void Message::Ext::to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) 
+    const {
+    pk->pack_ext(this->data_.size(), this->type_);
+    pk->pack_ext_body(this->data_.data(), this->data_.size());
+  }
+
   void Message::Nil::to_msgpack(msgpack::packer<msgpack::sbuffer> *pk) const {
     pk->pack_nil();
   }
+
+
+  // -----------------------------------------------------------------
+  // Decoder
+  static const int DECODE_DEPTH_MAX = 128;
+
+  static Message::Object* decode_int(int64_t v) {
+    return new Message::Fixnum(v);
+  }
+
+  static Message::Object* decode_uint(uint64_t v) {
+    if (v <= INT64_MAX) {
+      return new Message::Fixnum(static_cast<int64_t>(v));
+    }
+    return new Message::Ufixnum(v);
+  }
+
+  static Message::Object* decode(const char *data, size_t len, size_t *off,
+                                 int depth);
+
+  static Message::Object* decode_array(const char *data, size_t len,
+                                       size_t *off, size_t n, int depth) {
+    Message::Array *arr = new Message::Array();
+    for (size_t i = 0; i < n; i++) {
+      Message::Object *obj = decode(data, len, off, depth + 1);
+      if (obj == nullptr) {
+        delete arr;
+        return nullptr;
+      }
+      arr->push(obj);
+    }
+    return arr;
+  }
+
+  static Message::Object* decode_map(const char *data, size_t len,
+                                     size_t *off, size_t n, int depth) {
+    Message::Map *map = new Message::Map();
+    for (size_t i = 0; i < n; i++) {
+      Message::Object *key = decode(data, len, off, depth + 1);
+      if (key == nullptr || !key->is<Message::String>()) {
+        delete key;
+        delete map;
+        return nullptr;
+      }
+      Message::Object *val = decode(data, len, off, depth + 1);
+      if (val == nullptr) {
+        delete key;
+        delete map;
+        return nullptr;
+      }
+      map->set(key->as<Message::String>().val(), val);
+      delete key;
+    }
+    return map;
+  }
+
+  static Message::Object* decode(const char *data, size_t len, size_t *off,
+                                 int depth) {
+    PackedHeader h;
+    if (*off >= len || depth > DECODE_DEPTH_MAX ||
+        scan_packed(data + *off, data + len, &h) != ScanOk) {
+      return nullptr;
+    }
+    const char *p = data + *off + h.hdr;
+
+    if (h.type == PackedArray || h.type == PackedMap) {
+      *off += h.hdr;
+      return (h.type == PackedArray) ?
+        decode_array(data, len, off, h.len, depth) :
+        decode_map(data, len, off, h.len, depth);
+    }
+    *off += h.hdr + h.len;
+    switch (h.type) {
+      case PackedNil: return new Message::Nil();
+      case PackedBool: return new Message::Bool(h.val != 0);
+      case PackedUint: return decode_uint(h.val);
+      case PackedInt: return decode_int(static_cast<int64_t>(h.val));
+      case PackedFloat: return new Message::Float(packed_float(h));
+      case PackedStr: return new Message::String(p, h.len);
+      case PackedBin: return new Message::Binary(p, h.len);
+      case PackedExt: return new Message::Ext(h.ext, p, h.len);
+      default: return nullptr;
+    }
+  }
+
+  Message::Object* Message::Object::from_msgpack(const char *data, size_t len,
+                                                 size_t *offset) {
+    size_t off = *offset;
+    Object *obj = decode(data, len, &off, 0);
+    if (obj) {
+      *offset = off;
+    }
+    return obj;
+  }
 }
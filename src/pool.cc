@@ -0,0 +1,79 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "./fluent/pool.hpp"
+
+namespace fluent {
+  MessagePool::MessagePool(size_t limit) :
+    returned_(nullptr), free_(nullptr), count_(0), limit_(limit),
+    reused_(0) {
+  }
+
+  MessagePool::~MessagePool() {
+    // Message deletes following linked messages.
+    delete this->free_;
+    delete this->returned_.exchange(nullptr);
+  }
+
+  Message* MessagePool::get(const std::string &tag,
+                            Message::KeyOrder order) {
+    if (this->free_ == nullptr) {
+      this->free_ = this->returned_.exchange(nullptr,
+                                             std::memory_order_acquire);
+    }
+    if (this->free_ == nullptr) {
+      return new Message(tag, order);
+    }
+
+    Message *msg = this->free_;
+    this->free_ = msg->detach();
+    this->count_--;
+    this->reused_++;
+    msg->renew(tag, order);
+    return msg;
+  }
+
+  void MessagePool::put(Message *root) {
+    Message *msg = root;
+    while (msg) {
+      Message *next = msg->detach();
+      // Reserve a slot first, as workers put() concurrently.
+      if (this->count_.fetch_add(1, std::memory_order_relaxed) >=
+          this->limit_.load(std::memory_order_relaxed)) {
+        this->count_.fetch_sub(1, std::memory_order_relaxed);
+        delete msg;
+      } else {
+        msg->clear();
+        Message *head = this->returned_.load(std::memory_order_relaxed);
+        do {
+          msg->next_ = head;
+        } while (!this->returned_.compare_exchange_weak(
+            head, msg, std::memory_order_release, std::memory_order_relaxed));
+      }
+      msg = next;
+    }
+  }
+}
@@ -34,6 +34,7 @@
 #include <math.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/time.h>
 
 #include "./fluent/queue.hpp"
 #include "./debug.h"
@@ -110,12 +111,50 @@ namespace fluent {
   // ----------------------------------------------
   const bool MsgThreadQueue::DBG = false;
 
-  MsgThreadQueue::MsgThreadQueue() : term_(false) {
+  static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+  }
+
+  static void add_usec(struct timespec *ts, long usec) {
+    ts->tv_sec  += usec / 1000000L;
+    ts->tv_nsec += (usec % 1000000L) * 1000L;
+    if (ts->tv_nsec >= 1000000000L) {
+      ts->tv_sec  += 1;
+      ts->tv_nsec -= 1000000000L;
+    }
+  }
+
+  static void set_now(struct timespec *ts) {
+    struct timeval tv;
+    ::gettimeofday(&tv, nullptr);
+    ts->tv_sec  = tv.tv_sec;
+    ts->tv_nsec = tv.tv_usec * 1000L;
+  }
+
+  static void set_deadline(struct timespec *ts, int msec) {
+    set_now(ts);
+    add_usec(ts, msec * 1000L);
+  }
+
+  MsgThreadQueue::MsgThreadQueue() :
+    term_(false), drain_(false), abort_(false), busy_(false), flushing_(0),
+    linger_usec_(0), linger_count_(0), parked_(false), spin_(0), avail_(0),
+    signal_count_(0), park_count_(0) {
     // Setup pthread.
     ::pthread_mutex_init(&(this->mutex_), NULL);
     ::pthread_cond_init(&(this->cond_), NULL);
+    ::pthread_cond_init(&(this->drain_cond_), NULL);
+    this->first_ts_.tv_sec  = 0;
+    this->first_ts_.tv_nsec = 0;
   }
   MsgThreadQueue::~MsgThreadQueue() {
+    ::pthread_cond_destroy(&(this->drain_cond_));
+    ::pthread_cond_destroy(&(this->cond_));
+    ::pthread_mutex_destroy(&(this->mutex_));
   }
   bool MsgThreadQueue::push(Message *msg) {
     bool rc = true;
@@ -126,9 +165,27 @@ namespace fluent {
     debug(DBG, "PUSH: count:%zu, limit:%zu", this->count(), this->limit());
     if (this->term_) {
       // do not accept more msg because working thread going to shutdown.
+      rc = false;
     } else {
       rc = this->MsgQueue::push(msg);
-      ::pthread_cond_signal (&(this->cond_));
+      this->avail_.store(this->count(), std::memory_order_release);
+
+      bool wakeup = true;
+      if (this->linger_usec_ > 0) {
+        if (this->count() == 1) {
+          // Start lingering from arrival of the first message.
+          set_now(&(this->first_ts_));
+        } else {
+          wakeup = (this->count() >= this->batch_count());
+        }
+      }
+
+      // Signal only a sleeping consumer, once per sleep.
+      if (wakeup && this->parked_) {
+        this->parked_ = false;
+        this->signal_count_++;
+        ::pthread_cond_signal (&(this->cond_));
+      }
     }
     debug(DBG, "PUSHED: count:%zu, limit:%zu", this->count(), this->limit());
     
@@ -144,42 +201,73 @@ namespace fluent {
     ::pthread_mutex_lock(&(this->mutex_));
     debug(DBG, "entered lock");
 
-    msg = this->MsgQueue::bulk_pop();
-    if (msg != nullptr) {
-      debug(DBG, "poped before wait (%p)", msg);
-      ::pthread_mutex_unlock(&(this->mutex_));
-      return msg;
+    // Consumer comes back, so messages of previous bulk_pop() are done.
+    this->busy_ = false;
+    if (this->count() == 0) {
+      ::pthread_cond_broadcast(&(this->drain_cond_));
     }
 
-    if (this->term_) {
-      // Going to shutdown the thread.
+    if (this->count() == 0 && !this->term_ && this->spin_ > 0) {
+      // Poll for a while, a message may come before sleeping.
+      size_t spin = this->spin_;
       ::pthread_mutex_unlock(&(this->mutex_));
-      debug(DBG, "going to shutdown, leave");
-      return nullptr;
+      for (size_t i = 0; i < spin; i++) {
+        if (this->avail_.load(std::memory_order_acquire) > 0) {
+          break;
+        }
+        cpu_relax();
+      }
+      ::pthread_mutex_lock(&(this->mutex_));
+    }
+
+    while (this->count() == 0 && !this->term_) {
+      debug(DBG, "entered wait");
+      this->parked_ = true;
+      this->park_count_++;
+      ::pthread_cond_wait(&(this->cond_), &(this->mutex_));
+      this->parked_ = false;
+      debug(DBG, "left wait");
     }
-      
-    debug(DBG, "entered wait");
-    ::pthread_cond_wait(&(this->cond_), &(this->mutex_));
-    debug(DBG, "left wait");
 
+    if (this->linger_usec_ > 0 && this->count() > 0) {
+      // Wait for more messages to send them as one batch.
+      struct timespec deadline = this->first_ts_;
+      add_usec(&deadline, this->linger_usec_);
+      while (this->count() < this->batch_count() &&
+             !this->term_ && this->flushing_ == 0) {
+        this->parked_ = true;
+        this->park_count_++;
+        int rc = ::pthread_cond_timedwait(&(this->cond_), &(this->mutex_),
+                                          &deadline);
+        this->parked_ = false;
+        if (rc == ETIMEDOUT) {
+          break;
+        }
+      }
+      debug(DBG, "lingered, count:%zu", this->count());
+    }
     msg = this->MsgQueue::bulk_pop();
-    ::pthread_mutex_unlock(&(this->mutex_));
+    this->avail_.store(0, std::memory_order_relaxed);
+
     if (msg) {
+      this->busy_ = true;
       debug(DBG, "poped (%p)", msg);
     } else {
-      debug(DBG, "no data");
+      // Going to shutdown the thread.
+      debug(DBG, "going to shutdown, leave");
     }
-
+    ::pthread_mutex_unlock(&(this->mutex_));
     debug(DBG, "left lock");
 
     return msg;
   }
 
-  void MsgThreadQueue::term() {
+  void MsgThreadQueue::term(bool drain) {
     // Sending terminate signal to worker thread.
     ::pthread_mutex_lock(&(this->mutex_));
     this->term_ = true;
-    ::pthread_cond_signal (&(this->cond_));
+    this->drain_ = drain;
+    ::pthread_cond_broadcast(&(this->cond_));
     ::pthread_mutex_unlock(&(this->mutex_));    
     debug(DBG, "sent terminate");
   }
@@ -192,11 +280,102 @@ namespace fluent {
     debug(DBG, "checked terminate");
     return rc;
   }
+
+  void MsgThreadQueue::abort() {
+    ::pthread_mutex_lock(&(this->mutex_));
+    this->term_ = true;
+    this->abort_ = true;
+    ::pthread_cond_broadcast(&(this->cond_));
+    ::pthread_cond_broadcast(&(this->drain_cond_));
+    ::pthread_mutex_unlock(&(this->mutex_));
+    debug(DBG, "sent abort");
+  }
+
+  bool MsgThreadQueue::is_abort() {
+    bool rc;
+    ::pthread_mutex_lock(&(this->mutex_));
+    rc = this->abort_ || (this->term_ && !this->drain_);
+    ::pthread_mutex_unlock(&(this->mutex_));
+    return rc;
+  }
+
+  bool MsgThreadQueue::wait_abort(int msec) {
+    struct timespec deadline;
+    set_deadline(&deadline, msec);
+
+    ::pthread_mutex_lock(&(this->mutex_));
+    while (!(this->abort_ || (this->term_ && !this->drain_))) {
+      if (ETIMEDOUT == ::pthread_cond_timedwait(&(this->cond_),
+                                                &(this->mutex_), &deadline)) {
+        break;
+      }
+    }
+    bool rc = this->abort_ || (this->term_ && !this->drain_);
+    ::pthread_mutex_unlock(&(this->mutex_));
+    return rc;
+  }
+
+  bool MsgThreadQueue::wait_drain(int timeout_msec) {
+    struct timespec deadline;
+    set_deadline(&deadline, timeout_msec);
+
+    ::pthread_mutex_lock(&(this->mutex_));
+    // Do not let the consumer linger while somebody waits for flush.
+    this->flushing_++;
+    ::pthread_cond_broadcast(&(this->cond_));
+    while ((this->count() > 0 || this->busy_) && !this->abort_) {
+      if (ETIMEDOUT == ::pthread_cond_timedwait(&(this->drain_cond_),
+                                                &(this->mutex_), &deadline)) {
+        break;
+      }
+    }
+    bool rc = (this->count() == 0 && !this->busy_);
+    this->flushing_--;
+    ::pthread_mutex_unlock(&(this->mutex_));
+    debug(DBG, "waited drain: %d", rc);
+    return rc;
+  }
   
   void MsgThreadQueue::set_limit(size_t limit) {
     ::pthread_mutex_lock(&(this->mutex_));
     this->MsgQueue::set_limit(limit);
     ::pthread_mutex_unlock(&(this->mutex_));    
   }
+
+  void MsgThreadQueue::set_linger(int linger_usec, size_t batch_count) {
+    ::pthread_mutex_lock(&(this->mutex_));
+    this->linger_usec_  = (linger_usec > 0) ? linger_usec : 0;
+    this->linger_count_ = batch_count;
+    ::pthread_cond_signal(&(this->cond_));
+    ::pthread_mutex_unlock(&(this->mutex_));
+  }
+
+  void MsgThreadQueue::set_spin(size_t spin) {
+    ::pthread_mutex_lock(&(this->mutex_));
+    this->spin_ = spin;
+    ::pthread_mutex_unlock(&(this->mutex_));
+  }
+
+  size_t MsgThreadQueue::signal_count() {
+    ::pthread_mutex_lock(&(this->mutex_));
+    size_t n = this->signal_count_;
+    ::pthread_mutex_unlock(&(this->mutex_));
+    return n;
+  }
+
+  size_t MsgThreadQueue::park_count() {
+    ::pthread_mutex_lock(&(this->mutex_));
+    size_t n = this->park_count_;
+    ::pthread_mutex_unlock(&(this->mutex_));
+    return n;
+  }
+
+  size_t MsgThreadQueue::batch_count() const {
+    // A full queue rejects messages, so never linger beyond the limit.
+    if (this->linger_count_ == 0 || this->linger_count_ > this->limit()) {
+      return this->limit();
+    }
+    return this->linger_count_;
+  }
   
 }
@@ -0,0 +1,921 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <iterator>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "./fluent/reader.hpp"
+#include "./scan.h"
+
+namespace fluent {
+  static const size_t READ_CHUNK = 64 * 1024;
+
+  // Find the end of a msgpack object without decoding it. Nested objects
+  // are counted instead of recursion, so depth is not limited.
+  ScanResult skip_object(const char *p, const char *end, const char **next) {
+    uint64_t pending = 1;
+    while (pending > 0) {
+      // Each object takes a byte at least.
+      if (pending > static_cast<uint64_t>(end - p)) {
+        return ScanShort;
+      }
+      pending--;
+      PackedHeader h;
+      ScanResult rc = scan_packed(p, end, &h);
+      if (rc != ScanOk) {
+        return rc;
+      }
+      p += h.hdr;
+      if (h.type == PackedArray) {
+        pending += h.len;
+      } else if (h.type == PackedMap) {
+        pending += 2 * h.len;
+      } else {
+        p += h.len;
+      }
+    }
+    *next = p;
+    return ScanOk;
+  }
+
+  // Header of array (map if map is true) and number of its elements
+  // (pairs).
+  static ScanResult scan_header(const char *p, const char *end, bool map,
+                                uint64_t *n, const char **next) {
+    if (p >= end) {
+      return ScanShort;
+    }
+    uint8_t t = static_cast<uint8_t>(p[0]);
+    uint8_t fix = map ? 0x80 : 0x90;
+    uint8_t ext = map ? 0xde : 0xdc;
+    if (fix <= t && t <= fix + 0x0f) {
+      *n = t & 0x0f;
+      *next = p + 1;
+      return ScanOk;
+    }
+    if (t != ext && t != ext + 1) {
+      return ScanBroken;
+    }
+    size_t lenb = (t == ext) ? 2 : 4;
+    if (static_cast<size_t>(end - p) < 1 + lenb) {
+      return ScanShort;
+    }
+    *n = read_be(p + 1, lenb);
+    *next = p + 1 + lenb;
+    return ScanOk;
+  }
+
+  ScanResult scan_array(const char *p, const char *end, uint64_t *n,
+                        const char **next) {
+    return scan_header(p, end, false, n, next);
+  }
+
+  ScanResult scan_map(const char *p, const char *end, uint64_t *n,
+                      const char **next) {
+    return scan_header(p, end, true, n, next);
+  }
+
+  ScanResult scan_str(const char *p, const char *end, const char **str,
+                      size_t *len, const char **next, bool bin) {
+    if (p >= end) {
+      return ScanShort;
+    }
+    uint8_t t = static_cast<uint8_t>(p[0]);
+    size_t hdr;
+    if (0xa0 <= t && t <= 0xbf) {
+      hdr = 1;
+    } else if (0xd9 <= t && t <= 0xdb) {
+      hdr = 1 + (static_cast<size_t>(1) << (t - 0xd9));
+    } else if (bin && 0xc4 <= t && t <= 0xc6) {
+      hdr = 1 + (static_cast<size_t>(1) << (t - 0xc4));
+    } else {
+      return ScanBroken;
+    }
+    if (static_cast<size_t>(end - p) < hdr) {
+      return ScanShort;
+    }
+    size_t n = (hdr == 1) ? (t & 0x1f) : read_be(p + 1, hdr - 1);
+    if (static_cast<size_t>(end - p) - hdr < n) {
+      return ScanShort;
+    }
+    *str = p + hdr;
+    *len = n;
+    *next = p + hdr + n;
+    return ScanOk;
+  }
+
+  ScanResult scan_time(const char *p, const char *end, DumpReader::Entry *e,
+                       const char **next) {
+    if (p >= end) {
+      return ScanShort;
+    }
+    size_t remain = end - p;
+    uint8_t t = static_cast<uint8_t>(p[0]);
+    e->ts_nsec = 0;
+    e->event_time = false;
+    if (t <= 0x7f) {
+      e->ts = t;
+      p++;
+    } else if (0xcc <= t && t <= 0xd3) {
+      bool sign = (t >= 0xd0);
+      size_t sz = static_cast<size_t>(1) << (sign ? t - 0xd0 : t - 0xcc);
+      if (remain < 1 + sz) {
+        return ScanShort;
+      }
+      uint64_t u = read_be(p + 1, sz);
+      if (sign) {
+        switch (sz) {
+          case 1: e->ts = static_cast<int8_t>(u); break;
+          case 2: e->ts = static_cast<int16_t>(u); break;
+          case 4: e->ts = static_cast<int32_t>(u); break;
+          default: e->ts = static_cast<int64_t>(u); break;
+        }
+      } else {
+        e->ts = static_cast<time_t>(u);
+      }
+      p += 1 + sz;
+    } else if (t == 0xd7 || t == 0xc7) {
+      // EventTime: fixext 8 or ext 8 of 8 bytes, and type 0.
+      size_t hdr = (t == 0xd7) ? 2 : 3;
+      if (remain < hdr + 8) {
+        return ScanShort;
+      }
+      if ((t == 0xc7 && p[1] != 8) || p[hdr - 1] != 0) {
+        return ScanBroken;
+      }
+      e->ts = static_cast<time_t>(read_be(p + hdr, 4));
+      e->ts_nsec = static_cast<long>(read_be(p + hdr + 4, 4));
+      e->event_time = true;
+      p += hdr + 8;
+    } else {
+      return ScanBroken;
+    }
+    *next = p;
+    return ScanOk;
+  }
+
+  ScanResult scan_record(const char *p, const char *end, DumpReader::Entry *e,
+                         const char **next) {
+    if (p >= end) {
+      return ScanShort;
+    }
+    uint8_t t = static_cast<uint8_t>(p[0]);
+    if (!((0x80 <= t && t <= 0x8f) || t == 0xde || t == 0xdf)) {
+      return ScanBroken;
+    }
+    ScanResult rc = skip_object(p, end, next);
+    if (rc != ScanOk) {
+      return rc;
+    }
+    e->record = p;
+    e->record_len = *next - p;
+    return ScanOk;
+  }
+
+  ScanResult scan_entry(const char *p, const char *end,
+                        DumpReader::Entry *e) {
+    const char *start = p;
+    if (p >= end) {
+      return ScanShort;
+    }
+    if (static_cast<uint8_t>(p[0]) != 0x93) {
+      return ScanBroken;
+    }
+    p++;
+
+    ScanResult rc;
+    if ((rc = scan_str(p, end, &e->tag, &e->tag_len, &p)) != ScanOk ||
+        (rc = scan_time(p, end, e, &p)) != ScanOk ||
+        (rc = scan_record(p, end, e, &p)) != ScanOk) {
+      return rc;
+    }
+    e->size = p - start;
+    return ScanOk;
+  }
+
+  DumpReader::DumpReader() :
+    data_(nullptr), size_(0), pos_(0), base_(0), map_(nullptr), map_len_(0),
+    buf_(nullptr), buf_cap_(0), fd_(-1), own_fd_(false), eof_(true),
+    truncated_(false), ranged_(false), range_start_(0), range_end_(0),
+    span_(0) {
+  }
+  DumpReader::~DumpReader() {
+    this->close();
+  }
+
+  // Map regular file of fd into memory. *map is nullptr if fd is not a
+  // regular file or is empty.
+  static bool map_file(int fd, void **map, size_t *len, std::string *errmsg) {
+    *map = nullptr;
+    *len = 0;
+#ifndef _WIN32
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      size_t size = static_cast<size_t>(st.st_size);
+      void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        *errmsg = strerror(errno);
+        return false;
+      }
+      madvise(p, size, MADV_SEQUENTIAL);
+      *map = p;
+      *len = size;
+    }
+#endif
+    return true;
+  }
+
+  static void unmap_file(void *map, size_t len) {
+#ifndef _WIN32
+    if (map) {
+      munmap(map, len);
+    }
+#endif
+  }
+
+  bool DumpReader::open(const std::string &fname) {
+    this->close();
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+      this->errmsg_ = strerror(errno);
+      return false;
+    }
+    if (!map_file(fd, &this->map_, &this->map_len_, &this->errmsg_)) {
+      ::close(fd);
+      return false;
+    }
+    if (this->map_) {
+      ::close(fd);
+      this->data_ = static_cast<const char*>(this->map_);
+      this->size_ = this->map_len_;
+      return true;
+    }
+
+    this->fd_ = fd;
+    this->own_fd_ = true;
+    this->eof_ = false;
+    return true;
+  }
+
+  bool DumpReader::open(int fd) {
+    this->close();
+    this->fd_ = fd;
+    this->eof_ = false;
+    return true;
+  }
+
+  bool DumpReader::open(const char *data, size_t len) {
+    this->close();
+    this->data_ = data;
+    this->size_ = len;
+    return true;
+  }
+
+  void DumpReader::close() {
+    unmap_file(this->map_, this->map_len_);
+    free(this->buf_);
+    if (this->own_fd_) {
+      ::close(this->fd_);
+    }
+    this->data_ = nullptr;
+    this->size_ = 0;
+    this->pos_ = 0;
+    this->base_ = 0;
+    this->map_ = nullptr;
+    this->map_len_ = 0;
+    this->buf_ = nullptr;
+    this->buf_cap_ = 0;
+    this->fd_ = -1;
+    this->own_fd_ = false;
+    this->eof_ = true;
+    this->truncated_ = false;
+    this->errmsg_.clear();
+    this->ranged_ = false;
+    this->spans_.clear();
+    this->span_ = 0;
+  }
+
+  bool DumpReader::fill() {
+    if (this->eof_) {
+      return false;
+    }
+
+    // Move the rest to the head of buffer, and grow the buffer if the rest
+    // fills it.
+    size_t rest = this->size_ - this->pos_;
+    if (this->pos_ > 0) {
+      memmove(this->buf_, this->buf_ + this->pos_, rest);
+      this->base_ += this->pos_;
+      this->pos_ = 0;
+      this->size_ = rest;
+    }
+    if (rest == this->buf_cap_) {
+      if (this->buf_cap_ >= ENTRY_MAX) {
+        this->errmsg_ = "Too large entry at offset " +
+          std::to_string(this->offset());
+        return false;
+      }
+      size_t cap = (this->buf_cap_ > 0) ? this->buf_cap_ * 2 : READ_CHUNK;
+      char *buf = static_cast<char*>(realloc(this->buf_, cap));
+      if (buf == nullptr) {
+        this->errmsg_ = strerror(errno);
+        return false;
+      }
+      this->buf_ = buf;
+      this->buf_cap_ = cap;
+    }
+    this->data_ = this->buf_;
+
+    while (true) {
+      ssize_t rc = ::read(this->fd_, this->buf_ + this->size_,
+                          this->buf_cap_ - this->size_);
+      if (rc < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        this->errmsg_ = strerror(errno);
+        return false;
+      }
+      if (rc == 0) {
+        this->eof_ = true;
+        return false;
+      }
+      this->size_ += rc;
+      return true;
+    }
+  }
+
+  void DumpReader::set_time_range(time_t start, time_t end,
+                                  const DumpIndex *index) {
+    this->ranged_ = true;
+    this->range_start_ = start;
+    this->range_end_ = end;
+    this->spans_.clear();
+    this->span_ = 0;
+    if (index && this->fd_ < 0) {
+      this->spans_ = index->spans(start, end, this->size_);
+      if (this->spans_.empty()) {
+        // Nothing to read.
+        this->spans_.push_back(std::make_pair(this->size_, this->size_));
+      }
+    }
+  }
+
+  bool DumpReader::next_span() {
+    // Spans are used for file or memory, where base_ is 0.
+    while (this->span_ < this->spans_.size()) {
+      const std::pair<uint64_t, uint64_t> &span = this->spans_[this->span_];
+      if (this->pos_ < span.second) {
+        if (this->pos_ < span.first) {
+          this->pos_ = span.first;
+        }
+        return true;
+      }
+      this->span_++;
+    }
+    return false;
+  }
+
+  bool DumpReader::next(Entry *entry) {
+    while (this->next_entry(entry)) {
+      if (!this->ranged_ || (entry->ts >= this->range_start_ &&
+                             entry->ts < this->range_end_)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool DumpReader::next_entry(Entry *entry) {
+    while (this->errmsg_.empty()) {
+      if (!this->spans_.empty() && !this->next_span()) {
+        return false;
+      }
+      ScanResult rc = scan_entry(this->data_ + this->pos_,
+                                 this->data_ + this->size_, entry);
+      if (rc == ScanOk) {
+        entry->offset = this->offset();
+        this->pos_ += entry->size;
+        return true;
+      }
+      if (rc == ScanBroken) {
+        this->errmsg_ = "Broken entry at offset " +
+          std::to_string(this->offset());
+        return false;
+      }
+      if (!this->fill()) {
+        if (this->errmsg_.empty() && this->pos_ < this->size_) {
+          this->truncated_ = true;
+        }
+        return false;
+      }
+    }
+    return false;
+  }
+
+  Message* DumpReader::next_message() {
+    Entry e;
+    if (!this->next(&e)) {
+      return nullptr;
+    }
+    Message *msg = DumpReader::decode(e);
+    if (msg == nullptr) {
+      this->errmsg_ = "Unsupported record at offset " +
+        std::to_string(e.offset);
+    }
+    return msg;
+  }
+
+  Message* DumpReader::decode(const Entry &entry) {
+    size_t off = 0;
+    Message::Object *obj =
+      Message::Object::from_msgpack(entry.record, entry.record_len, &off);
+    if (obj == nullptr) {
+      return nullptr;
+    }
+    Message *msg = new Message(std::string(entry.tag, entry.tag_len),
+                               static_cast<Message::Map*>(obj));
+    msg->set_ts(entry.ts, entry.ts_nsec);
+    msg->set_event_time(entry.event_time);
+    return msg;
+  }
+
+  void DumpReader::load(const Entry &entry, Message *msg) {
+    // Record is a map checked by scan_entry().
+    uint8_t t = static_cast<uint8_t>(entry.record[0]);
+    size_t hdr, count;
+    if (t <= 0x8f) {
+      hdr = 1;
+      count = t & 0x0f;
+    } else {
+      hdr = (t == 0xde) ? 3 : 5;
+      count = read_be(entry.record + 1, hdr - 1);
+    }
+    if (msg->raw_ == nullptr) {
+      msg->raw_ = new msgpack::sbuffer(entry.record_len);
+    }
+    msg->raw_->write(entry.record + hdr, entry.record_len - hdr);
+    msg->raw_count_ += count;
+    msg->set_ts(entry.ts, entry.ts_nsec);
+    msg->set_event_time(entry.event_time);
+  }
+
+  // ----------------------------------------------------------------
+  // DumpIndex
+  const char DumpIndex::MAGIC[8] = {'F', 'L', 'T', 'I', 'D', 'X', '0', '1'};
+
+  static void write_be(uint64_t v, char *p) {
+    for (int i = 7; i >= 0; i--) {
+      p[i] = static_cast<char>(v & 0xff);
+      v >>= 8;
+    }
+  }
+
+  void DumpIndex::encode(const Block &block, char *buf) {
+    write_be(block.offset, buf);
+    write_be(block.length, buf + 8);
+    write_be(static_cast<uint64_t>(block.min_ts), buf + 16);
+    write_be(static_cast<uint64_t>(block.max_ts), buf + 24);
+  }
+
+  void DumpIndex::decode(const char *buf, Block *block) {
+    block->offset = read_be(buf, 8);
+    block->length = read_be(buf + 8, 8);
+    block->min_ts = static_cast<int64_t>(read_be(buf + 16, 8));
+    block->max_ts = static_cast<int64_t>(read_be(buf + 24, 8));
+  }
+
+  bool DumpIndex::open(const std::string &fname) {
+    this->blocks_.clear();
+    this->max_until_.clear();
+    this->gaps_.clear();
+    this->end_ = 0;
+    this->errmsg_.clear();
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+      this->errmsg_ = strerror(errno);
+      return false;
+    }
+    std::string data;
+    char buf[BUFSIZ];
+    while (true) {
+      ssize_t rc = ::read(fd, buf, sizeof(buf));
+      if (rc < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rc < 0) {
+        this->errmsg_ = strerror(errno);
+        ::close(fd);
+        return false;
+      }
+      if (rc == 0) {
+        break;
+      }
+      data.append(buf, rc);
+    }
+    ::close(fd);
+
+    if (data.size() < sizeof(MAGIC) ||
+        memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0) {
+      this->errmsg_ = "Not a dumpfile index";
+      return false;
+    }
+    // A block being written at the end is ignored.
+    size_t count = (data.size() - sizeof(MAGIC)) / BLOCK_SIZE;
+    this->blocks_.resize(count);
+    this->max_until_.resize(count);
+    for (size_t i = 0; i < count; i++) {
+      Block &b = this->blocks_[i];
+      decode(data.data() + sizeof(MAGIC) + i * BLOCK_SIZE, &b);
+      this->max_until_[i] = (i > 0 && this->max_until_[i - 1] > b.max_ts) ?
+        this->max_until_[i - 1] : b.max_ts;
+      if (b.offset > this->end_) {
+        this->gaps_.push_back(std::make_pair(this->end_, b.offset));
+      }
+      this->end_ = std::max(this->end_, b.offset + b.length);
+    }
+    return true;
+  }
+
+  std::vector<std::pair<uint64_t, uint64_t> >
+  DumpIndex::spans(time_t start, time_t end, uint64_t size) const {
+    // Blocks before the first one with time >= start have only entries of
+    // time < start, even if time of entries is not in order.
+    size_t first = std::lower_bound(this->max_until_.begin(),
+                                    this->max_until_.end(),
+                                    static_cast<int64_t>(start)) -
+      this->max_until_.begin();
+    std::vector<std::pair<uint64_t, uint64_t> > found;
+    for (size_t i = first; i < this->blocks_.size(); i++) {
+      const Block &b = this->blocks_[i];
+      if (b.min_ts < end && b.max_ts >= start) {
+        found.push_back(std::make_pair(b.offset, b.offset + b.length));
+      }
+    }
+    // Data not covered by blocks is read too.
+    std::vector<std::pair<uint64_t, uint64_t> > all;
+    std::merge(found.begin(), found.end(), this->gaps_.begin(),
+               this->gaps_.end(), std::back_inserter(all));
+    all.push_back(std::make_pair(this->end_, size));
+
+    std::vector<std::pair<uint64_t, uint64_t> > spans;
+    for (size_t i = 0; i < all.size(); i++) {
+      uint64_t from = all[i].first, to = std::min(all[i].second, size);
+      if (from >= to) {
+        continue;
+      }
+      if (!spans.empty() && spans.back().second >= from) {
+        spans.back().second = std::max(spans.back().second, to);
+      } else {
+        spans.push_back(std::make_pair(from, to));
+      }
+    }
+    return spans;
+  }
+
+  // ----------------------------------------------------------------
+  // DumpScanner
+
+  // Entries to parse in a row at a boundary found in the middle of file.
+  static const size_t SYNC_ENTRIES = 4;
+
+  // Offset of the first entry boundary in [begin, end) of data, or end if
+  // not found.
+  static size_t resync(const char *data, size_t size, size_t begin,
+                       size_t end) {
+    const char *p = data + begin, *last = data + end, *eod = data + size;
+    while (p < last) {
+      p = static_cast<const char*>(memchr(p, 0x93, last - p));
+      if (p == nullptr) {
+        break;
+      }
+      const char *q = p;
+      size_t n = 0;
+      DumpReader::Entry e;
+      while (n < SYNC_ENTRIES && q < eod &&
+             scan_entry(q, eod, &e) == ScanOk) {
+        q += e.size;
+        n++;
+      }
+      if (n == SYNC_ENTRIES || (n > 0 && q == eod)) {
+        return p - data;
+      }
+      p++;
+    }
+    return end;
+  }
+
+  struct ScanRange {
+    size_t begin;
+    size_t end;
+    // Offset of the first entry, and the end of the last entry.
+    size_t first;
+    size_t stop;
+    // Result at stop, ScanOk if the range is scanned to the end.
+    ScanResult result;
+    std::vector<DumpReader::Entry> entries;
+    std::vector<Message*> messages;
+    std::future<void> scanned;
+    std::future<void> done;
+  };
+
+  // Scan entries from offset until one beyond range.
+  static void scan_range(const char *data, size_t size, size_t from,
+                         ScanRange *r) {
+    r->entries.clear();
+    r->first = from;
+    r->result = ScanOk;
+    size_t pos = from;
+    DumpReader::Entry e;
+    while (pos < r->end) {
+      ScanResult rc = scan_entry(data + pos, data + size, &e);
+      if (rc != ScanOk) {
+        r->result = rc;
+        break;
+      }
+      e.offset = pos;
+      r->entries.push_back(e);
+      pos += e.size;
+    }
+    r->stop = pos;
+  }
+
+  // Fixed number of threads taking jobs in FIFO order.
+  class ScanPool {
+  private:
+    std::vector<std::thread> threads_;
+    std::deque<std::function<void()> > jobs_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool stop_;
+
+    void work() {
+      while (true) {
+        std::function<void()> job;
+        {
+          std::unique_lock<std::mutex> lock(this->mutex_);
+          this->cond_.wait(lock, [this]() {
+              return this->stop_ || !this->jobs_.empty();
+            });
+          if (this->jobs_.empty()) {
+            return;
+          }
+          job = std::move(this->jobs_.front());
+          this->jobs_.pop_front();
+        }
+        job();
+      }
+    }
+
+  public:
+    explicit ScanPool(size_t threads) : stop_(false) {
+      for (size_t i = 0; i < threads; i++) {
+        this->threads_.push_back(std::thread(&ScanPool::work, this));
+      }
+    }
+    ~ScanPool() {
+      {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        this->stop_ = true;
+      }
+      this->cond_.notify_all();
+      for (size_t i = 0; i < this->threads_.size(); i++) {
+        this->threads_[i].join();
+      }
+    }
+    std::future<void> submit(const std::function<void()> &func) {
+      auto task = std::make_shared<std::packaged_task<void()> >(func);
+      std::future<void> f = task->get_future();
+      {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        this->jobs_.push_back([task]() { (*task)(); });
+      }
+      this->cond_.notify_one();
+      return f;
+    }
+  };
+
+  DumpScanner::DumpScanner(size_t threads, size_t range_size) :
+    data_(nullptr), size_(0), map_(nullptr), map_len_(0), threads_(threads),
+    range_size_(range_size > 0 ? range_size : 1), count_(0),
+    truncated_(false) {
+    if (this->threads_ == 0) {
+      this->threads_ = std::thread::hardware_concurrency();
+      if (this->threads_ == 0) {
+        this->threads_ = 1;
+      }
+    }
+  }
+  DumpScanner::~DumpScanner() {
+    this->close();
+  }
+
+  bool DumpScanner::open(const std::string &fname) {
+    this->close();
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+      this->errmsg_ = strerror(errno);
+      return false;
+    }
+    bool rc = map_file(fd, &this->map_, &this->map_len_, &this->errmsg_);
+    ::close(fd);
+    if (!rc) {
+      return false;
+    }
+    this->data_ = static_cast<const char*>(this->map_);
+    this->size_ = this->map_len_;
+    return true;
+  }
+
+  bool DumpScanner::open(const char *data, size_t len) {
+    this->close();
+    this->data_ = data;
+    this->size_ = len;
+    return true;
+  }
+
+  void DumpScanner::close() {
+    unmap_file(this->map_, this->map_len_);
+    this->data_ = nullptr;
+    this->size_ = 0;
+    this->map_ = nullptr;
+    this->map_len_ = 0;
+    this->count_ = 0;
+    this->truncated_ = false;
+    this->errmsg_.clear();
+  }
+
+  bool DumpScanner::scan(
+      const std::function<void(const DumpReader::Entry&)> &handler) {
+    return this->run(&handler, nullptr);
+  }
+
+  bool DumpScanner::scan_ordered(
+      const std::function<void(Message*)> &handler) {
+    return this->run(nullptr, &handler);
+  }
+
+  bool DumpScanner::run(
+      const std::function<void(const DumpReader::Entry&)> *handler,
+      const std::function<void(Message*)> *ordered) {
+    this->count_ = 0;
+    this->truncated_ = false;
+    this->errmsg_.clear();
+
+    const char *data = this->data_;
+    size_t size = this->size_;
+    size_t nrange = (size + this->range_size_ - 1) / this->range_size_;
+    size_t window = this->threads_ * 2;
+    ScanPool pool(this->threads_);
+    // Ranges being scanned, and checked ranges being handled or decoded.
+    std::deque<ScanRange*> scanning, working;
+    size_t next = 0, prev_stop = 0;
+    bool stopped = false, failed = false;
+
+    // Pass decoded messages to handler in order.
+    auto deliver = [&](ScanRange *r) {
+      r->done.get();
+      for (size_t i = 0; i < r->messages.size(); i++) {
+        Message *msg = r->messages[i];
+        if (msg == nullptr && !failed) {
+          failed = true;
+          this->errmsg_ = "Unsupported record at offset " +
+            std::to_string(r->entries[i].offset);
+        }
+        if (failed) {
+          delete msg;
+        } else {
+          this->count_++;
+          (*ordered)(msg);
+        }
+      }
+      delete r;
+    };
+    auto finish = [&](ScanRange *r) {
+      if (ordered) {
+        deliver(r);
+      } else {
+        r->done.get();
+        delete r;
+      }
+    };
+
+    while (true) {
+      while (!stopped && next < nrange &&
+             scanning.size() + working.size() < window) {
+        ScanRange *r = new ScanRange();
+        r->begin = next * this->range_size_;
+        r->end = std::min(size, r->begin + this->range_size_);
+        r->scanned = pool.submit([r, data, size]() {
+            size_t first = (r->begin == 0) ? 0 :
+              resync(data, size, r->begin, r->end);
+            scan_range(data, size, first, r);
+          });
+        scanning.push_back(r);
+        next++;
+      }
+      if (scanning.empty()) {
+        break;
+      }
+
+      ScanRange *r = scanning.front();
+      scanning.pop_front();
+      r->scanned.get();
+      if (stopped) {
+        delete r;
+        continue;
+      }
+
+      if (prev_stop >= r->end) {
+        // The previous entry covers this range.
+        r->entries.clear();
+        r->result = ScanOk;
+        r->stop = prev_stop;
+      } else if (r->first != prev_stop) {
+        // Found boundary was not an entry, or entries are broken before.
+        scan_range(data, size, prev_stop, r);
+      }
+      prev_stop = r->stop;
+      if (r->result == ScanShort) {
+        this->truncated_ = true;
+        stopped = true;
+      } else if (r->result == ScanBroken) {
+        this->errmsg_ = "Broken entry at offset " + std::to_string(r->stop);
+        stopped = true;
+      }
+
+      if (handler) {
+        this->count_ += r->entries.size();
+        r->done = pool.submit([r, handler]() {
+            for (size_t i = 0; i < r->entries.size(); i++) {
+              (*handler)(r->entries[i]);
+            }
+          });
+      } else {
+        r->done = pool.submit([r]() {
+            r->messages.resize(r->entries.size());
+            for (size_t i = 0; i < r->entries.size(); i++) {
+              r->messages[i] = DumpReader::decode(r->entries[i]);
+            }
+          });
+      }
+      working.push_back(r);
+
+      // Finish handled ranges, and wait for the oldest one if too many.
+      while (!working.empty() &&
+             (working.size() > this->threads_ ||
+              working.front()->done.wait_for(std::chrono::seconds(0)) ==
+              std::future_status::ready)) {
+        finish(working.front());
+        working.pop_front();
+      }
+    }
+
+    while (!working.empty()) {
+      finish(working.front());
+      working.pop_front();
+    }
+    return this->errmsg_.empty();
+  }
+}
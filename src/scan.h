@@ -0,0 +1,237 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_SCAN_H__
+#define SRC_SCAN_H__
+
+#include <stdint.h>
+#include <string.h>
+#include "./fluent/reader.hpp"
+
+// Scanners of msgpack data shared by DumpReader, ForwardServer, TextEncoder
+// and Message. They check bytes in [p, end) without copying, and set *next
+// to the byte after the scanned object.
+
+namespace fluent {
+  enum ScanResult {
+    ScanOk,
+    ScanShort,          // Data ends in the middle of object.
+    ScanBroken,
+  };
+
+  inline uint64_t read_be(const char *p, size_t n) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; i++) {
+      v = (v << 8) | static_cast<uint8_t>(p[i]);
+    }
+    return v;
+  }
+
+  enum PackedType {
+    PackedNil,
+    PackedBool,
+    PackedUint,
+    PackedInt,
+    PackedFloat,
+    PackedStr,
+    PackedBin,
+    PackedExt,
+    PackedArray,
+    PackedMap,
+  };
+
+  // Header of msgpack object. The object takes hdr + len bytes except
+  // array and map, whose len is the number of elements (pairs) following
+  // the header.
+  struct PackedHeader {
+    PackedType type;
+    size_t hdr;
+    uint64_t len;
+    // Value of bool, integer (int64_t for PackedInt) and bits of float of
+    // len bytes.
+    uint64_t val;
+    // Type of ext.
+    int8_t ext;
+  };
+
+  // Header of object at p, and data of scalar as well. Elements of array
+  // and map are not checked.
+  inline ScanResult scan_packed(const char *p, const char *end,
+                                PackedHeader *h) {
+    if (p >= end) {
+      return ScanShort;
+    }
+    size_t remain = end - p;
+    uint8_t t = static_cast<uint8_t>(p[0]);
+    // Bytes of length field.
+    size_t lenb = 0;
+    h->hdr = 1;
+    h->len = 0;
+    h->val = 0;
+    h->ext = 0;
+
+    if (t <= 0x7f) {
+      h->type = PackedUint;
+      h->val = t;
+      return ScanOk;
+    } else if (t >= 0xe0) {
+      h->type = PackedInt;
+      h->val = static_cast<uint64_t>(static_cast<int64_t>(
+          static_cast<int8_t>(t)));
+      return ScanOk;
+    } else if (t <= 0x8f) {
+      h->type = PackedMap;
+      h->len = t & 0x0f;
+      return ScanOk;
+    } else if (t <= 0x9f) {
+      h->type = PackedArray;
+      h->len = t & 0x0f;
+      return ScanOk;
+    } else if (t <= 0xbf) {
+      h->type = PackedStr;
+      h->len = t & 0x1f;
+    } else {
+      switch (t) {
+        case 0xc0: h->type = PackedNil; return ScanOk;
+        case 0xc2: case 0xc3:
+          h->type = PackedBool;
+          h->val = t - 0xc2;
+          return ScanOk;
+        case 0xcc: case 0xcd: case 0xce: case 0xcf:
+          h->type = PackedUint;
+          h->len = static_cast<size_t>(1) << (t - 0xcc);
+          break;
+        case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+          h->type = PackedInt;
+          h->len = static_cast<size_t>(1) << (t - 0xd0);
+          break;
+        case 0xca: h->type = PackedFloat; h->len = 4; break;
+        case 0xcb: h->type = PackedFloat; h->len = 8; break;
+        case 0xd9: case 0xda: case 0xdb:          // str 8, 16, 32
+          h->type = PackedStr;
+          lenb = static_cast<size_t>(1) << (t - 0xd9);
+          break;
+        case 0xc4: case 0xc5: case 0xc6:          // bin 8, 16, 32
+          h->type = PackedBin;
+          lenb = static_cast<size_t>(1) << (t - 0xc4);
+          break;
+        case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+          // fixext 1, 2, 4, 8, 16
+          h->type = PackedExt;
+          h->hdr = 2;
+          h->len = static_cast<size_t>(1) << (t - 0xd4);
+          break;
+        case 0xc7: case 0xc8: case 0xc9:          // ext 8, 16, 32
+          h->type = PackedExt;
+          lenb = static_cast<size_t>(1) << (t - 0xc7);
+          h->hdr = 2;
+          break;
+        case 0xdc: case 0xdd:
+          h->type = PackedArray;
+          lenb = (t == 0xdc) ? 2 : 4;
+          break;
+        case 0xde: case 0xdf:
+          h->type = PackedMap;
+          lenb = (t == 0xde) ? 2 : 4;
+          break;
+        default:
+          // 0xc1 is never used.
+          return ScanBroken;
+      }
+    }
+
+    h->hdr += lenb;
+    if (remain < h->hdr) {
+      return ScanShort;
+    }
+    if (lenb > 0) {
+      h->len = read_be(p + 1, lenb);
+    }
+    if (h->type == PackedExt) {
+      h->ext = static_cast<int8_t>(p[h->hdr - 1]);
+    } else if (h->type == PackedArray || h->type == PackedMap) {
+      return ScanOk;
+    }
+    if (remain - h->hdr < h->len) {
+      return ScanShort;
+    }
+
+    switch (h->type) {
+      case PackedUint:
+      case PackedFloat:
+        h->val = read_be(p + 1, h->len);
+        break;
+      case PackedInt: {
+        uint64_t u = read_be(p + 1, h->len);
+        int64_t v;
+        switch (h->len) {
+          case 1: v = static_cast<int8_t>(u); break;
+          case 2: v = static_cast<int16_t>(u); break;
+          case 4: v = static_cast<int32_t>(u); break;
+          default: v = static_cast<int64_t>(u); break;
+        }
+        h->val = static_cast<uint64_t>(v);
+        break;
+      }
+      default:
+        break;
+    }
+    return ScanOk;
+  }
+
+  // Value of PackedFloat, float 32 or float 64.
+  inline double packed_float(const PackedHeader &h) {
+    if (h.len == 4) {
+      uint32_t u = static_cast<uint32_t>(h.val);
+      float f;
+      memcpy(&f, &u, sizeof(f));
+      return f;
+    }
+    double d;
+    memcpy(&d, &h.val, sizeof(d));
+    return d;
+  }
+
+  ScanResult skip_object(const char *p, const char *end, const char **next);
+  // Header of array or map, and number of elements or pairs in *n.
+  ScanResult scan_array(const char *p, const char *end, uint64_t *n,
+                        const char **next);
+  ScanResult scan_map(const char *p, const char *end, uint64_t *n,
+                      const char **next);
+  // str, or bin as well if bin is true.
+  ScanResult scan_str(const char *p, const char *end, const char **str,
+                      size_t *len, const char **next, bool bin=false);
+  // Integer or EventTime into ts, ts_nsec and event_time of e.
+  ScanResult scan_time(const char *p, const char *end, DumpReader::Entry *e,
+                       const char **next);
+  // Map into record and record_len of e.
+  ScanResult scan_record(const char *p, const char *end, DumpReader::Entry *e,
+                         const char **next);
+  // [tag, time, record] into e except offset.
+  ScanResult scan_entry(const char *p, const char *end, DumpReader::Entry *e);
+}
+
+#endif  // SRC_SCAN_H__
@@ -0,0 +1,574 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <algorithm>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include "./fluent/server.hpp"
+#include "./scan.h"
+#include "./debug.h"
+
+namespace fluent {
+  static const size_t READ_CHUNK = 64 * 1024;
+  // Limit of a frame in buffer, to close a connection sending garbage.
+  static const size_t FRAME_MAX = 256 * 1024 * 1024;
+
+  static bool set_nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return (flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0);
+  }
+
+  struct ForwardServer::Conn {
+    int fd;
+    std::vector<char> in;
+    size_t in_len;
+    std::string out;    // acks not sent yet
+    explicit Conn(int fd) : fd(fd), in(READ_CHUNK), in_len(0) {}
+  };
+
+  // Readiness of fds, level triggered.
+  class ForwardServer::Poller {
+  public:
+    struct Event {
+      int fd;
+      bool in;    // readable, closed or error
+      bool out;
+    };
+
+  private:
+#ifdef __linux__
+    int epfd_;
+    std::vector<struct epoll_event> events_;
+#else
+    std::vector<struct pollfd> fds_;
+#endif
+
+  public:
+#ifdef __linux__
+    Poller() : epfd_(epoll_create1(0)), events_(256) {}
+    ~Poller() {
+      if (this->epfd_ >= 0) {
+        ::close(this->epfd_);
+      }
+    }
+    bool ok() const { return this->epfd_ >= 0; }
+    bool add(int fd) {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.fd = fd;
+      return epoll_ctl(this->epfd_, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+    void del(int fd) {
+      struct epoll_event ev;
+      epoll_ctl(this->epfd_, EPOLL_CTL_DEL, fd, &ev);
+    }
+    // Watch writability of fd as well if out is true.
+    void set_out(int fd, bool out) {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+      ev.data.fd = fd;
+      epoll_ctl(this->epfd_, EPOLL_CTL_MOD, fd, &ev);
+    }
+    bool wait(std::vector<Event> *events) {
+      events->clear();
+      int n = epoll_wait(this->epfd_, &this->events_[0],
+                         this->events_.size(), -1);
+      if (n < 0) {
+        return errno == EINTR;
+      }
+      for (int i = 0; i < n; i++) {
+        const struct epoll_event &ev = this->events_[i];
+        Event e;
+        e.fd = ev.data.fd;
+        e.in = (ev.events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+        e.out = (ev.events & EPOLLOUT) != 0;
+        events->push_back(e);
+      }
+      return true;
+    }
+#else
+    Poller() {}
+    bool ok() const { return true; }
+    bool add(int fd) {
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      this->fds_.push_back(pfd);
+      return true;
+    }
+    void del(int fd) {
+      for (size_t i = 0; i < this->fds_.size(); i++) {
+        if (this->fds_[i].fd == fd) {
+          this->fds_.erase(this->fds_.begin() + i);
+          return;
+        }
+      }
+    }
+    void set_out(int fd, bool out) {
+      for (size_t i = 0; i < this->fds_.size(); i++) {
+        if (this->fds_[i].fd == fd) {
+          this->fds_[i].events = POLLIN | (out ? POLLOUT : 0);
+          return;
+        }
+      }
+    }
+    bool wait(std::vector<Event> *events) {
+      events->clear();
+      int n = poll(&this->fds_[0], this->fds_.size(), -1);
+      if (n < 0) {
+        return errno == EINTR;
+      }
+      for (size_t i = 0; i < this->fds_.size(); i++) {
+        short r = this->fds_[i].revents;
+        if (r == 0) {
+          continue;
+        }
+        Event e;
+        e.fd = this->fds_[i].fd;
+        e.in = (r & (POLLIN | POLLHUP | POLLERR)) != 0;
+        e.out = (r & POLLOUT) != 0;
+        events->push_back(e);
+      }
+      return true;
+    }
+#endif
+  };
+
+  // Parse a frame of [tag, time, record, option?] (Message mode),
+  // [tag, [[time, record], ...], option?] (Forward mode) or
+  // [tag, bin/str of [time, record]..., option?] (PackedForward mode).
+  // Entries are appended to entries, and *chunk points to chunk option in
+  // msgpack if it is given.
+  static ScanResult scan_frame(const char *p, const char *end,
+                               std::vector<DumpReader::Entry> *entries,
+                               const char **chunk, size_t *chunk_len,
+                               bool *compressed, const char **next) {
+    ScanResult rc;
+    uint64_t n;
+    DumpReader::Entry e;
+    *chunk = nullptr;
+    *chunk_len = 0;
+    *compressed = false;
+    *next = p;
+    if ((rc = scan_array(p, end, &n, &p)) != ScanOk) {
+      return rc;
+    }
+    if (n < 2 || n > 4) {
+      return ScanBroken;
+    }
+    if ((rc = scan_str(p, end, &e.tag, &e.tag_len, &p)) != ScanOk) {
+      return rc;
+    }
+    if (p >= end) {
+      return ScanShort;
+    }
+
+    uint8_t t = static_cast<uint8_t>(p[0]);
+    uint64_t options;
+    const char *packed = nullptr, *packed_end = nullptr;
+    if ((0x90 <= t && t <= 0x9f) || t == 0xdc || t == 0xdd) {
+      // Forward
+      uint64_t count, len;
+      if ((rc = scan_array(p, end, &count, &p)) != ScanOk) {
+        return rc;
+      }
+      for (uint64_t i = 0; i < count; i++) {
+        if ((rc = scan_array(p, end, &len, &p)) != ScanOk) {
+          return rc;
+        }
+        if (len != 2) {
+          return ScanBroken;
+        }
+        if ((rc = scan_time(p, end, &e, &p)) != ScanOk ||
+            (rc = scan_record(p, end, &e, &p)) != ScanOk) {
+          return rc;
+        }
+        entries->push_back(e);
+      }
+      options = n - 2;
+    } else if ((0xa0 <= t && t <= 0xbf) || (0xd9 <= t && t <= 0xdb) ||
+               (0xc4 <= t && t <= 0xc6)) {
+      // PackedForward, parsed after option that may tell compression.
+      size_t size;
+      if ((rc = scan_str(p, end, &packed, &size, &p, true)) != ScanOk) {
+        return rc;
+      }
+      packed_end = packed + size;
+      options = n - 2;
+    } else {
+      // Message
+      if (n < 3) {
+        return ScanBroken;
+      }
+      if ((rc = scan_time(p, end, &e, &p)) != ScanOk ||
+          (rc = scan_record(p, end, &e, &p)) != ScanOk) {
+        return rc;
+      }
+      entries->push_back(e);
+      options = n - 3;
+    }
+    if (options > 1) {
+      return ScanBroken;
+    }
+
+    if (options == 1) {
+      uint64_t pairs;
+      if ((rc = scan_map(p, end, &pairs, &p)) != ScanOk) {
+        return rc;
+      }
+      for (uint64_t i = 0; i < pairs; i++) {
+        const char *key, *val, *s;
+        size_t key_len, s_len;
+        if ((rc = scan_str(p, end, &key, &key_len, &val)) != ScanOk ||
+            (rc = skip_object(val, end, &p)) != ScanOk) {
+          return rc;
+        }
+        if (key_len == 5 && memcmp(key, "chunk", 5) == 0) {
+          *chunk = val;
+          *chunk_len = p - val;
+        } else if (key_len == 10 && memcmp(key, "compressed", 10) == 0) {
+          const char *tail;
+          *compressed = (scan_str(val, p, &s, &s_len, &tail) != ScanOk ||
+                         s_len != 4 || memcmp(s, "text", 4) != 0);
+        }
+      }
+    }
+
+    if (packed != nullptr && !*compressed) {
+      // Entries must be complete in the payload.
+      uint64_t len;
+      while (packed < packed_end) {
+        if (scan_array(packed, packed_end, &len, &packed) != ScanOk ||
+            len != 2 ||
+            scan_time(packed, packed_end, &e, &packed) != ScanOk ||
+            scan_record(packed, packed_end, &e, &packed) != ScanOk) {
+          return ScanBroken;
+        }
+        entries->push_back(e);
+      }
+    }
+    *next = p;
+    return ScanOk;
+  }
+
+  ForwardServer::ForwardServer() :
+    listen_fd_(-1), running_(false), ack_(true), queue_(nullptr),
+    poller_(nullptr), count_(0), bytes_(0), lost_(0), broken_(0) {
+    this->wake_fd_[0] = this->wake_fd_[1] = -1;
+    signal(SIGPIPE, SIG_IGN);
+  }
+  ForwardServer::~ForwardServer() {
+    this->stop();
+    if (this->listen_fd_ >= 0) {
+      ::close(this->listen_fd_);
+    }
+  }
+
+  bool ForwardServer::listen(const std::string &host, int port) {
+    struct addrinfo hints, *result, *rp;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int r;
+    const std::string port_s = std::to_string(port);
+    if (0 != (r = ::getaddrinfo(host.empty() ? nullptr : host.c_str(),
+                                port_s.c_str(), &hints, &result))) {
+      this->errmsg_.assign(gai_strerror(r));
+      return false;
+    }
+
+    if (this->listen_fd_ >= 0) {
+      ::close(this->listen_fd_);
+      this->listen_fd_ = -1;
+    }
+    for (rp = result; rp != nullptr; rp = rp->ai_next) {
+      int fd = ::socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+      if (fd < 0) {
+        continue;
+      }
+      int on = 1;
+      ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      if (::bind(fd, rp->ai_addr, rp->ai_addrlen) == 0 &&
+          ::listen(fd, SOMAXCONN) == 0 && set_nonblock(fd)) {
+        this->listen_fd_ = fd;
+        break;
+      }
+      this->errmsg_.assign(strerror(errno));
+      ::close(fd);
+    }
+    freeaddrinfo(result);
+    return this->listen_fd_ >= 0;
+  }
+
+  int ForwardServer::port() const {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (this->listen_fd_ < 0 ||
+        ::getsockname(this->listen_fd_, reinterpret_cast<sockaddr*>(&addr),
+                      &len) != 0) {
+      return -1;
+    }
+    if (addr.ss_family == AF_INET6) {
+      return ntohs(reinterpret_cast<sockaddr_in6*>(&addr)->sin6_port);
+    }
+    return ntohs(reinterpret_cast<sockaddr_in*>(&addr)->sin_port);
+  }
+
+  bool ForwardServer::start() {
+    if (this->running_) {
+      return true;
+    }
+    if (this->listen_fd_ < 0) {
+      this->errmsg_.assign("not listening");
+      return false;
+    }
+    if (::pipe(this->wake_fd_) != 0) {
+      this->errmsg_.assign(strerror(errno));
+      return false;
+    }
+    this->poller_ = new Poller();
+    if (!this->poller_->ok() || !this->poller_->add(this->listen_fd_) ||
+        !this->poller_->add(this->wake_fd_[0])) {
+      this->errmsg_.assign(strerror(errno));
+      this->stop();
+      return false;
+    }
+    this->running_ = true;
+    pthread_create(&(this->th_), nullptr, ForwardServer::run_thread, this);
+    return true;
+  }
+
+  void ForwardServer::stop() {
+    if (this->running_) {
+      char c = 0;
+      while (::write(this->wake_fd_[1], &c, 1) < 0 && errno == EINTR) {}
+      pthread_join(this->th_, nullptr);
+      this->running_ = false;
+    }
+    while (!this->conns_.empty()) {
+      this->close_conn(this->conns_.begin()->second);
+    }
+    delete this->poller_;
+    this->poller_ = nullptr;
+    for (int i = 0; i < 2; i++) {
+      if (this->wake_fd_[i] >= 0) {
+        ::close(this->wake_fd_[i]);
+        this->wake_fd_[i] = -1;
+      }
+    }
+  }
+
+  void* ForwardServer::run_thread(void *obj) {
+    static_cast<ForwardServer*>(obj)->loop();
+    return nullptr;
+  }
+
+  void ForwardServer::loop() {
+    std::vector<Poller::Event> events;
+    while (this->poller_->wait(&events)) {
+      for (size_t i = 0; i < events.size(); i++) {
+        const Poller::Event &ev = events[i];
+        if (ev.fd == this->wake_fd_[0]) {
+          return;
+        }
+        if (ev.fd == this->listen_fd_) {
+          this->accept_conns();
+          continue;
+        }
+        auto it = this->conns_.find(ev.fd);
+        if (it == this->conns_.end()) {
+          continue;
+        }
+        Conn *conn = it->second;
+        if ((ev.out && !this->write_conn(conn)) ||
+            (ev.in && !this->read_conn(conn))) {
+          this->close_conn(conn);
+        }
+      }
+    }
+    this->errmsg_.assign(strerror(errno));
+  }
+
+  void ForwardServer::accept_conns() {
+    while (true) {
+      int fd = ::accept(this->listen_fd_, nullptr, nullptr);
+      if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+          this->errmsg_.assign(strerror(errno));
+        }
+        if (errno != EINTR) {
+          return;
+        }
+        continue;
+      }
+      // Acks are small and should not wait.
+      int on = 1;
+      ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      if (!set_nonblock(fd) || !this->poller_->add(fd)) {
+        ::close(fd);
+        continue;
+      }
+      debug(DBG, "accepted fd=%d", fd);
+      this->conns_[fd] = new Conn(fd);
+    }
+  }
+
+  void ForwardServer::close_conn(Conn *conn) {
+    debug(DBG, "closing fd=%d", conn->fd);
+    if (this->poller_) {
+      this->poller_->del(conn->fd);
+    }
+    ::close(conn->fd);
+    this->conns_.erase(conn->fd);
+    delete conn;
+  }
+
+  bool ForwardServer::read_conn(Conn *conn) {
+    if (conn->in.size() - conn->in_len < READ_CHUNK) {
+      conn->in.resize(std::max(conn->in.size() * 2,
+                               conn->in_len + READ_CHUNK));
+    }
+    ssize_t n = ::read(conn->fd, &conn->in[conn->in_len],
+                       conn->in.size() - conn->in_len);
+    if (n < 0) {
+      return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+    }
+    if (n == 0) {
+      // Closed by peer, an incomplete frame is dropped.
+      return false;
+    }
+    conn->in_len += n;
+    this->bytes_ += n;
+    return this->decode(conn);
+  }
+
+  bool ForwardServer::write_conn(Conn *conn) {
+    while (!conn->out.empty()) {
+      ssize_t n = ::write(conn->fd, conn->out.data(), conn->out.size());
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          return false;
+        }
+        this->poller_->set_out(conn->fd, true);
+        return true;
+      }
+      conn->out.erase(0, n);
+    }
+    this->poller_->set_out(conn->fd, false);
+    return true;
+  }
+
+  bool ForwardServer::decode(Conn *conn) {
+    const char *p = &conn->in[0], *end = p + conn->in_len;
+    while (p < end) {
+      const char *chunk, *next;
+      size_t chunk_len;
+      bool compressed;
+      this->entries_.clear();
+      ScanResult rc = scan_frame(p, end, &this->entries_, &chunk, &chunk_len,
+                                 &compressed, &next);
+      if (rc == ScanShort) {
+        break;
+      }
+      if (rc == ScanBroken || compressed) {
+        this->errmsg_.assign(compressed ?
+                             "compressed entries are not supported" :
+                             "broken forward frame");
+        this->broken_++;
+        return false;
+      }
+      this->deliver();
+      p = next;
+
+      if (chunk != nullptr && this->ack_) {
+        // {"ack": chunk}
+        conn->out.append("\x81\xa3" "ack", 5);
+        conn->out.append(chunk, chunk_len);
+      }
+    }
+
+    size_t remain = end - p;
+    if (remain >= FRAME_MAX) {
+      this->errmsg_.assign("too large forward frame");
+      this->broken_++;
+      return false;
+    }
+    if (remain > 0 && p != &conn->in[0]) {
+      memmove(&conn->in[0], p, remain);
+    }
+    conn->in_len = remain;
+    if (remain == 0 && conn->in.size() > 16 * READ_CHUNK) {
+      // Release the buffer grown for a large frame.
+      std::vector<char>(READ_CHUNK).swap(conn->in);
+    }
+    return conn->out.empty() || this->write_conn(conn);
+  }
+
+  void ForwardServer::deliver() {
+    if (this->entry_handler_) {
+      for (size_t i = 0; i < this->entries_.size(); i++) {
+        this->entry_handler_(this->entries_[i]);
+      }
+    } else if (this->handler_ || this->queue_) {
+      for (size_t i = 0; i < this->entries_.size(); i++) {
+        Message *msg = DumpReader::decode(this->entries_[i]);
+        if (msg == nullptr) {
+          this->lost_++;
+        } else if (this->queue_) {
+          if (!this->queue_->push(msg)) {
+            delete msg;
+            this->lost_++;
+          }
+        } else {
+          this->handler_(msg);
+        }
+      }
+    }
+    this->count_ += this->entries_.size();
+  }
+}
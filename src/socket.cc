@@ -49,14 +49,24 @@
 
 
 namespace fluent {
+  const int Socket::SEND_TIMEOUT_MSEC = 500;
+
   Socket::Socket(const std::string &host, const std::string &port) :
-    host_(host), port_(port), is_connected_(false) {
+    sock_(-1), host_(host), port_(port), is_connected_(false),
+    aborted_(false) {
 #ifndef _WIN32
     signal(SIGPIPE, SIG_IGN);
 #endif
   }
   Socket::~Socket() {
-    ::close(this->sock_);
+    this->close();
+  }
+  void Socket::close() {
+    if (this->sock_ >= 0) {
+      ::close(this->sock_);
+      this->sock_ = -1;
+    }
+    this->is_connected_ = false;
   }
   bool Socket::connect() {
     const bool DBG = false;
@@ -79,6 +89,7 @@ namespace fluent {
       // throw Exception("getaddrinfo error: " + errmsg);
     }
 
+    this->close();
     for (rp = result; rp != NULL; rp = rp->ai_next) {
       this->sock_ = ::socket(rp->ai_family, rp->ai_socktype,
                              rp->ai_protocol);
@@ -87,6 +98,17 @@ namespace fluent {
       }
 
       if (::connect(this->sock_, rp->ai_addr, rp->ai_addrlen) == 0) {
+        // Bound blocking writes so that abort() is noticed.
+#ifdef _WIN32
+        DWORD tv = SEND_TIMEOUT_MSEC;
+#else
+        struct timeval tv;
+        tv.tv_sec  = SEND_TIMEOUT_MSEC / 1000;
+        tv.tv_usec = (SEND_TIMEOUT_MSEC % 1000) * 1000;
+#endif
+        ::setsockopt(this->sock_, SOL_SOCKET, SO_SNDTIMEO,
+                     reinterpret_cast<const char*>(&tv), sizeof(tv));
+
         char buf[INET6_ADDRSTRLEN];
         struct sockaddr_in *addr_in = (struct sockaddr_in *) rp->ai_addr;
         ::inet_ntop(rp->ai_family, &addr_in->sin_addr.s_addr, buf,
@@ -96,6 +118,7 @@ namespace fluent {
         debug(DBG, "connected to %s", buf);
         break;
       }
+      this->close();
     }
 
     if (rp == NULL) {
@@ -106,22 +129,36 @@ namespace fluent {
     freeaddrinfo(result);
     return rc;
   }
-  bool Socket::send(void *data, size_t len) {
+  bool Socket::send(const void *data, size_t len) {
+    const char *ptr = static_cast<const char*>(data);
+    while (len > 0) {
 #ifdef _WIN32
-    if (SOCKET_ERROR == ::send(this->sock_, (char*)data, len, 0)) {
-      LPTSTR err = nullptr;
-      auto error = WSAGetLastError();
-      FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM,
-              nullptr, error, 0, (LPTSTR)&err, 0, nullptr);
-      this->errmsg_.assign(err);
+      int rc = ::send(this->sock_, ptr, len, 0);
+      if (SOCKET_ERROR == rc) {
+        auto error = WSAGetLastError();
+        if (error == WSAETIMEDOUT && !this->aborted_) {
+          continue;
+        }
+        LPTSTR err = nullptr;
+        FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER |
+                      FORMAT_MESSAGE_FROM_SYSTEM,
+                      nullptr, error, 0, (LPTSTR)&err, 0, nullptr);
+        this->errmsg_.assign(err);
 #else
-    if (0 > ::write(this->sock_, data, len)) {
-      this->errmsg_.assign(strerror(errno));
+      ssize_t rc = ::write(this->sock_, ptr, len);
+      if (0 > rc) {
+        if ((errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) &&
+            !this->aborted_) {
+          continue;
+        }
+        this->errmsg_.assign(strerror(errno));
 #endif // _WIN32
-      debug(false, "err: %s", this->errmsg_.c_str());
-      this->is_connected_ = false;
-      ::close(this->sock_);
-      return false;
+        debug(false, "err: %s", this->errmsg_.c_str());
+        this->close();
+        return false;
+      }
+      ptr += rc;
+      len -= rc;
     }
     return true;
   }
@@ -0,0 +1,1011 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <algorithm>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FLUENT_X86_SIMD
+#endif
+#include "./fluent/text.hpp"
+#include "./fluent/template.hpp"
+#include "./scan.h"
+
+namespace fluent {
+  static const int PACKED_DEPTH_MAX = 128;
+
+  // Two digits of 00 to 99.
+  static const char DIGITS[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+  // Characters to be escaped in JSON string: 0 is not escaped, 'u' is
+  // \u00XX and others are the escape character.
+  static const char ESCAPE[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+  };
+
+  // ----------------------------------------------------------------
+  // With SIMD, strings are validated as UTF-8 first, and then scanned for
+  // bytes to escape: control characters, '"' and '\\', by block of 16
+  // (SSE2) or 32 (AVX2) bytes. Otherwise, and for short or invalid
+  // strings, the scalar scanner checks 8 bytes at a time (SWAR) and stops
+  // also at non-ASCII bytes, which are validated sequence by sequence.
+  static const size_t BULK_MIN = 32;
+  typedef size_t (*ScanFunc)(const uint8_t *p, size_t len);
+  typedef bool (*ValidateFunc)(const uint8_t *p, size_t len);
+
+  static const uint64_t ONES = 0x0101010101010101ULL;
+  static const uint64_t HIGH = 0x8080808080808080ULL;
+
+  // Length of valid UTF-8 sequence at p, or 0 if it is invalid: overlong
+  // encoding, surrogate, over U+10FFFF or truncated.
+  static size_t utf8_length(const uint8_t *p, const uint8_t *end) {
+    uint8_t c = p[0];
+    size_t n;
+    uint8_t lo = 0x80, hi = 0xbf;   // Range of the second byte.
+    if (c >= 0xc2 && c <= 0xdf) {
+      n = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+      n = 3;
+      if (c == 0xe0) {
+        lo = 0xa0;
+      } else if (c == 0xed) {
+        hi = 0x9f;
+      }
+    } else if (c >= 0xf0 && c <= 0xf4) {
+      n = 4;
+      if (c == 0xf0) {
+        lo = 0x90;
+      } else if (c == 0xf4) {
+        hi = 0x8f;
+      }
+    } else {
+      return 0;
+    }
+    if (static_cast<size_t>(end - p) < n || p[1] < lo || p[1] > hi) {
+      return 0;
+    }
+    for (size_t i = 2; i < n; i++) {
+      if ((p[i] & 0xc0) != 0x80) {
+        return 0;
+      }
+    }
+    return n;
+  }
+
+  // Validate from p skipping ASCII words, return false at invalid byte.
+  static bool validate_scalar(const uint8_t *p, size_t len) {
+    const uint8_t *end = p + len;
+    while (p < end) {
+      if (end - p >= 8) {
+        uint64_t x;
+        memcpy(&x, p, sizeof(x));
+        if ((x & HIGH) == 0) {
+          p += 8;
+          continue;
+        }
+      }
+      if (*p < 0x80) {
+        p++;
+        continue;
+      }
+      size_t n = utf8_length(p, end);
+      if (n == 0) {
+        return false;
+      }
+      p += n;
+    }
+    return true;
+  }
+
+  // Scan bytes to escape, and also non-ASCII bytes if ASCII is true.
+  template <bool ASCII>
+  static size_t scan_scalar(const uint8_t *p, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+      uint64_t x;
+      memcpy(&x, p + i, sizeof(x));
+      uint64_t quote = x ^ (ONES * '"');
+      uint64_t bslash = x ^ (ONES * '\\');
+      // Byte under 0x20, and zero byte of quote or bslash. Bytes over 0x7f
+      // are masked by ~x.
+      uint64_t t = ((x - ONES * 0x20) & ~x) | ((quote - ONES) & ~quote) |
+        ((bslash - ONES) & ~bslash);
+      if (ASCII) {
+        t |= x;
+      }
+      if (t & HIGH) {
+        break;
+      }
+    }
+    while (i < len && ESCAPE[p[i]] == 0 && (!ASCII || p[i] < 0x80)) {
+      i++;
+    }
+    return i;
+  }
+
+#ifdef FLUENT_X86_SIMD
+  __attribute__((target("sse2")))
+  static size_t scan_sse2(const uint8_t *p, size_t len) {
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+      // Unsigned v <= 0x1f by max(v, 0x1f) == 0x1f.
+      __m128i t = _mm_or_si128(
+          _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl),
+          _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)));
+      int mask = _mm_movemask_epi8(t);
+      if (mask) {
+        return i + __builtin_ctz(mask);
+      }
+    }
+    return i + scan_scalar<false>(p + i, len - i);
+  }
+
+  // ASCII blocks are checked by the high bits at once.
+  __attribute__((target("sse2")))
+  static bool validate_sse2(const uint8_t *p, size_t len) {
+    size_t i = 0;
+    while (i + 16 <= len) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+      int mask = _mm_movemask_epi8(v);
+      if (mask == 0) {
+        i += 16;
+        continue;
+      }
+      // Validate sequences from the first non-ASCII byte to the end of
+      // the block, the last one may go over it.
+      size_t block_end = i + 16;
+      i += __builtin_ctz(mask);
+      while (i < block_end) {
+        if (p[i] < 0x80) {
+          i++;
+          continue;
+        }
+        size_t n = utf8_length(p + i, p + len);
+        if (n == 0) {
+          return false;
+        }
+        i += n;
+      }
+    }
+    return validate_scalar(p + i, len - i);
+  }
+
+  __attribute__((target("avx2")))
+  static size_t scan_avx2(const uint8_t *p, size_t len) {
+    const __m256i ctrl = _mm256_set1_epi8(0x1f);
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+      __m256i t = _mm256_or_si256(
+          _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrl), ctrl),
+          _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                          _mm256_cmpeq_epi8(v, bslash)));
+      uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(t));
+      if (mask) {
+        return i + __builtin_ctz(mask);
+      }
+    }
+    // Tail under 32 bytes by SWAR, not to mix legacy SSE code in.
+    return i + scan_scalar<false>(p + i, len - i);
+  }
+
+  // UTF-8 validation by table lookup of Keiser and Lemire, "Validating
+  // UTF-8 In Less Than One Instruction Per Byte" (2021). Each pair of
+  // bytes is classified by the high and low nibbles of the first byte and
+  // the high nibble of the second byte, and an error bit that all three
+  // tables agree on means an invalid pair. Sequences of 3 and 4 bytes are
+  // checked with bytes 2 and 3 before.
+  static const uint8_t TOO_SHORT = 1 << 0;
+  static const uint8_t TOO_LONG = 1 << 1;
+  static const uint8_t OVERLONG_3 = 1 << 2;
+  static const uint8_t TOO_LARGE = 1 << 3;
+  static const uint8_t SURROGATE = 1 << 4;
+  static const uint8_t OVERLONG_2 = 1 << 5;
+  static const uint8_t TOO_LARGE_1000 = 1 << 6;
+  static const uint8_t OVERLONG_4 = 1 << 6;
+  static const uint8_t TWO_CONTS = 1 << 7;
+  static const uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+  // Table of 16 bytes in both 128-bit lanes for _mm256_shuffle_epi8().
+  __attribute__((target("avx2")))
+  static inline __m256i table16(const uint8_t (&t)[16]) {
+    __m128i lane = _mm_loadu_si128(reinterpret_cast<const __m128i*>(t));
+    return _mm256_broadcastsi128_si256(lane);
+  }
+
+  // Bytes of input shifted by N from prev, i.e. N bytes before.
+  template <int N>
+  __attribute__((target("avx2")))
+  static inline __m256i prev_bytes(__m256i input, __m256i prev) {
+    return _mm256_alignr_epi8(input,
+                              _mm256_permute2x128_si256(prev, input, 0x21),
+                              16 - N);
+  }
+
+  static const uint8_t BYTE_1_HIGH[16] = {
+    // 0_______ ________ <ASCII in byte 1>
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    // 10______ ________ <continuation in byte 1>
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    // 1100____ ________ <two byte lead in byte 1>
+    TOO_SHORT | OVERLONG_2,
+    // 1101____ ________ <two byte lead in byte 1>
+    TOO_SHORT,
+    // 1110____ ________ <three byte lead in byte 1>
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    // 1111____ ________ <four+ byte lead in byte 1>
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+  };
+  static const uint8_t BYTE_1_LOW[16] = {
+    // ____0000 ________
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    // ____0001 ________
+    CARRY | OVERLONG_2,
+    // ____001_ ________
+    CARRY,
+    CARRY,
+    // ____0100 ________
+    CARRY | TOO_LARGE,
+    // ____0101 ________
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    // ____011_ ________
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    // ____1___ ________
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    // ____1101 ________
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+  };
+  static const uint8_t BYTE_2_HIGH[16] = {
+    // ________ 0_______ <ASCII in byte 2>
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    // ________ 1000____
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 |
+    OVERLONG_4,
+    // ________ 1001____
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    // ________ 101_____
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    // ________ 11______
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+  };
+
+  __attribute__((target("avx2")))
+  static inline __m256i check_block(__m256i input, __m256i prev_input) {
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i prev1 = prev_bytes<1>(input, prev_input);
+    __m256i byte_1_high = _mm256_shuffle_epi8(
+        table16(BYTE_1_HIGH),
+        _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+    __m256i byte_1_low = _mm256_shuffle_epi8(
+        table16(BYTE_1_LOW), _mm256_and_si256(prev1, nibble));
+    __m256i byte_2_high = _mm256_shuffle_epi8(
+        table16(BYTE_2_HIGH),
+        _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+    __m256i special = _mm256_and_si256(
+        _mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    // Third and fourth bytes of sequence must be continuation, where
+    // TWO_CONTS (0x80) is expected instead of error.
+    __m256i prev2 = prev_bytes<2>(input, prev_input);
+    __m256i prev3 = prev_bytes<3>(input, prev_input);
+    __m256i is_third = _mm256_subs_epu8(prev2,
+                                        _mm256_set1_epi8(0xe0 - 0x80));
+    __m256i is_fourth = _mm256_subs_epu8(prev3,
+                                         _mm256_set1_epi8(0xf0 - 0x80));
+    __m256i must23 = _mm256_and_si256(_mm256_or_si256(is_third, is_fourth),
+                                      _mm256_set1_epi8(0x80));
+    return _mm256_xor_si256(must23, special);
+  }
+
+  __attribute__((target("avx2")))
+  static bool validate_avx2(const uint8_t *p, size_t len) {
+    // Lead bytes in the last 3 bytes of block that need following bytes.
+    const __m256i max_value = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0xf0 - 1, 0xe0 - 1, 0xc0 - 1);
+    __m256i error = _mm256_setzero_si256();
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    uint8_t tail[32];
+    for (size_t i = 0; i < len; i += 32) {
+      __m256i input;
+      if (len - i >= 32) {
+        input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+      } else {
+        // Pad the last block with zeros.
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, p + i, len - i);
+        input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tail));
+      }
+      if (_mm256_movemask_epi8(input) == 0) {
+        // ASCII block, error if the previous block needs more bytes.
+        error = _mm256_or_si256(error, prev_incomplete);
+        prev_incomplete = _mm256_setzero_si256();
+      } else {
+        error = _mm256_or_si256(error, check_block(input, prev_input));
+        prev_incomplete = _mm256_subs_epu8(input, max_value);
+      }
+      prev_input = input;
+    }
+    error = _mm256_or_si256(error, prev_incomplete);
+    return _mm256_testz_si256(error, error);
+  }
+#endif
+
+  struct Scanners {
+    ScanFunc scan;
+    ValidateFunc validate;
+  };
+
+  static bool cpu_supports(TextEncoder::Scanner scanner) {
+    switch (scanner) {
+      case TextEncoder::ScalarScanner:
+        return true;
+#ifdef FLUENT_X86_SIMD
+      case TextEncoder::SSE2Scanner:
+        return __builtin_cpu_supports("sse2");
+      case TextEncoder::AVX2Scanner:
+        return __builtin_cpu_supports("avx2");
+#endif
+      default:
+        return false;
+    }
+  }
+
+  static const Scanners* scanners(TextEncoder::Scanner scanner) {
+    // Scalar one validates sequences while scanning, in a single pass.
+    static const Scanners SCALAR = {scan_scalar<true>, nullptr};
+#ifdef FLUENT_X86_SIMD
+    static const Scanners SSE2 = {scan_sse2, validate_sse2};
+    static const Scanners AVX2 = {scan_avx2, validate_avx2};
+    switch (scanner) {
+      case TextEncoder::SSE2Scanner: return &SSE2;
+      case TextEncoder::AVX2Scanner: return &AVX2;
+      default: break;
+    }
+#endif
+    return &SCALAR;
+  }
+
+  static TextEncoder::Scanner best_scanner() {
+    if (cpu_supports(TextEncoder::AVX2Scanner)) {
+      return TextEncoder::AVX2Scanner;
+    } else if (cpu_supports(TextEncoder::SSE2Scanner)) {
+      return TextEncoder::SSE2Scanner;
+    }
+    return TextEncoder::ScalarScanner;
+  }
+
+  static std::atomic<TextEncoder::Scanner> current_scanner(best_scanner());
+  static std::atomic<const Scanners*> current_scanners(
+      scanners(best_scanner()));
+
+  bool TextEncoder::set_scanner(Scanner scanner) {
+    if (!cpu_supports(scanner)) {
+      return false;
+    }
+    current_scanner = scanner;
+    current_scanners = scanners(scanner);
+    return true;
+  }
+  TextEncoder::Scanner TextEncoder::scanner() {
+    return current_scanner;
+  }
+
+  // Write digits of val backward from end, return the first digit.
+  static char* format_uint(uint64_t val, char *end) {
+    char *p = end;
+    while (val >= 100) {
+      size_t i = (val % 100) * 2;
+      val /= 100;
+      p -= 2;
+      p[0] = DIGITS[i];
+      p[1] = DIGITS[i + 1];
+    }
+    if (val >= 10) {
+      size_t i = val * 2;
+      p -= 2;
+      p[0] = DIGITS[i];
+      p[1] = DIGITS[i + 1];
+    } else {
+      *--p = static_cast<char>('0' + val);
+    }
+    return p;
+  }
+
+  TextEncoder::TextEncoder(size_t reserve) :
+    buf_(nullptr), size_(0), cap_(0), time_sec_(0), time_valid_(false),
+    time_len_(0) {
+    if (reserve > 0) {
+      this->grow(reserve);
+    }
+  }
+  TextEncoder::~TextEncoder() {
+    free(this->buf_);
+  }
+
+  void TextEncoder::grow(size_t need) {
+    size_t cap = (this->cap_ > 0) ? this->cap_ : 256;
+    while (cap < need) {
+      cap *= 2;
+    }
+    char *buf = static_cast<char*>(realloc(this->buf_, cap));
+    if (buf == nullptr) {
+      throw std::bad_alloc();
+    }
+    this->buf_ = buf;
+    this->cap_ = cap;
+  }
+
+  void TextEncoder::put_int(int64_t val) {
+    char tmp[24];
+    char *end = tmp + sizeof(tmp);
+    // Negate in unsigned not to overflow by INT64_MIN.
+    uint64_t u = (val < 0) ? 0 - static_cast<uint64_t>(val) :
+      static_cast<uint64_t>(val);
+    char *p = format_uint(u, end);
+    if (val < 0) {
+      *--p = '-';
+    }
+    this->put(p, end - p);
+  }
+
+  void TextEncoder::put_uint(uint64_t val) {
+    char tmp[24];
+    char *end = tmp + sizeof(tmp);
+    char *p = format_uint(val, end);
+    this->put(p, end - p);
+  }
+
+  // Exact powers of ten as double.
+  static const double POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+  };
+
+  void TextEncoder::put_double(double val) {
+    if (isnan(val) || isinf(val)) {
+      this->put("null", 4);
+      return;
+    }
+    if (val == 0) {
+      this->put(signbit(val) ? "-0.0" : "0.0", signbit(val) ? 4 : 3);
+      return;
+    }
+
+    // Fast path for values of fixed notation: find the fewest decimals k
+    // such that integer m = val * 10^k gives back val by m / 10^k. m is
+    // exact under 2^53 and division by exact power of ten is correctly
+    // rounded, so m * 10^-k is the shortest decimal reading back to val.
+    double a = fabs(val);
+    if (a >= 1e-4 && a < 1e15) {
+      for (int k = 0; k < 23 && a * POW10[k] < 9007199254740992.0; k++) {
+        double m = floor(a * POW10[k] + 0.5);
+        if (m / POW10[k] != a) {
+          continue;
+        }
+        char tmp[48];
+        char *end = tmp + sizeof(tmp);
+        char *p = format_uint(static_cast<uint64_t>(m), end);
+        // Pad zeros to have an integer digit, e.g. 0.05.
+        while (end - p <= k) {
+          *--p = '0';
+        }
+        char *dst = this->reserve((end - p) + 3);
+        char *q = dst;
+        if (val < 0) {
+          *q++ = '-';
+        }
+        size_t int_len = (end - p) - k;
+        memcpy(q, p, int_len);
+        q += int_len;
+        *q++ = '.';
+        if (k == 0) {
+          *q++ = '0';
+        } else {
+          memcpy(q, p + int_len, k);
+          q += k;
+        }
+        this->size_ += q - dst;
+        return;
+      }
+    }
+
+    // Shortest precision that reads back to the same value. Any decimal of
+    // 15 digits survives the round trip, so %.15g is already the shortest
+    // one for such values, and others need 16 or 17 digits.
+    char tmp[32];
+    int len = 0;
+    for (int prec = 15; prec <= 17; prec++) {
+      len = snprintf(tmp, sizeof(tmp), "%.*g", prec, val);
+      if (prec == 17 || strtod(tmp, nullptr) == val) {
+        break;
+      }
+    }
+    this->put(tmp, len);
+    // Keep it floating point number, e.g. 1e+20 is fine but not 1234.
+    if (strpbrk(tmp, ".e") == nullptr) {
+      this->put(".0", 2);
+    }
+  }
+
+  void TextEncoder::put_string(const char *data, size_t len) {
+    // At most 6 bytes (\u00XX or \ufffd) for each byte and quotes.
+    char *dst = this->reserve(len * 6 + 2);
+    char *p = dst;
+    *p++ = '"';
+    const uint8_t *src = reinterpret_cast<const uint8_t*>(data);
+    const uint8_t *end = src + len;
+    ScanFunc scan = scan_scalar<true>;
+    if (len >= BULK_MIN) {
+      const Scanners *sc = current_scanners.load(std::memory_order_relaxed);
+      if (sc->validate && sc->validate(src, len)) {
+        scan = sc->scan;
+      }
+    }
+    while (src < end) {
+      // Copy run of characters not escaped at once.
+      size_t run = scan(src, end - src);
+      memcpy(p, src, run);
+      p += run;
+      src += run;
+      if (src == end) {
+        break;
+      }
+
+      uint8_t c = *src;
+      if (c >= 0x80) {
+        // Copy valid UTF-8 sequences and replace an invalid byte.
+        const uint8_t *seq = src;
+        size_t n;
+        while (src < end && *src >= 0x80 &&
+               (n = utf8_length(src, end)) > 0) {
+          src += n;
+        }
+        memcpy(p, seq, src - seq);
+        p += src - seq;
+        if (src < end && *src >= 0x80) {
+          memcpy(p, "\\ufffd", 6);
+          p += 6;
+          src++;
+        }
+        continue;
+      }
+
+      char esc = ESCAPE[c];
+      *p++ = '\\';
+      if (esc == 'u') {
+        static const char HEX[] = "0123456789abcdef";
+        p[0] = 'u';
+        p[1] = '0';
+        p[2] = '0';
+        p[3] = HEX[c >> 4];
+        p[4] = HEX[c & 0x0f];
+        p += 5;
+      } else {
+        *p++ = esc;
+      }
+      src++;
+    }
+    *p++ = '"';
+    this->size_ += p - dst;
+  }
+
+  void TextEncoder::put_key(const std::string &key) {
+    this->put_string(key.data(), key.size());
+    this->put(": ", 2);
+  }
+
+  void TextEncoder::put_time(time_t sec, long nsec, bool event_time) {
+    if (!this->time_valid_ || sec != this->time_sec_) {
+      struct tm tm;
+      bool ok = (gmtime_r(&sec, &tm) != nullptr);
+      long long year = ok ? tm.tm_year + 1900LL : 0;
+      if (!ok || year < 0 || year > 9999) {
+        int len;
+        if (ok) {
+          len = snprintf(this->time_, sizeof(this->time_),
+                         "%lld-%02d-%02dT%02d:%02d:%02d", year, tm.tm_mon + 1,
+                         tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+        } else {
+          // Beyond struct tm, e.g. huge time from a broken dumpfile.
+          len = snprintf(this->time_, sizeof(this->time_), "%lld",
+                         static_cast<long long>(sec));
+        }
+        this->time_len_ = std::min(static_cast<size_t>(len),
+                                   sizeof(this->time_) - 1);
+      } else {
+        char *p = this->time_;
+        const int fields[] = {
+          static_cast<int>(year / 100), static_cast<int>(year % 100),
+          tm.tm_mon + 1, tm.tm_mday,
+          tm.tm_hour, tm.tm_min, tm.tm_sec,
+        };
+        const char seps[] = {0, '-', '-', 'T', ':', ':', 0};
+        for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+          memcpy(p, DIGITS + fields[i] * 2, 2);
+          p += 2;
+          if (seps[i]) {
+            *p++ = seps[i];
+          }
+        }
+        this->time_len_ = p - this->time_;
+      }
+      this->time_sec_ = sec;
+      this->time_valid_ = true;
+    }
+
+    // YYYY-MM-DDTHH:MM:SS.nnnnnnnnn+00:00
+    char *dst = this->reserve(this->time_len_ + 16);
+    char *p = dst;
+    memcpy(p, this->time_, this->time_len_);
+    p += this->time_len_;
+    if (event_time) {
+      *p++ = '.';
+      uint32_t n = static_cast<uint32_t>(nsec);
+      for (int i = 8; i >= 0; i--) {
+        p[i] = static_cast<char>('0' + n % 10);
+        n /= 10;
+      }
+      p += 9;
+    }
+    memcpy(p, "+00:00", 6);
+    p += 6;
+    this->size_ += p - dst;
+  }
+
+  void TextEncoder::put_object(const Message::Object *obj) {
+    switch (obj->tag()) {
+      case Message::Object::MapType: {
+        const Message::Map *map = static_cast<const Message::Map*>(obj);
+        this->put('{');
+        for (auto it = map->map_.begin(); it != map->map_.end(); it++) {
+          if (it != map->map_.begin()) {
+            this->put(", ", 2);
+          }
+          this->put_key(it->name());
+          this->put_object(it->val);
+        }
+        this->put('}');
+        break;
+      }
+      case Message::Object::ArrayType: {
+        const Message::Array *arr = static_cast<const Message::Array*>(obj);
+        this->put('[');
+        for (size_t i = 0; i < arr->array_.size(); i++) {
+          if (i > 0) {
+            this->put(", ", 2);
+          }
+          this->put_object(arr->array_[i]);
+        }
+        this->put(']');
+        break;
+      }
+      case Message::Object::StringType: {
+        const std::string &s = static_cast<const Message::String*>(obj)->val();
+        this->put_string(s.data(), s.size());
+        break;
+      }
+      case Message::Object::FixnumType:
+        this->put_int(static_cast<const Message::Fixnum*>(obj)->val());
+        break;
+      case Message::Object::UfixnumType:
+        this->put_uint(static_cast<const Message::Ufixnum*>(obj)->val());
+        break;
+      case Message::Object::FloatType:
+        this->put_double(static_cast<const Message::Float*>(obj)->val());
+        break;
+      case Message::Object::BoolType:
+        if (static_cast<const Message::Bool*>(obj)->val()) {
+          this->put("true", 4);
+        } else {
+          this->put("false", 5);
+        }
+        break;
+      case Message::Object::BinaryType: {
+        const std::string &s = static_cast<const Message::Binary*>(obj)->val();
+        this->put_string(s.data(), s.size());
+        break;
+      }
+      case Message::Object::ExtType: {
+        const std::string &s = static_cast<const Message::Ext*>(obj)->data();
+        this->put_string(s.data(), s.size());
+        break;
+      }
+      case Message::Object::NilType:
+        this->put("null", 4);
+        break;
+    }
+  }
+
+  const char* TextEncoder::put_packed(const char *p, const char *end,
+                                      int depth) {
+    PackedHeader h;
+    if (depth > PACKED_DEPTH_MAX || scan_packed(p, end, &h) != ScanOk) {
+      return nullptr;
+    }
+    p += h.hdr;
+
+    switch (h.type) {
+      case PackedNil: this->put("null", 4); break;
+      case PackedBool:
+        if (h.val) {
+          this->put("true", 4);
+        } else {
+          this->put("false", 5);
+        }
+        break;
+      case PackedUint: this->put_uint(h.val); break;
+      case PackedInt: this->put_int(static_cast<int64_t>(h.val)); break;
+      case PackedFloat: this->put_double(packed_float(h)); break;
+      case PackedStr:
+      case PackedBin:
+      case PackedExt:
+        this->put_string(p, h.len);
+        break;
+      case PackedArray:
+      case PackedMap: {
+        // Array or map of h.len elements.
+        bool is_map = (h.type == PackedMap);
+        this->put(is_map ? '{' : '[');
+        for (uint64_t i = 0; i < h.len && p; i++) {
+          if (i > 0) {
+            this->put(", ", 2);
+          }
+          p = is_map ? this->put_packed_key(p, end, depth + 1) :
+            this->put_packed(p, end, depth + 1);
+          if (is_map && p) {
+            this->put(": ", 2);
+            p = this->put_packed(p, end, depth + 1);
+          }
+        }
+        this->put(is_map ? '}' : ']');
+        return p;
+      }
+    }
+    return p + h.len;
+  }
+
+  const char* TextEncoder::put_packed_key(const char *p, const char *end,
+                                          int depth) {
+    PackedHeader h;
+    if (scan_packed(p, end, &h) == ScanOk &&
+        (h.type == PackedStr || h.type == PackedBin || h.type == PackedExt)) {
+      // str, bin and ext are written as string.
+      return this->put_packed(p, end, depth);
+    }
+    size_t start = this->size_;
+    p = this->put_packed(p, end, depth);
+    if (p) {
+      const std::string key(this->buf_ + start, this->size_ - start);
+      this->size_ = start;
+      this->put_string(key.data(), key.size());
+    }
+    return p;
+  }
+
+  void TextEncoder::put_ltsv(const char *data, size_t len, bool label) {
+    // At most 2 bytes for each byte.
+    char *dst = this->reserve(len * 2);
+    char *p = dst;
+    for (size_t i = 0; i < len; i++) {
+      char c = data[i];
+      switch (c) {
+        case '\t': *p++ = '\\'; *p++ = 't'; break;
+        case '\n': *p++ = '\\'; *p++ = 'n'; break;
+        case '\r': *p++ = '\\'; *p++ = 'r'; break;
+        case '\\': *p++ = '\\'; *p++ = '\\'; break;
+        case ':': *p++ = label ? '_' : ':'; break;
+        default: *p++ = c; break;
+      }
+    }
+    this->size_ += p - dst;
+  }
+
+  void TextEncoder::put_ltsv_object(const Message::Object *obj) {
+    switch (obj->tag()) {
+      case Message::Object::StringType: {
+        const std::string &s = static_cast<const Message::String*>(obj)->val();
+        this->put_ltsv(s.data(), s.size());
+        break;
+      }
+      case Message::Object::BinaryType: {
+        const std::string &s = static_cast<const Message::Binary*>(obj)->val();
+        this->put_ltsv(s.data(), s.size());
+        break;
+      }
+      default:
+        this->put_object(obj);
+        break;
+    }
+  }
+
+  const char* TextEncoder::put_ltsv_packed(const char *p, const char *end,
+                                           bool label) {
+    PackedHeader h;
+    if (scan_packed(p, end, &h) != ScanOk) {
+      return nullptr;
+    }
+    if (h.type == PackedStr || h.type == PackedBin) {
+      this->put_ltsv(p + h.hdr, h.len, label);
+      return p + h.hdr + h.len;
+    }
+    size_t start = this->size_;
+    p = this->put_packed(p, end, 0);
+    if (label) {
+      // Label of JSON text, such as an array key.
+      std::replace(this->buf_ + start, this->buf_ + this->size_, ':', '_');
+    }
+    return p;
+  }
+
+  bool TextEncoder::put_packed_entries(const char *data, size_t len,
+                                       size_t count, bool ltsv, bool *first) {
+    const char *p = data, *end = data + len;
+    for (size_t i = 0; i < count && p; i++) {
+      if (ltsv) {
+        this->put('\t');
+        p = this->put_ltsv_packed(p, end, true);
+        if (p) {
+          this->put(':');
+          p = this->put_ltsv_packed(p, end, false);
+        }
+        continue;
+      }
+
+      if (!*first) {
+        this->put(", ", 2);
+      }
+      *first = false;
+      p = this->put_packed_key(p, end, 0);
+      if (p) {
+        this->put(": ", 2);
+        p = this->put_packed(p, end, 0);
+      }
+    }
+    return p != nullptr;
+  }
+
+  bool TextEncoder::put_fields(const Message &msg, bool ltsv) {
+    // Encoded fields of Template and Builder first, and then fields of Map,
+    // as to_msgpack().
+    bool first = true;
+    if (msg.tmpl_ &&
+        !this->put_packed_entries(msg.tmpl_->data().data(),
+                                  msg.tmpl_->data().size(),
+                                  msg.tmpl_->count(), ltsv, &first)) {
+      return false;
+    }
+    if (msg.raw_ &&
+        !this->put_packed_entries(msg.raw_->data(), msg.raw_->size(),
+                                  msg.raw_count_, ltsv, &first)) {
+      return false;
+    }
+    const Message::Map *map = msg.root_;
+    for (auto it = map->map_.begin(); it != map->map_.end(); it++) {
+      if (ltsv) {
+        this->put('\t');
+        this->put_ltsv(it->name().data(), it->name().size(), true);
+        this->put(':');
+        this->put_ltsv_object(it->val);
+        continue;
+      }
+
+      if (!first) {
+        this->put(", ", 2);
+      }
+      first = false;
+      this->put_key(it->name());
+      this->put_object(it->val);
+    }
+    return true;
+  }
+
+  bool TextEncoder::encode(const Message &msg) {
+    size_t start = this->size_;
+    this->put_time(msg.ts_, msg.ts_nsec_, msg.event_time_);
+    this->put('\t');
+    this->put(msg.tag_.data(), msg.tag_.size());
+    this->put("\t{", 2);
+    if (!this->put_fields(msg, false)) {
+      this->size_ = start;
+      return false;
+    }
+    this->put("}\n", 2);
+    return true;
+  }
+
+  bool TextEncoder::encode_json(const Message &msg) {
+    size_t start = this->size_;
+    this->put("{\"tag\": ", 8);
+    this->put_string(msg.tag_.data(), msg.tag_.size());
+    this->put(", \"time\": \"", 11);
+    this->put_time(msg.ts_, msg.ts_nsec_, msg.event_time_);
+    this->put("\", \"record\": {", 14);
+    if (!this->put_fields(msg, false)) {
+      this->size_ = start;
+      return false;
+    }
+    this->put("}}\n", 3);
+    return true;
+  }
+
+  bool TextEncoder::encode_ltsv(const Message &msg) {
+    size_t start = this->size_;
+    this->put("time:", 5);
+    this->put_time(msg.ts_, msg.ts_nsec_, msg.event_time_);
+    this->put("\ttag:", 5);
+    this->put_ltsv(msg.tag_.data(), msg.tag_.size());
+    if (!this->put_fields(msg, true)) {
+      this->size_ = start;
+      return false;
+    }
+    this->put('\n');
+    return true;
+  }
+
+  void TextEncoder::encode(const Message::Object &obj) {
+    this->put_object(&obj);
+  }
+}
@@ -41,7 +41,7 @@
 
 
 TEST_F(FluentTest, InetEmitter) {
-  fluent::InetEmitter *e = new fluent::InetEmitter("localhost", 24224);
+  fluent::InetEmitter *e = new fluent::InetEmitter("localhost", port());
   const std::string tag = "test.inet";
   fluent::Message *msg = new fluent::Message(tag);
   msg->set("url", "https://github.com");
@@ -50,15 +50,19 @@ TEST_F(FluentTest, InetEmitter) {
   // msg should be deleted by Emitter after sending
   e->emit(msg);
   
-  std::string res_tag, res_ts, res_rec;
-  EXPECT_TRUE(get_line(&res_tag, &res_ts, &res_rec));
-  EXPECT_EQ(tag, res_tag);
-  EXPECT_EQ("{\"port\"=>443, \"url\"=>\"https://github.com\"}", res_rec);
+  fluent::Message *res = get_message();
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(tag, res->tag());
+  EXPECT_EQ(443, res->get("port").as<fluent::Message::Fixnum>().val());
+  EXPECT_EQ("https://github.com",
+            res->get("url").as<fluent::Message::String>().val());
+  delete res;
   delete e;
 }
 
 TEST_F(FluentTest, InetEmitter_with_string_portnum) {
-  fluent::InetEmitter *e = new fluent::InetEmitter("localhost", "24224");
+  fluent::InetEmitter *e =
+    new fluent::InetEmitter("localhost", std::to_string(port()));
   const std::string tag = "test.inet";
   fluent::Message *msg = new fluent::Message(tag);
   msg->set("url", "https://github.com");
@@ -67,10 +71,13 @@ TEST_F(FluentTest, InetEmitter_with_string_portnum) {
   // msg should be deleted by Emitter after sending
   e->emit(msg);
   
-  std::string res_tag, res_ts, res_rec;
-  EXPECT_TRUE(get_line(&res_tag, &res_ts, &res_rec));
-  EXPECT_EQ(res_tag, tag);
-  EXPECT_EQ(res_rec, "{\"port\"=>443, \"url\"=>\"https://github.com\"}");
+  fluent::Message *res = get_message();
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(tag, res->tag());
+  EXPECT_EQ(443, res->get("port").as<fluent::Message::Fixnum>().val());
+  EXPECT_EQ("https://github.com",
+            res->get("url").as<fluent::Message::String>().val());
+  delete res;
   delete e;
 }
 
@@ -222,3 +229,28 @@ TEST(QueueEmitter, basic) {
   // No messages.
   EXPECT_TRUE(nullptr == q->pop());
 }
+
+TEST(FileEmitter, flush) {
+  struct stat st;
+  const std::string fname = "fileemitter_test_flush.msg";
+  if (0 == ::stat(fname.c_str(), &st)) {
+    ASSERT_TRUE(0 == unlink(fname.c_str()));
+  }
+
+  fluent::FileEmitter *e = new fluent::FileEmitter(fname);
+  fluent::Message *msg = new fluent::Message("test.file");
+  msgpack::sbuffer sbuf;
+  msgpack::packer<msgpack::sbuffer> pkr(&sbuf);
+  msg->set("num", 1);
+  msg->to_msgpack(&pkr);
+  EXPECT_TRUE(e->emit(msg));
+
+  EXPECT_TRUE(e->flush(3000));
+  ASSERT_EQ(0, ::stat(fname.c_str(), &st));
+  EXPECT_EQ(sbuf.size(), st.st_size);
+
+  EXPECT_EQ(0, e->shutdown(1000));
+  EXPECT_EQ(0, e->lost());
+  delete e;
+  EXPECT_TRUE(0 == unlink(fname.c_str()));
+}
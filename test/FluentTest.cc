@@ -27,7 +27,7 @@
 #include "./FluentTest.hpp"
 #include <unistd.h>
 
-FluentTest::FluentTest() : pid_(0) {
+FluentTest::FluentTest() : server_(nullptr), port_(0) {
 }
 
 FluentTest::~FluentTest() {
@@ -38,94 +38,39 @@ void FluentTest::SetUp() {
 }
 
 void FluentTest::TearDown() {
-  if (this->pid_ > 0) {
+  if (this->server_) {
     stop_fluent();
   }
 }
 
 void FluentTest::start_fluent() {
-  int pipe_c2p[2];
-  ASSERT_TRUE(pipe(pipe_c2p) >= 0);
-    
-  pid_t pid = fork();
-  if (pid == 0) {
-    // Running as child.
-    std::vector<std::string> arg = {
-      // "./test/helper/tcp_server.rb",
-    };
-
-    /*
-    char *argv = new char*[arg.size() + 1];
-    for (size_t i = 0; i < arg.size(); i++) {
-      argv[i] = const_cast<char*>(arg[i].c_str());
-    }
-    argv[arg.size()] = NULL;
-    */
-    char *argv[1];
-    argv[0] = NULL;
-    
-    close(pipe_c2p[RP]);
-    dup2(pipe_c2p[WP], 1);
-    close(pipe_c2p[WP]);
-
-    if (execvp("./test/helper/tcp_server.rb", static_cast<char *const *>(argv)) < 0) {
-      perror("execvp");        
-    }
-  } else {
-    // Running as parent.
-    this->pid_ = pid;
-
-     int flags = fcntl(pipe_c2p[RP], F_GETFL, 0);
-    flags |= O_NONBLOCK;
-    fcntl(pipe_c2p[RP], F_SETFL, flags);
-       
-    this->pipe_fd_ = pipe_c2p[RP];
-    this->pipe_ = fdopen(this->pipe_fd_, "r");
-    ASSERT_TRUE(this->pipe_ != NULL);
-  }
+  this->server_ = new fluent::ForwardServer();
+  ASSERT_TRUE(this->server_->listen("127.0.0.1"));
+  this->port_ = this->server_->port();
+  this->server_->set_handler([this](fluent::Message *msg) {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      this->msgs_.push_back(msg);
+      this->cond_.notify_all();
+    });
+  ASSERT_TRUE(this->server_->start());
 }
 
 void FluentTest::stop_fluent() {
-  kill(this->pid_, SIGINT);
-  int stat;
-  int rc = waitpid(this->pid_, &stat, 0);
-  ASSERT_EQ(this->pid_, rc);
-  this->pid_ = 0;
-  close(this->pipe_fd_);
+  delete this->server_;
+  this->server_ = nullptr;
+  for (auto msg : this->msgs_) {
+    delete msg;
+  }
+  this->msgs_.clear();
 }
-  
-bool FluentTest::get_line(std::string *tag, std::string *ts, std::string *rec,
-                          time_t timeout) {
-  static const bool DBG = false;
-  char buf[BUFSIZ];
 
-  time_t start_ts = time(nullptr);
-  char *res;
-  while (nullptr == (res = fgets(buf, BUFSIZ, this->pipe_))) {
-    usleep(100000);
-    if (time(nullptr) - start_ts >= timeout) {
-      return false;
-    }
+fluent::Message* FluentTest::get_message(time_t timeout) {
+  std::unique_lock<std::mutex> lock(this->mutex_);
+  if (!this->cond_.wait_for(lock, std::chrono::seconds(timeout),
+                            [this] { return !this->msgs_.empty(); })) {
+    return nullptr;
   }
-    
-  std::string line(buf);
-
-  size_t tag_ptr = line.find(" ");
-  size_t ts_ptr  = line.find(" ", tag_ptr + 1);
-  size_t rec_ptr = line.find(" ", ts_ptr + 1);
-
-  debug(DBG, "tag_ptr = %lu", tag_ptr);
-  debug(DBG, "ts_ptr  = %lu", ts_ptr);
-  debug(DBG, "rec_ptr = %lu", rec_ptr);
-
-  tag->assign(line, 0, tag_ptr);
-  ts->assign(line,  tag_ptr + 1, ts_ptr - tag_ptr);
-  rec->assign(line, ts_ptr + 1, line.length() - 2 - ts_ptr);
-  debug(DBG, "ts=%s", ts->c_str());
-  debug(DBG, "msg=%s", rec->c_str());
-  debug(DBG, "%s", line.c_str());
-  
-  return true;
+  fluent::Message *msg = this->msgs_.front();
+  this->msgs_.pop_front();
+  return msg;
 }
-
-
@@ -33,25 +33,28 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <signal.h>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 
 
 #include "./gtest.h"
 #include "../src/fluent/emitter.hpp"
+#include "../src/fluent/server.hpp"
 
 #include "../src/debug.h"
 
 
+// Runs ForwardServer in process, on a free port of localhost.
 class FluentTest : public ::testing::Test {
 private:
-  enum {
-    RP = 0, WP = 1
-  };
-  int pipe_fd_;
-  pid_t pid_;
+  fluent::ForwardServer *server_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<fluent::Message*> msgs_;
+  int port_;
   
 protected:
-  FILE *pipe_;
-
   FluentTest();
   virtual ~FluentTest();
 
@@ -59,8 +62,10 @@ protected:
   virtual void TearDown();
   void start_fluent();
   void stop_fluent();
-  bool get_line(std::string *tag, std::string *ts, std::string *rec,
-                time_t timeout=10);
+  int port() const { return this->port_; }
+  // Return a message received by the server, or nullptr on timeout.
+  // Caller owns the message.
+  fluent::Message* get_message(time_t timeout=10);
 };
 
 
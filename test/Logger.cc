@@ -40,17 +40,20 @@
 
 TEST_F(FluentTest, Logger) {
   fluent::Logger *logger = new fluent::Logger();
-  logger->new_forward("localhost", 24224);
+  logger->new_forward("localhost", port());
   
   const std::string tag = "test.http";
   fluent::Message *msg = logger->retain_message(tag);
   msg->set("url", "https://github.com");
   msg->set("port", 443);
   logger->emit(msg);
-  std::string res_tag, res_ts, res_rec;
-  get_line(&res_tag, &res_ts, &res_rec);
-  EXPECT_EQ(res_tag, tag);
-  EXPECT_EQ(res_rec, "{\"port\"=>443, \"url\"=>\"https://github.com\"}");
+  fluent::Message *res = get_message();
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(tag, res->tag());
+  EXPECT_EQ(443, res->get("port").as<fluent::Message::Fixnum>().val());
+  EXPECT_EQ("https://github.com",
+            res->get("url").as<fluent::Message::String>().val());
+  delete res;
 
   delete logger;
 }
@@ -85,6 +88,34 @@ TEST(Logger, textfile) {
   EXPECT_TRUE(0 == unlink(fname.c_str()));
 }
 
+TEST(Logger, ltsvfile) {
+  struct stat st;
+  const std::string fname = "logger_test_output.ltsv";
+  if (0 == ::stat(fname.c_str(), &st)) {
+    ASSERT_TRUE(0 == unlink(fname.c_str()));
+  }
+
+  fluent::Logger *logger = new fluent::Logger();
+  logger->new_ltsvfile(fname);
+  fluent::Message *msg = logger->retain_message("test.file");
+  msg->set("num", 1);
+  msg->set_ts(1514633395);
+  EXPECT_TRUE(logger->emit(msg));
+  delete logger;
+
+  ASSERT_EQ (0, ::stat(fname.c_str(), &st));
+  char buf[BUFSIZ];
+  int fd = ::open(fname.c_str(), O_RDONLY);
+  ASSERT_TRUE(fd > 0);
+  int readsize = ::read(fd, buf, sizeof(buf));
+  ASSERT_TRUE(readsize > 0);
+  ::close(fd);
+
+  EXPECT_EQ("time:2017-12-30T11:29:55+00:00\ttag:test.file\tnum:1\n",
+            std::string(buf, readsize));
+  EXPECT_TRUE(0 == unlink(fname.c_str()));
+}
+
 
 /*
  * Disabled because of unstable
@@ -148,6 +179,50 @@ TEST(Logger, QueueEmitter) {
   delete logger;
 }
 
+TEST(Logger, schema) {
+  fluent::Logger *logger = new fluent::Logger();
+  fluent::MsgQueue *q = logger->new_msgqueue();
+  logger->set_tag_prefix("web");
+  const fluent::Schema<std::string, int> schema("race", "level");
+  EXPECT_TRUE(logger->emit("access", schema, "gnome", 3));
+
+  fluent::Message *msg = q->pop();
+  ASSERT_TRUE(msg != nullptr);
+  EXPECT_EQ("web.access", msg->tag());
+  std::stringstream ss;
+  msg->to_ostream(ss);
+  EXPECT_NE(std::string::npos,
+            ss.str().find("\t{\"race\": \"gnome\", \"level\": 3}\n"));
+  delete msg;
+
+  delete logger;
+}
+
+TEST(Logger, template) {
+  fluent::Logger *logger = new fluent::Logger();
+  fluent::MsgQueue *q = logger->new_msgqueue();
+  fluent::Message base("base");
+  base.set("race", "gnome");
+  const fluent::Template *tmpl = logger->new_template(base);
+  fluent::Message *msg = logger->retain_message("access", tmpl);
+  msg->set("level", 3);
+  EXPECT_TRUE(logger->emit(msg));
+
+  msg = q->pop();
+  ASSERT_TRUE(msg != nullptr);
+  std::stringstream ss;
+  msg->to_ostream(ss);
+  EXPECT_NE(std::string::npos,
+            ss.str().find("\t{\"race\": \"gnome\", \"level\": 3}\n"));
+
+  // Message can live longer than logger.
+  delete logger;
+  std::stringstream ss2;
+  msg->to_ostream(ss2);
+  EXPECT_EQ(ss.str(), ss2.str());
+  delete msg;
+}
+
 TEST(Logger, TagPrefix) {
   fluent::Logger *logger = new fluent::Logger();
   fluent::Message* noprefix_msg = logger->retain_message("blue");
@@ -157,3 +232,54 @@ TEST(Logger, TagPrefix) {
   fluent::Message *withprefix_msg = logger->retain_message("blue");
   EXPECT_EQ(withprefix_msg->tag(), "dark.blue");
 }
+
+TEST(Logger, flush) {
+  struct stat st;
+  const std::string fname = "logger_test_flush.msg";
+  if (0 == ::stat(fname.c_str(), &st)) {
+    ASSERT_TRUE(0 == unlink(fname.c_str()));
+  }
+
+  fluent::Logger *logger = new fluent::Logger();
+  logger->new_dumpfile(fname);
+  msgpack::sbuffer sbuf;
+  msgpack::packer<msgpack::sbuffer> pkr(&sbuf);
+  for (int i = 0; i < 100; i++) {
+    fluent::Message *msg = logger->retain_message("test.flush");
+    msg->set("seq", i);
+    msg->to_msgpack(&pkr);
+    EXPECT_TRUE(logger->emit(msg));
+  }
+
+  // All messages should be written before deleting logger.
+  size_t lost = 1;
+  EXPECT_TRUE(logger->flush(3000, &lost));
+  EXPECT_EQ(0, lost);
+  ASSERT_EQ(0, ::stat(fname.c_str(), &st));
+  EXPECT_EQ(sbuf.size(), st.st_size);
+
+  delete logger;
+  EXPECT_TRUE(0 == unlink(fname.c_str()));
+}
+
+TEST(Logger, shutdown_with_deadline) {
+  fluent::Logger *logger = new fluent::Logger();
+  // Nobody listens on the port, so messages can not be sent.
+  logger->new_forward("127.0.0.1", 1);
+  for (int i = 0; i < 3; i++) {
+    fluent::Message *msg = logger->retain_message("test.shutdown");
+    msg->set("seq", i);
+    EXPECT_TRUE(logger->emit(msg));
+  }
+
+  time_t start = time(nullptr);
+  EXPECT_EQ(3, logger->shutdown(200));
+  EXPECT_GE(2, time(nullptr) - start);
+
+  // Logger does not accept messages after shutdown.
+  fluent::Message *msg = logger->retain_message("test.shutdown");
+  EXPECT_FALSE(logger->emit(msg));
+  EXPECT_EQ(4, logger->lost());
+
+  delete logger;
+}
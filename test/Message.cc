@@ -31,6 +31,8 @@
 #include <signal.h>
 #include "./gtest.h"
 #include "../src/fluent/message.hpp"
+#include "../src/fluent/schema.hpp"
+#include "../src/fluent/template.hpp"
 #include "../src/fluent/exception.hpp"
 #include "../src/debug.h"
 
@@ -368,6 +370,147 @@ TEST(Message, MapGetObject) {
   delete obj;
 }
 
+TEST(Message, MapKeyOrder) {
+  fluent::Message::Map map;
+  map.set("magic", 1);
+  map.set("blue", 2);
+  map.set("zombie", 3);
+  map.set("arcane", 4);
+  map.set("blue", 5);
+  EXPECT_EQ(4, map.size());
+  EXPECT_TRUE(map.del("magic"));
+  EXPECT_FALSE(map.del("magic"));
+  EXPECT_FALSE(map.has_key("magic"));
+  EXPECT_TRUE(map.has_key("zombie"));
+  EXPECT_EQ(5, map.get("blue").as<fluent::Message::Fixnum>().val());
+
+  // Entries are sorted by key regardless of insertion order.
+  std::stringstream ss;
+  map.to_ostream(ss);
+  EXPECT_EQ("{\"arcane\": 4, \"blue\": 5, \"zombie\": 3}", ss.str());
+}
+
+TEST(Message, MapInsertionOrder) {
+  fluent::Message::Map map(fluent::Message::InsertionOrder);
+  map.set("zombie", 1);
+  map.set("arcane", 2);
+  map.set("zombie", 3);
+  std::stringstream ss;
+  map.to_ostream(ss);
+  EXPECT_EQ("{\"zombie\": 3, \"arcane\": 2}", ss.str());
+
+  // Values are written as JSON.
+  fluent::Message::Map values(fluent::Message::InsertionOrder);
+  values.set("s", "a\"b");
+  values.set("t", true);
+  values.set_nil("n");
+  values.retain_array("a")->push(false);
+  ss.str("");
+  values.to_ostream(ss);
+  EXPECT_EQ("{\"s\": \"a\\\"b\", \"t\": true, \"n\": null, \"a\": [false]}",
+            ss.str());
+
+  // Over threshold of hash index.
+  for (int i = 0; i < 200; i++) {
+    map.set("k" + std::to_string(i), i);
+  }
+  map.set("k100", -100);
+  EXPECT_EQ(202, map.size());
+  EXPECT_EQ(-100, map.get("k100").as<fluent::Message::Fixnum>().val());
+  EXPECT_TRUE(map.del("arcane"));
+  EXPECT_FALSE(map.has_key("arcane"));
+  EXPECT_EQ(199, map.get("k199").as<fluent::Message::Fixnum>().val());
+
+  // Nested map and clone keep the order.
+  fluent::Message::Map *nested = map.retain_map("nested");
+  nested->set("b", 1);
+  nested->set("a", 2);
+  fluent::Message::Object *obj = map.clone();
+  const fluent::Message::Map &cloned = obj->as<fluent::Message::Map>();
+  EXPECT_EQ(fluent::Message::InsertionOrder, cloned.order());
+  EXPECT_EQ(3, cloned.get("zombie").as<fluent::Message::Fixnum>().val());
+  EXPECT_EQ(0, cloned.get("k0").as<fluent::Message::Fixnum>().val());
+  ss.str("");
+  cloned.get("nested").to_ostream(ss);
+  EXPECT_EQ("{\"b\": 1, \"a\": 2}", ss.str());
+  delete obj;
+
+  // Record is serialized in insertion order.
+  fluent::Message msg("test.order", fluent::Message::InsertionOrder);
+  msg.set("b", 1);
+  msg.set("a", 2);
+  uint8_t data[] = {0x82, 0xa1, 0x62, 0x01, 0xa1, 0x61, 0x02};
+  msgpack::sbuffer buf;
+  msgpack::packer<msgpack::sbuffer> pk(&buf);
+  msg.to_msgpack(&pk);
+  ASSERT_LT(sizeof(data), buf.size());
+  const char *rec = buf.data() + buf.size() - sizeof(data);
+  EXPECT_TRUE(0 == memcmp(rec, data, sizeof(data)));
+}
+
+TEST(Message, InternedKey) {
+  static const fluent::Message::Key RACE("race"), LEVEL("level");
+  EXPECT_EQ("\xa4race", RACE.packed());
+
+  const fluent::Message::KeyOrder orders[] = {
+    fluent::Message::SortedKeys, fluent::Message::InsertionOrder,
+  };
+  for (size_t i = 0; i < 2; i++) {
+    fluent::Message msg1("test.key", orders[i]), msg2("test.key", orders[i]);
+    msg1.set_ts(1514633395);
+    msg2.set_ts(1514633395);
+    msg1.set("race", "gnome");
+    msg1.set("level", 3);
+    msg1.set("job", "mage");
+    msg2.set(RACE, "gnome");
+    msg2.set(LEVEL, 2);
+    msg2.set("job", "mage");
+    // Key and string key with the same name are the same field.
+    msg2.set("level", 3);
+    EXPECT_TRUE(msg2.has_key("race"));
+    EXPECT_EQ("gnome",
+              msg2.get("race").as<fluent::Message::String>().val());
+
+    msgpack::sbuffer buf1, buf2;
+    msgpack::packer<msgpack::sbuffer> pk1(&buf1), pk2(&buf2);
+    msg1.to_msgpack(&pk1);
+    msg2.to_msgpack(&pk2);
+    ASSERT_EQ(buf1.size(), buf2.size());
+    EXPECT_TRUE(0 == memcmp(buf1.data(), buf2.data(), buf1.size()));
+
+    fluent::Message *msg3 = msg2.clone();
+    msg3->set(LEVEL, 4);
+    std::stringstream ss;
+    msg3->to_ostream(ss);
+    EXPECT_NE(std::string::npos, ss.str().find("\"level\": 4"));
+    EXPECT_TRUE(msg3->del("race"));
+    EXPECT_FALSE(msg3->has_key("race"));
+    delete msg3;
+  }
+}
+
+TEST(Message, StringSetters) {
+  fluent::Message msg("test.str");
+  std::string owned(100, 'x');
+  const char *data = owned.data();
+  msg.set("moved", std::move(owned));
+  msg.set("view", "warlock and mage", 7);
+  fluent::Message::Array *arr = msg.retain_array("arr");
+  arr->push(std::string("gnome"));
+  arr->push("dwarf elf", 5);
+
+  // Buffer is handed over without copy.
+  const std::string &moved = msg.get("moved").as<fluent::Message::String>()
+    .val();
+  EXPECT_EQ(std::string(100, 'x'), moved);
+  EXPECT_EQ(data, moved.data());
+  EXPECT_EQ("warlock", msg.get("view").as<fluent::Message::String>().val());
+  const fluent::Message::Array &a =
+    msg.get("arr").as<fluent::Message::Array>();
+  EXPECT_EQ("gnome", a.get(0).as<fluent::Message::String>().val());
+  EXPECT_EQ("dwarf", a.get(1).as<fluent::Message::String>().val());
+}
+
 TEST(Message, clone) {
   fluent::Message *msg1 = new fluent::Message("race.gnome");
   msg1->set("i", 1);
@@ -447,3 +590,309 @@ TEST(Message, clone) {
   delete msg2;
 }
 
+TEST(Message, CopyOnWriteClone) {
+  fluent::Message *base = new fluent::Message("race.gnome");
+  base->set("s", "warlock");
+  base->retain_map("m")->set("hunter", 1);
+  base->retain_array("a")->push(1);
+
+  // Fields are shared until modified.
+  fluent::Message *msg = base->clone();
+  EXPECT_EQ(&base->get("s"), &msg->get("s"));
+  EXPECT_EQ(&base->get("m"), &msg->get("m"));
+
+  // Modifying nested map and array of clone copies them.
+  msg->retain_map("m")->set("hunter", 2);
+  msg->retain_array("a")->push(2);
+  msg->set("new", true);
+  EXPECT_NE(&base->get("m"), &msg->get("m"));
+  EXPECT_EQ(&base->get("s"), &msg->get("s"));
+  EXPECT_EQ(1, base->get("m").as<fluent::Message::Map>().get("hunter")
+            .as<fluent::Message::Fixnum>().val());
+  EXPECT_EQ(2, msg->get("m").as<fluent::Message::Map>().get("hunter")
+            .as<fluent::Message::Fixnum>().val());
+  EXPECT_EQ(1, base->get("a").as<fluent::Message::Array>().size());
+  EXPECT_EQ(2, msg->get("a").as<fluent::Message::Array>().size());
+  EXPECT_FALSE(base->has_key("new"));
+
+  // Modifying the original does not affect clone either.
+  fluent::Message *msg2 = base->clone();
+  base->retain_map("m")->set("mage", 3);
+  base->del("s");
+  EXPECT_FALSE(msg2->get("m").as<fluent::Message::Map>().has_key("mage"));
+  EXPECT_TRUE(msg2->has_key("s"));
+
+  // Clones live longer than the original.
+  delete base;
+  EXPECT_EQ("warlock", msg->get("s").as<fluent::Message::String>().val());
+  delete msg;
+  EXPECT_EQ("warlock", msg2->get("s").as<fluent::Message::String>().val());
+  delete msg2;
+}
+
+TEST(Message, builder) {
+  fluent::Message *msg1 = new fluent::Message("test.builder");
+  fluent::Message *msg2 = new fluent::Message("test.builder");
+  msg1->set_ts(1514633395);
+  msg2->set_ts(1514633395);
+  const std::string long_str(300, 'x');
+
+  // Keys are sorted to get the same data as Map.
+  msg1->set("b", true);
+  msg1->set("f", 3.141592);
+  msg1->set("i", -1234567);
+  msg1->set("l", long_str);
+  msg1->set_nil("n");
+  msg1->set("s", "warlock");
+  msg1->set("u", 4000000000u);
+
+  fluent::Message::Builder b(msg2);
+  b.set("b", true).set("f", 3.141592).set("i", -1234567).set("l", long_str);
+  b.set_nil("n").set("s", "warlock").set("u", 4000000000u);
+  EXPECT_EQ(7, b.count());
+
+  msgpack::sbuffer buf1, buf2;
+  msgpack::packer<msgpack::sbuffer> pk1(&buf1), pk2(&buf2);
+  msg1->to_msgpack(&pk1);
+  msg2->to_msgpack(&pk2);
+  ASSERT_EQ(buf1.size(), buf2.size());
+  EXPECT_TRUE(0 == memcmp(buf1.data(), buf2.data(), buf1.size()));
+
+  // Clone has the encoded fields too.
+  fluent::Message *msg3 = msg2->clone();
+  msgpack::sbuffer buf3;
+  msgpack::packer<msgpack::sbuffer> pk3(&buf3);
+  msg3->to_msgpack(&pk3);
+  ASSERT_EQ(buf1.size(), buf3.size());
+  EXPECT_TRUE(0 == memcmp(buf1.data(), buf3.data(), buf1.size()));
+
+  delete msg1;
+  delete msg2;
+  delete msg3;
+}
+
+TEST(Message, builder_with_map) {
+  fluent::Message *msg = new fluent::Message("test.builder");
+  msg->set_ts(1514633395);
+  fluent::Message::Builder b(msg);
+  b.set("a", 1);
+  msg->set("b", 2);
+
+  // Record should be {"a": 1, "b": 2}
+  uint8_t data[] = {0x82, 0xa1, 0x61, 0x01, 0xa1, 0x62, 0x02};
+  msgpack::sbuffer buf;
+  msgpack::packer<msgpack::sbuffer> pk(&buf);
+  msg->to_msgpack(&pk);
+  ASSERT_LT(sizeof(data), buf.size());
+  const char *rec = buf.data() + buf.size() - sizeof(data);
+  EXPECT_TRUE(0 == memcmp(rec, data, sizeof(data)));
+
+  std::stringstream ss;
+  msg->to_ostream(ss);
+  EXPECT_EQ("2017-12-30T11:29:55+00:00\ttest.builder\t{\"a\": 1, \"b\": 2}\n",
+            ss.str());
+  delete msg;
+}
+
+TEST(Message, schema) {
+  const fluent::Schema<double, int, std::string> schema("latency_us",
+                                                        "status", "url");
+  fluent::Message *msg1 = new fluent::Message("test.schema");
+  fluent::Message *msg2 = new fluent::Message("test.schema");
+  msg1->set_ts(1514633395);
+  msg2->set_ts(1514633395);
+
+  msg1->set("latency_us", 1.5);
+  msg1->set("status", 200);
+  msg1->set("url", "/index.html");
+  schema.encode(msg2, 1.5, 200, "/index.html");
+
+  msgpack::sbuffer buf1, buf2;
+  msgpack::packer<msgpack::sbuffer> pk1(&buf1), pk2(&buf2);
+  msg1->to_msgpack(&pk1);
+  msg2->to_msgpack(&pk2);
+  ASSERT_EQ(buf1.size(), buf2.size());
+  EXPECT_TRUE(0 == memcmp(buf1.data(), buf2.data(), buf1.size()));
+
+  // "url" as fixstr.
+  EXPECT_EQ(std::string("\xa3url"), schema.packed_key(2));
+
+  delete msg1;
+  delete msg2;
+}
+
+TEST(Message, template) {
+  fluent::Message base("base");
+  base.set("host", "web01");
+  base.set("region", "ap-northeast-1");
+  fluent::Message::Builder(&base).set("build", 1024);
+  fluent::Template *tmpl = new fluent::Template(base);
+  EXPECT_EQ(3, tmpl->count());
+
+  // Fields in the order of template, builder and map.
+  fluent::Message *msg1 = new fluent::Message("test.template");
+  fluent::Message *msg2 = new fluent::Message("test.template");
+  msg1->set_ts(1514633395);
+  msg2->set_ts(1514633395);
+  fluent::Message::Builder(msg1).set("build", 1024);
+  msg1->set("host", "web01");
+  msg1->set("region", "ap-northeast-1");
+  msg1->set("status", 200);
+  msg2->set_template(tmpl);
+  msg2->set("status", 200);
+  fluent::Template::release(tmpl);
+  // Template is left by release() and not shown to get().
+  EXPECT_EQ(tmpl, msg2->get_template());
+  EXPECT_FALSE(msg2->has_key("host"));
+
+  msgpack::sbuffer buf1, buf2;
+  msgpack::packer<msgpack::sbuffer> pk1(&buf1), pk2(&buf2);
+  msg1->to_msgpack(&pk1);
+  msg2->to_msgpack(&pk2);
+  ASSERT_EQ(buf1.size(), buf2.size());
+  EXPECT_TRUE(0 == memcmp(buf1.data(), buf2.data(), buf1.size()));
+
+  // Decoded map is the same.
+  std::stringstream ss1, ss2;
+  msg1->to_ostream(ss1);
+  msg2->to_ostream(ss2);
+  EXPECT_EQ(ss1.str(), ss2.str());
+
+  // Clone shares template.
+  fluent::Message *msg3 = msg2->clone();
+  delete msg2;
+  std::stringstream ss3;
+  msg3->to_ostream(ss3);
+  EXPECT_EQ(ss1.str(), ss3.str());
+  msgpack::sbuffer buf3;
+  msgpack::packer<msgpack::sbuffer> pk3(&buf3);
+  msg3->to_msgpack(&pk3);
+  ASSERT_EQ(buf2.size(), buf3.size());
+  EXPECT_TRUE(0 == memcmp(buf2.data(), buf3.data(), buf2.size()));
+
+  delete msg1;
+  delete msg3;
+}
+
+TEST(Message, Int64BinExt) {
+  fluent::Message::Map *obj = new fluent::Message::Map();
+  const char bin[] = {0x00, 0x01, static_cast<char>(0xff)};
+  const char ext[] = {0x0a, 0x0b, 0x0c, 0x0d};
+  obj->set("i", -1234567890123LL);
+  obj->set("u", 18446744073709551615ULL);
+  obj->set("l", 4000000000L);
+  obj->set_bin("b", bin, sizeof(bin));
+  obj->set_ext("e", 7, ext, sizeof(ext));
+  obj->retain_array("a")->push_bin(bin, 1);
+
+  msgpack::sbuffer buf;
+  msgpack::packer<msgpack::sbuffer> pk(&buf);
+  obj->get("i").to_msgpack(&pk);
+  obj->get("b").to_msgpack(&pk);
+  obj->get("e").to_msgpack(&pk);
+  const uint8_t expected[] = {
+    0xd3, 0xff, 0xff, 0xfe, 0xe0, 0x8e, 0x04, 0xfb, 0x35,  // int64
+    0xc4, 0x03, 0x00, 0x01, 0xff,                          // bin8
+    0xd6, 0x07, 0x0a, 0x0b, 0x0c, 0x0d,                    // fixext4
+  };
+  ASSERT_EQ(sizeof(expected), buf.size());
+  EXPECT_TRUE(0 == memcmp(expected, buf.data(), buf.size()));
+
+  // Decoded as the same types.
+  buf.clear();
+  obj->to_msgpack(&pk);
+  size_t off = 0;
+  fluent::Message::Object *res =
+    fluent::Message::Object::from_msgpack(buf.data(), buf.size(), &off);
+  ASSERT_TRUE(res != nullptr);
+  const fluent::Message::Map &map = res->as<fluent::Message::Map>();
+  EXPECT_EQ(-1234567890123LL,
+            map.get("i").as<fluent::Message::Fixnum>().val());
+  EXPECT_EQ(18446744073709551615ULL,
+            map.get("u").as<fluent::Message::Ufixnum>().val());
+  EXPECT_EQ(4000000000L, map.get("l").as<fluent::Message::Fixnum>().val());
+  EXPECT_EQ(std::string(bin, sizeof(bin)),
+            map.get("b").as<fluent::Message::Binary>().val());
+  EXPECT_EQ(fluent::Message::Object::ExtType, map.get("e").tag());
+  EXPECT_EQ(7, map.get("e").as<fluent::Message::Ext>().type());
+  EXPECT_EQ(std::string(ext, sizeof(ext)),
+            map.get("e").as<fluent::Message::Ext>().data());
+  EXPECT_EQ(std::string(bin, 1), map.get("a").as<fluent::Message::Array>()
+            .get(0).as<fluent::Message::Binary>().val());
+
+  std::stringstream ss;
+  map.get("e").to_ostream(ss);
+  // Data of ext is written as JSON string, as Message::to_ostream().
+  EXPECT_EQ("\"\\n\\u000b\\f\\r\"", ss.str());
+  delete res;
+  delete obj;
+}
+
+TEST(Message, EventTime) {
+  fluent::Message msg("test.time");
+  time_t sec;
+  long nsec;
+  fluent::Message::now(&sec, &nsec);
+  EXPECT_LE(msg.ts(), sec);
+  EXPECT_GE(msg.ts() + 1, sec);
+  EXPECT_TRUE(0 <= nsec && nsec < 1000000000);
+
+  msg.set_ts(1514633395, 123456789);
+  msg.set_event_time(true);
+  msgpack::sbuffer buf;
+  msgpack::packer<msgpack::sbuffer> pk(&buf);
+  msg.to_msgpack(&pk);
+  // [tag, EventTime, {}]
+  const uint8_t expected[] = {
+    0x93, 0xa9, 't', 'e', 's', 't', '.', 't', 'i', 'm', 'e',
+    0xd7, 0x00, 0x5a, 0x47, 0x78, 0xb3, 0x07, 0x5b, 0xcd, 0x15,
+    0x80,
+  };
+  ASSERT_EQ(sizeof(expected), buf.size());
+  EXPECT_TRUE(0 == memcmp(expected, buf.data(), buf.size()));
+
+  fluent::Message *cloned = msg.clone();
+  EXPECT_TRUE(cloned->event_time());
+  EXPECT_EQ(123456789, cloned->ts_nsec());
+  std::stringstream ss;
+  cloned->to_ostream(ss);
+  EXPECT_EQ("2017-12-30T11:29:55.123456789+00:00\ttest.time\t{}\n",
+            ss.str());
+  delete cloned;
+}
+
+TEST(Message, from_msgpack) {
+  fluent::Message::Map *obj = new fluent::Message::Map();
+  obj->set("i", -300);
+  obj->set("s", "test");
+  obj->set("f", 3.141592);
+  obj->set_nil("n");
+  obj->retain_array("a")->push(1);
+  obj->retain_map("m")->set("gnome", 2);
+
+  msgpack::sbuffer buf;
+  msgpack::packer<msgpack::sbuffer> pk(&buf);
+  obj->to_msgpack(&pk);
+
+  size_t off = 0;
+  fluent::Message::Object *res =
+    fluent::Message::Object::from_msgpack(buf.data(), buf.size(), &off);
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(buf.size(), off);
+  const fluent::Message::Map &map = res->as<fluent::Message::Map>();
+  EXPECT_EQ(-300, map.get("i").as<fluent::Message::Fixnum>().val());
+  EXPECT_EQ("test", map.get("s").as<fluent::Message::String>().val());
+  EXPECT_EQ(3.141592, map.get("f").as<fluent::Message::Float>().val());
+  EXPECT_TRUE(map.get("n").is_nil());
+  EXPECT_EQ(1, map.get("a").as<fluent::Message::Array>().size());
+  EXPECT_EQ(2, map.get("m").as<fluent::Message::Map>().get("gnome")
+            .as<fluent::Message::Fixnum>().val());
+  delete res;
+
+  // Truncated data can not be decoded, and offset is not moved.
+  off = 0;
+  EXPECT_TRUE(nullptr == fluent::Message::Object::from_msgpack(
+      buf.data(), buf.size() - 1, &off));
+  EXPECT_EQ(0, off);
+  delete obj;
+}
@@ -0,0 +1,196 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <thread>
+#include "./gtest.h"
+#include "../src/fluent/pool.hpp"
+#include "../src/fluent/logger.hpp"
+#include "../src/debug.h"
+
+TEST(MessagePool, reuse) {
+  fluent::MessagePool pool(2);
+  fluent::Message *msg1 = pool.get("test.pool");
+  msg1->set("race", "gnome");
+  msg1->set("level", 3);
+  const fluent::Message::Object *val = &msg1->get("race");
+
+  // Linked messages are returned at once, over the limit is deleted.
+  fluent::Message *msg2 = pool.get("test.pool");
+  fluent::Message *msg3 = pool.get("test.pool");
+  msg1->attach(msg2);
+  msg2->attach(msg3);
+  pool.put(msg1);
+  EXPECT_EQ(2, pool.count());
+
+  // Message is cleared and renewed.
+  fluent::Message *msg4 = pool.get("test.reuse",
+                                   fluent::Message::InsertionOrder);
+  fluent::Message *msg5 = pool.get("test.reuse");
+  EXPECT_EQ(2, pool.reused());
+  EXPECT_EQ(0, pool.count());
+  fluent::Message *reused = (msg4 == msg1) ? msg4 : msg5;
+  EXPECT_EQ(msg1, reused);
+  EXPECT_EQ("test.reuse", reused->tag());
+  EXPECT_FALSE(reused->has_key("race"));
+  EXPECT_EQ(nullptr, reused->next());
+
+  // Value object is reused by set().
+  reused->set("job", "mage");
+  EXPECT_EQ(val, &reused->get("job"));
+  EXPECT_EQ("mage", reused->get("job").as<fluent::Message::String>().val());
+
+  // Pool is empty, new message is allocated.
+  fluent::Message *msg6 = pool.get("test.pool");
+  EXPECT_EQ(2, pool.reused());
+  delete msg4;
+  delete msg5;
+  delete msg6;
+}
+
+TEST(MessagePool, concurrent_put) {
+  fluent::MessagePool pool(100000);
+  const int n = 1000;
+  std::vector<fluent::Message*> msgs;
+  for (int i = 0; i < n * 4; i++) {
+    msgs.push_back(pool.get("test.pool"));
+  }
+  std::vector<std::thread> th;
+  for (int t = 0; t < 4; t++) {
+    th.push_back(std::thread([&, t]() {
+          for (int i = 0; i < n; i++) {
+            pool.put(msgs[t * n + i]);
+          }
+        }));
+  }
+  for (auto &t : th) {
+    t.join();
+  }
+  EXPECT_EQ(n * 4, pool.count());
+
+  // All messages come back exactly once.
+  std::set<fluent::Message*> got;
+  for (int i = 0; i < n * 4; i++) {
+    got.insert(pool.get("test.pool"));
+  }
+  EXPECT_EQ(n * 4, got.size());
+  EXPECT_EQ(n * 4, pool.reused());
+  for (auto msg : got) {
+    delete msg;
+  }
+}
+
+TEST(MessagePool, concurrent_limit) {
+  // Messages over the limit are deleted even if put() concurrently.
+  fluent::MessagePool pool(100);
+  const int n = 1000;
+  std::vector<fluent::Message*> msgs;
+  for (int i = 0; i < n * 4; i++) {
+    msgs.push_back(new fluent::Message("test.pool"));
+  }
+  std::vector<std::thread> th;
+  for (int t = 0; t < 4; t++) {
+    th.push_back(std::thread([&, t]() {
+          for (int i = 0; i < n; i++) {
+            pool.put(msgs[t * n + i]);
+          }
+        }));
+  }
+  for (auto &t : th) {
+    t.join();
+  }
+  EXPECT_EQ(100, pool.count());
+
+  std::set<fluent::Message*> got;
+  for (int i = 0; i < 100; i++) {
+    got.insert(pool.get("test.pool"));
+  }
+  EXPECT_EQ(100, got.size());
+  EXPECT_EQ(100, pool.reused());
+  for (auto msg : got) {
+    delete msg;
+  }
+}
+
+TEST(Logger, pool) {
+  struct stat st;
+  const std::string fname = "logger_test_pool.msg";
+  if (0 == ::stat(fname.c_str(), &st)) {
+    ASSERT_TRUE(0 == unlink(fname.c_str()));
+  }
+
+  fluent::Logger *logger = new fluent::Logger();
+  logger->new_dumpfile(fname);
+  logger->set_pool_size(16);
+  msgpack::sbuffer sbuf;
+  msgpack::packer<msgpack::sbuffer> pkr(&sbuf);
+  for (int i = 0; i < 100; i++) {
+    fluent::Message *msg = logger->retain_message("test.pool");
+    msg->set("seq", i);
+    if (i % 2 == 0) {
+      msg->set("even", true);
+    }
+    msg->to_msgpack(&pkr);
+    EXPECT_TRUE(logger->emit(msg));
+    if (i % 10 == 0) {
+      // Let messages return to the pool.
+      EXPECT_TRUE(logger->flush(3000));
+    }
+  }
+
+  // Recycled messages have no stale fields.
+  EXPECT_TRUE(logger->flush(3000));
+  ASSERT_EQ(0, ::stat(fname.c_str(), &st));
+  ASSERT_EQ(sbuf.size(), st.st_size);
+  FILE *fp = fopen(fname.c_str(), "rb");
+  std::string data(st.st_size, '\0');
+  ASSERT_EQ(1, fread(&data[0], st.st_size, 1, fp));
+  fclose(fp);
+  EXPECT_TRUE(0 == memcmp(sbuf.data(), data.data(), sbuf.size()));
+
+  delete logger;
+  EXPECT_TRUE(0 == unlink(fname.c_str()));
+
+  // Emitters added after set_pool_size() recycle messages as well.
+  logger = new fluent::Logger();
+  logger->set_pool_size(16);
+  logger->new_dumpfile(fname);
+  fluent::Message *msg = logger->retain_message("test.pool");
+  EXPECT_TRUE(logger->emit(msg));
+  EXPECT_TRUE(logger->flush(3000));
+  EXPECT_EQ(msg, logger->retain_message("test.pool"));
+  delete logger;
+  EXPECT_TRUE(0 == unlink(fname.c_str()));
+
+  // So are messages emitted without emitters.
+  logger = new fluent::Logger();
+  logger->set_pool_size(16);
+  msg = logger->retain_message("test.pool");
+  EXPECT_TRUE(logger->emit(msg));
+  EXPECT_EQ(msg, logger->retain_message("test.pool"));
+  delete logger;
+}
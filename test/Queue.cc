@@ -0,0 +1,131 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/time.h>
+#include <unistd.h>
+#include "./gtest.h"
+#include "../src/fluent/queue.hpp"
+#include "../src/fluent/logger.hpp"
+#include "../src/debug.h"
+
+static long elapsed_msec(const struct timeval &start) {
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  return (now.tv_sec - start.tv_sec) * 1000 +
+    (now.tv_usec - start.tv_usec) / 1000;
+}
+
+static size_t count_msg(fluent::Message *root) {
+  size_t n = 0;
+  for (fluent::Message *msg = root; msg; msg = msg->next()) {
+    n++;
+  }
+  return n;
+}
+
+TEST(MsgThreadQueue, linger_until_batch_count) {
+  fluent::MsgThreadQueue q;
+  q.set_linger(10 * 1000 * 1000, 3);
+  for (int i = 0; i < 3; i++) {
+    EXPECT_TRUE(q.push(new fluent::Message("test.queue")));
+  }
+
+  // Enough messages are queued, so bulk_pop() should not linger.
+  struct timeval start;
+  gettimeofday(&start, nullptr);
+  fluent::Message *root = q.bulk_pop();
+  EXPECT_GT(1000, elapsed_msec(start));
+  EXPECT_EQ(3, count_msg(root));
+  delete root;
+}
+
+TEST(MsgThreadQueue, linger_until_timeout) {
+  fluent::MsgThreadQueue q;
+  q.set_linger(100 * 1000, 10);
+  struct timeval start;
+  gettimeofday(&start, nullptr);
+  EXPECT_TRUE(q.push(new fluent::Message("test.queue")));
+  EXPECT_TRUE(q.push(new fluent::Message("test.queue")));
+
+  // Batch is not filled, so bulk_pop() waits for linger time.
+  fluent::Message *root = q.bulk_pop();
+  EXPECT_LE(90, elapsed_msec(start));
+  EXPECT_EQ(2, count_msg(root));
+  delete root;
+}
+
+TEST(MsgThreadQueue, flush_stops_lingering) {
+  const std::string fname = "queue_test_linger.msg";
+  fluent::Logger *logger = new fluent::Logger();
+  logger->new_dumpfile(fname);
+  logger->set_linger(60 * 1000 * 1000);
+
+  fluent::Message *msg = logger->retain_message("test.linger");
+  msg->set("num", 1);
+  EXPECT_TRUE(logger->emit(msg));
+
+  struct timeval start;
+  gettimeofday(&start, nullptr);
+  EXPECT_TRUE(logger->flush(5000));
+  EXPECT_GT(5000, elapsed_msec(start));
+
+  delete logger;
+  EXPECT_TRUE(0 == unlink(fname.c_str()));
+}
+
+static void* pop_one(void *obj) {
+  fluent::MsgThreadQueue *q = static_cast<fluent::MsgThreadQueue*>(obj);
+  return q->bulk_pop();
+}
+
+TEST(MsgThreadQueue, signal_only_parked_consumer) {
+  fluent::MsgThreadQueue q;
+  // Consumer is not waiting, so push() should not signal.
+  for (int i = 0; i < 3; i++) {
+    EXPECT_TRUE(q.push(new fluent::Message("test.queue")));
+  }
+  EXPECT_EQ(0, q.signal_count());
+  fluent::Message *root = q.bulk_pop();
+  EXPECT_EQ(3, count_msg(root));
+  EXPECT_EQ(0, q.park_count());
+  delete root;
+
+  // Consumer sleeps on empty queue and is woken up once.
+  q.set_spin(1000);
+  pthread_t th;
+  ASSERT_EQ(0, pthread_create(&th, nullptr, pop_one, &q));
+  while (q.park_count() == 0) {
+    usleep(1000);
+  }
+  EXPECT_TRUE(q.push(new fluent::Message("test.queue")));
+  void *res;
+  pthread_join(th, &res);
+  root = static_cast<fluent::Message*>(res);
+  EXPECT_EQ(1, count_msg(root));
+  EXPECT_EQ(1, q.signal_count());
+  EXPECT_EQ(1, q.park_count());
+  delete root;
+}
@@ -0,0 +1,466 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include "./gtest.h"
+#include "../src/fluent/reader.hpp"
+#include "../src/fluent/logger.hpp"
+#include "../src/debug.h"
+
+static void pack_entries(msgpack::sbuffer *buf, int count) {
+  msgpack::packer<msgpack::sbuffer> pk(buf);
+  for (int i = 0; i < count; i++) {
+    fluent::Message msg("test.reader");
+    msg.set_ts(1514633395 + i, i * 1000);
+    msg.set_event_time(i % 2 == 1);
+    msg.set("seq", i);
+    msg.set("text", std::string(i, 'x'));
+    msg.retain_map("nest")->retain_array("a")->push(i);
+    msg.to_msgpack(&pk);
+  }
+}
+
+TEST(DumpReader, dumpfile) {
+  struct stat st;
+  const std::string fname = "reader_test.msg";
+  if (0 == ::stat(fname.c_str(), &st)) {
+    ASSERT_TRUE(0 == unlink(fname.c_str()));
+  }
+
+  fluent::Logger *logger = new fluent::Logger();
+  logger->new_dumpfile(fname);
+  msgpack::sbuffer sbuf;
+  msgpack::packer<msgpack::sbuffer> pk(&sbuf);
+  for (int i = 0; i < 100; i++) {
+    fluent::Message *msg = logger->retain_message("test.dump");
+    msg->set_ts(1514633395, i);
+    msg->set_event_time(i % 2 == 0);
+    fluent::Message::Builder(msg).set("status", 200 + i);
+    msg->set("seq", i);
+    msg->to_msgpack(&pk);
+    EXPECT_TRUE(logger->emit(msg));
+  }
+  delete logger;
+
+  fluent::DumpReader reader;
+  ASSERT_TRUE(reader.open(fname));
+  fluent::DumpReader::Entry e;
+  for (int i = 0; i < 100; i++) {
+    uint64_t offset = reader.offset();
+    ASSERT_TRUE(reader.next(&e));
+    EXPECT_EQ(offset, e.offset);
+    EXPECT_EQ("test.dump", std::string(e.tag, e.tag_len));
+    EXPECT_EQ(1514633395, e.ts);
+    EXPECT_EQ(i % 2 == 0, e.event_time);
+    EXPECT_EQ(e.event_time ? i : 0, e.ts_nsec);
+    // Record is a view of the data as written.
+    ASSERT_TRUE(e.record_len < e.size);
+    EXPECT_EQ(0, memcmp(sbuf.data() + e.offset + e.size - e.record_len,
+                        e.record, e.record_len));
+  }
+  EXPECT_FALSE(reader.next(&e));
+  EXPECT_FALSE(reader.truncated());
+  EXPECT_EQ("", reader.errmsg());
+  EXPECT_EQ(sbuf.size(), reader.offset());
+
+  // Decoded into Message.
+  ASSERT_TRUE(reader.open(fname));
+  for (int i = 0; i < 100; i++) {
+    fluent::Message *msg = reader.next_message();
+    ASSERT_TRUE(msg != nullptr);
+    EXPECT_EQ("test.dump", msg->tag());
+    EXPECT_EQ(i % 2 == 0, msg->event_time());
+    EXPECT_EQ(200 + i, msg->get("status").as<fluent::Message::Fixnum>().val());
+    EXPECT_EQ(i, msg->get("seq").as<fluent::Message::Fixnum>().val());
+    delete msg;
+  }
+  EXPECT_TRUE(nullptr == reader.next_message());
+  EXPECT_EQ("", reader.errmsg());
+  EXPECT_TRUE(0 == unlink(fname.c_str()));
+}
+
+TEST(DumpReader, truncated) {
+  msgpack::sbuffer buf;
+  pack_entries(&buf, 10);
+
+  // Any cut in the last entry is not an error.
+  fluent::DumpReader reader;
+  fluent::DumpReader::Entry e;
+  ASSERT_TRUE(reader.open(buf.data(), buf.size()));
+  for (int i = 0; i < 9; i++) {
+    ASSERT_TRUE(reader.next(&e));
+  }
+  size_t last = reader.offset();
+  for (size_t len = last; len < buf.size(); len++) {
+    ASSERT_TRUE(reader.open(buf.data(), len));
+    int count = 0;
+    while (reader.next(&e)) {
+      count++;
+    }
+    EXPECT_EQ(9, count);
+    EXPECT_EQ(len > last, reader.truncated());
+    EXPECT_EQ("", reader.errmsg());
+    EXPECT_EQ(last, reader.offset());
+  }
+}
+
+TEST(DumpReader, broken) {
+  msgpack::sbuffer buf;
+  pack_entries(&buf, 3);
+  fluent::DumpReader reader;
+  fluent::DumpReader::Entry e;
+  ASSERT_TRUE(reader.open(buf.data(), buf.size()));
+  ASSERT_TRUE(reader.next(&e));
+  size_t second = reader.offset();
+
+  // 0xc1 is never used.
+  std::string data(buf.data(), buf.size());
+  data[second + 1] = '\xc1';
+  ASSERT_TRUE(reader.open(data.data(), data.size()));
+  EXPECT_TRUE(reader.next(&e));
+  EXPECT_FALSE(reader.next(&e));
+  EXPECT_FALSE(reader.truncated());
+  EXPECT_EQ("Broken entry at offset " + std::to_string(second),
+            reader.errmsg());
+  EXPECT_FALSE(reader.next(&e));
+
+  // Map key must be string for Message.
+  msgpack::sbuffer buf2;
+  msgpack::packer<msgpack::sbuffer> pk(&buf2);
+  pk.pack_array(3);
+  pk.pack(std::string("tag"));
+  pk.pack(1);
+  pk.pack_map(1);
+  pk.pack(1);
+  pk.pack(2);
+  ASSERT_TRUE(reader.open(buf2.data(), buf2.size()));
+  EXPECT_TRUE(nullptr == reader.next_message());
+  EXPECT_EQ("Unsupported record at offset 0", reader.errmsg());
+}
+
+TEST(DumpReader, stream) {
+  msgpack::sbuffer buf;
+  pack_entries(&buf, 500);
+  // Entry larger than read chunk grows the buffer.
+  fluent::Message big("test.big");
+  big.set("text", std::string(200000, 'y'));
+  msgpack::packer<msgpack::sbuffer> pk(&buf);
+  big.to_msgpack(&pk);
+  pack_entries(&buf, 1);
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  std::thread writer([&]() {
+      // Write in pieces that split entries.
+      for (size_t pos = 0; pos < buf.size(); ) {
+        size_t len = std::min<size_t>(buf.size() - pos, 777);
+        ssize_t rc = ::write(fds[1], buf.data() + pos, len);
+        ASSERT_TRUE(rc > 0);
+        pos += rc;
+      }
+      ::close(fds[1]);
+    });
+
+  fluent::DumpReader reader;
+  ASSERT_TRUE(reader.open(fds[0]));
+  int count = 0;
+  fluent::Message *msg;
+  while (nullptr != (msg = reader.next_message())) {
+    if (count < 500) {
+      EXPECT_EQ(count, msg->get("seq").as<fluent::Message::Fixnum>().val());
+      EXPECT_EQ(static_cast<size_t>(count),
+                msg->get("text").as<fluent::Message::String>().val().size());
+      EXPECT_EQ(1514633395 + count, msg->ts());
+    } else if (count == 500) {
+      EXPECT_EQ("test.big", msg->tag());
+      EXPECT_EQ(200000,
+                msg->get("text").as<fluent::Message::String>().val().size());
+    }
+    delete msg;
+    count++;
+  }
+  writer.join();
+  EXPECT_EQ(502, count);
+  EXPECT_FALSE(reader.truncated());
+  EXPECT_EQ("", reader.errmsg());
+  EXPECT_EQ(buf.size(), reader.offset());
+  ::close(fds[0]);
+}
+
+TEST(DumpReader, load) {
+  msgpack::sbuffer buf;
+  pack_entries(&buf, 20);
+  fluent::DumpReader reader;
+  fluent::DumpReader::Entry e;
+  ASSERT_TRUE(reader.open(buf.data(), buf.size()));
+
+  // Loaded message is encoded into the same entry.
+  while (reader.next(&e)) {
+    fluent::Message msg(std::string(e.tag, e.tag_len));
+    fluent::DumpReader::load(e, &msg);
+    msgpack::sbuffer out;
+    msgpack::packer<msgpack::sbuffer> pk(&out);
+    msg.to_msgpack(&pk);
+    ASSERT_EQ(e.size, out.size());
+    EXPECT_EQ(0, memcmp(buf.data() + e.offset, out.data(), out.size()));
+  }
+  EXPECT_EQ(buf.size(), reader.offset());
+}
+
+// Entries of random size, some of them span ranges, and some records
+// contain dump entries as bin that look like boundaries.
+static void pack_random(msgpack::sbuffer *buf, int count, unsigned seed) {
+  msgpack::packer<msgpack::sbuffer> pk(buf);
+  srand(seed);
+  for (int i = 0; i < count; i++) {
+    fluent::Message msg("test.scan");
+    msg.set_ts(1514633395, i);
+    msg.set_event_time(true);
+    msg.set("seq", i);
+    int r = rand() % 10;
+    if (r == 0) {
+      msg.set("big", std::string(rand() % 5000, 'b'));
+    } else if (r == 1) {
+      msgpack::sbuffer inner;
+      pack_entries(&inner, 1 + rand() % 8);
+      msg.set_bin("inner", inner.data(), inner.size());
+    } else {
+      msg.set("s", std::string(rand() % 50, 's'));
+    }
+    msg.to_msgpack(&pk);
+  }
+}
+
+static std::vector<uint64_t> read_offsets(const char *data, size_t len,
+                                          fluent::DumpReader *reader) {
+  std::vector<uint64_t> offsets;
+  fluent::DumpReader::Entry e;
+  reader->open(data, len);
+  while (reader->next(&e)) {
+    offsets.push_back(e.offset);
+  }
+  return offsets;
+}
+
+TEST(DumpScanner, scan) {
+  msgpack::sbuffer buf;
+  pack_random(&buf, 3000, 1);
+  fluent::DumpReader reader;
+  std::vector<uint64_t> expected = read_offsets(buf.data(), buf.size(),
+                                                &reader);
+  ASSERT_EQ(3000, expected.size());
+
+  const size_t range_sizes[] = {100, 1000, 4096, 1 << 20};
+  for (size_t range_size : range_sizes) {
+    fluent::DumpScanner scanner(4, range_size);
+    ASSERT_TRUE(scanner.open(buf.data(), buf.size()));
+
+    // Unordered
+    std::mutex mutex;
+    std::vector<uint64_t> offsets;
+    EXPECT_TRUE(scanner.scan([&](const fluent::DumpReader::Entry &e) {
+          std::lock_guard<std::mutex> lock(mutex);
+          offsets.push_back(e.offset);
+        }));
+    std::sort(offsets.begin(), offsets.end());
+    EXPECT_EQ(expected, offsets);
+    EXPECT_EQ(3000, scanner.count());
+    EXPECT_FALSE(scanner.truncated());
+
+    // Ordered
+    int seq = 0;
+    EXPECT_TRUE(scanner.scan_ordered([&](fluent::Message *msg) {
+          EXPECT_EQ(seq, msg->get("seq").as<fluent::Message::Fixnum>().val());
+          EXPECT_EQ(seq, msg->ts_nsec());
+          seq++;
+          delete msg;
+        }));
+    EXPECT_EQ(3000, seq);
+    EXPECT_EQ("", scanner.errmsg());
+  }
+}
+
+TEST(DumpScanner, broken) {
+  msgpack::sbuffer buf;
+  pack_random(&buf, 1000, 2);
+  fluent::DumpReader reader;
+  std::vector<uint64_t> offsets = read_offsets(buf.data(), buf.size(),
+                                               &reader);
+  fluent::DumpScanner scanner(3, 512);
+
+  // Same entries as DumpReader before truncated or broken data.
+  const size_t cuts[] = {offsets[700] + 5, buf.size() - 1};
+  for (size_t len : cuts) {
+    size_t expected = read_offsets(buf.data(), len, &reader).size();
+    ASSERT_TRUE(scanner.open(buf.data(), len));
+    std::atomic<size_t> count(0);
+    EXPECT_TRUE(scanner.scan([&](const fluent::DumpReader::Entry &e) {
+          count++;
+        }));
+    EXPECT_EQ(expected, count);
+    EXPECT_EQ(expected, scanner.count());
+    EXPECT_TRUE(scanner.truncated());
+  }
+
+  std::string data(buf.data(), buf.size());
+  data[offsets[500]] = '\xc1';
+  ASSERT_TRUE(scanner.open(data.data(), data.size()));
+  size_t count = 0;
+  EXPECT_FALSE(scanner.scan_ordered([&](fluent::Message *msg) {
+        count++;
+        delete msg;
+      }));
+  EXPECT_EQ(500, count);
+  EXPECT_EQ("Broken entry at offset " + std::to_string(offsets[500]),
+            scanner.errmsg());
+  EXPECT_FALSE(scanner.truncated());
+}
+
+TEST(DumpIndex, time_range) {
+  struct stat st;
+  const std::string fname = "reader_test_index.msg";
+  const std::string index_fname = fname + ".idx";
+  unlink(fname.c_str());
+  unlink(index_fname.c_str());
+  const time_t base = 1514633395;
+
+  // 100 entries for each second, indexed by blocks of 64 entries.
+  fluent::Logger *logger = new fluent::Logger();
+  logger->new_dumpfile(fname, index_fname, 64);
+  for (int i = 0; i < 10000; i++) {
+    fluent::Message *msg = logger->retain_message("test.index");
+    msg->set_ts(base + i / 100);
+    msg->set("seq", i);
+    EXPECT_TRUE(logger->emit(msg));
+    if (i % 500 == 0) {
+      logger->flush(3000);
+    }
+  }
+  delete logger;
+
+  fluent::DumpIndex index;
+  ASSERT_TRUE(index.open(index_fname));
+  ASSERT_EQ(0, ::stat(fname.c_str(), &st));
+  ASSERT_EQ(200, index.blocks().size());
+  uint64_t end = 0;
+  for (auto &b : index.blocks()) {
+    EXPECT_EQ(end, b.offset);
+    EXPECT_EQ(b.min_ts, b.max_ts);
+    end = b.offset + b.length;
+  }
+  EXPECT_EQ(static_cast<uint64_t>(st.st_size), end);
+
+  // Only blocks of the time range are read.
+  uint64_t bytes = 0;
+  for (auto &span : index.spans(base + 20, base + 30, st.st_size)) {
+    bytes += span.second - span.first;
+  }
+  EXPECT_LT(st.st_size / 11, bytes);
+  EXPECT_GT(st.st_size / 9, bytes);
+
+  // Appended without index, and then with index including an entry of
+  // older time.
+  logger = new fluent::Logger();
+  logger->new_dumpfile(fname);
+  for (int i = 0; i < 50; i++) {
+    fluent::Message *msg = logger->retain_message("test.index");
+    msg->set_ts(base + 25);
+    msg->set("seq", 20000 + i);
+    EXPECT_TRUE(logger->emit(msg));
+  }
+  delete logger;
+  logger = new fluent::Logger();
+  logger->new_dumpfile(fname, index_fname, 64);
+  for (int i = 0; i < 100; i++) {
+    fluent::Message *msg = logger->retain_message("test.index");
+    msg->set_ts(i == 50 ? base + 21 : base + 200);
+    msg->set("seq", 30000 + i);
+    EXPECT_TRUE(logger->emit(msg));
+  }
+  delete logger;
+
+  ASSERT_TRUE(index.open(index_fname));
+  fluent::DumpReader reader;
+  for (int with_index = 0; with_index < 2; with_index++) {
+    ASSERT_TRUE(reader.open(fname));
+    reader.set_time_range(base + 20, base + 30,
+                          with_index ? &index : nullptr);
+    std::vector<int64_t> seqs;
+    fluent::Message *msg;
+    while (nullptr != (msg = reader.next_message())) {
+      EXPECT_LE(base + 20, msg->ts());
+      EXPECT_GT(base + 30, msg->ts());
+      seqs.push_back(msg->get("seq").as<fluent::Message::Fixnum>().val());
+      delete msg;
+    }
+    EXPECT_EQ("", reader.errmsg());
+    ASSERT_EQ(1051, seqs.size());
+    EXPECT_EQ(2000, seqs[0]);
+    EXPECT_EQ(2999, seqs[999]);
+    EXPECT_EQ(20000, seqs[1000]);
+    EXPECT_EQ(30050, seqs[1050]);
+  }
+
+  // No entry in the range.
+  ASSERT_TRUE(reader.open(fname));
+  reader.set_time_range(base + 500, base + 600, &index);
+  fluent::DumpReader::Entry e;
+  EXPECT_FALSE(reader.next(&e));
+  EXPECT_FALSE(reader.truncated());
+  EXPECT_TRUE(0 == unlink(fname.c_str()));
+  EXPECT_TRUE(0 == unlink(index_fname.c_str()));
+}
+
+TEST(DumpIndex, lost_entries) {
+  struct stat st;
+  const std::string fname = "/dev/full";
+  const std::string index_fname = "reader_test_lost.msg.idx";
+  if (::stat(fname.c_str(), &st) != 0) {
+    return;
+  }
+  unlink(index_fname.c_str());
+
+  // Entries fail to be written, and so no block points to them.
+  fluent::Logger *logger = new fluent::Logger();
+  logger->new_dumpfile(fname, index_fname, 8);
+  for (int i = 0; i < 100; i++) {
+    fluent::Message *msg = logger->retain_message("test.index");
+    msg->set_ts(1514633395 + i / 10);
+    msg->set("seq", i);
+    EXPECT_TRUE(logger->emit(msg));
+  }
+  delete logger;
+
+  fluent::DumpIndex index;
+  ASSERT_TRUE(index.open(index_fname));
+  EXPECT_EQ(0, index.blocks().size());
+  EXPECT_TRUE(0 == unlink(index_fname.c_str()));
+}
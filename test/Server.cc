@@ -0,0 +1,272 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <mutex>
+#include <vector>
+#include "./gtest.h"
+#include "../src/fluent/server.hpp"
+#include "../src/fluent/logger.hpp"
+#include "../src/debug.h"
+
+static int connect_server(int port) {
+  int sock = ::socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  if (::connect(sock, reinterpret_cast<struct sockaddr*>(&addr),
+                sizeof(addr)) != 0) {
+    ::close(sock);
+    return -1;
+  }
+  struct timeval tv = {3, 0};
+  ::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  return sock;
+}
+
+static bool wait_count(const fluent::ForwardServer &server, size_t count) {
+  for (int i = 0; i < 300 && server.count() < count; i++) {
+    usleep(10000);
+  }
+  return server.count() == count;
+}
+
+static void pack_record(msgpack::packer<msgpack::sbuffer> *pk, int seq) {
+  pk->pack_map(1);
+  pk->pack(std::string("seq"));
+  pk->pack(seq);
+}
+
+static void pack_event_time(msgpack::sbuffer *buf, uint32_t sec,
+                            uint32_t nsec) {
+  char b[10] = {static_cast<char>(0xd7), 0};
+  for (int i = 0; i < 4; i++) {
+    b[2 + i] = static_cast<char>(sec >> (24 - 8 * i));
+    b[6 + i] = static_cast<char>(nsec >> (24 - 8 * i));
+  }
+  buf->write(b, sizeof(b));
+}
+
+TEST(ForwardServer, modes) {
+  std::mutex mutex;
+  std::vector<fluent::Message*> msgs;
+  fluent::ForwardServer server;
+  ASSERT_TRUE(server.listen("127.0.0.1"));
+  ASSERT_LT(0, server.port());
+  server.set_handler([&](fluent::Message *msg) {
+      std::lock_guard<std::mutex> lock(mutex);
+      msgs.push_back(msg);
+    });
+  ASSERT_TRUE(server.start());
+
+  msgpack::sbuffer buf;
+  msgpack::packer<msgpack::sbuffer> pk(&buf);
+  // Message mode with chunk.
+  pk.pack_array(4);
+  pk.pack(std::string("test.message"));
+  pk.pack(1514633395);
+  pack_record(&pk, 0);
+  pk.pack_map(1);
+  pk.pack(std::string("chunk"));
+  pk.pack(std::string("c1"));
+  // Forward mode with integer time and EventTime.
+  pk.pack_array(2);
+  pk.pack(std::string("test.forward"));
+  pk.pack_array(2);
+  pk.pack_array(2);
+  pk.pack(1514633396);
+  pack_record(&pk, 1);
+  pk.pack_array(2);
+  pack_event_time(&buf, 1514633397, 123456789);
+  pack_record(&pk, 2);
+  // PackedForward mode with chunk.
+  msgpack::sbuffer entries;
+  msgpack::packer<msgpack::sbuffer> epk(&entries);
+  for (int i = 3; i < 5; i++) {
+    epk.pack_array(2);
+    epk.pack(1514633395 + i);
+    pack_record(&epk, i);
+  }
+  pk.pack_array(3);
+  pk.pack(std::string("test.packed"));
+  pk.pack_bin(entries.size());
+  pk.pack_bin_body(entries.data(), entries.size());
+  pk.pack_map(2);
+  pk.pack(std::string("size"));
+  pk.pack(2);
+  pk.pack(std::string("chunk"));
+  pk.pack(std::string("c2"));
+
+  int sock = connect_server(server.port());
+  ASSERT_LE(0, sock);
+  // Frames may arrive in pieces.
+  ASSERT_EQ(7, ::write(sock, buf.data(), 7));
+  usleep(50000);
+  ASSERT_EQ(static_cast<ssize_t>(buf.size() - 7),
+            ::write(sock, buf.data() + 7, buf.size() - 7));
+
+  const std::string acks = "\x81\xa3" "ack" "\xa2" "c1"
+                           "\x81\xa3" "ack" "\xa2" "c2";
+  std::string res;
+  char rbuf[64];
+  ssize_t n;
+  while (res.size() < acks.size() &&
+         (n = ::read(sock, rbuf, sizeof(rbuf))) > 0) {
+    res.append(rbuf, n);
+  }
+  EXPECT_EQ(acks, res);
+  ASSERT_TRUE(wait_count(server, 5));
+  ::close(sock);
+  server.stop();
+  EXPECT_EQ(buf.size(), server.bytes());
+  EXPECT_EQ(0, server.lost());
+  EXPECT_EQ(0, server.broken());
+
+  ASSERT_EQ(5, msgs.size());
+  const char *tags[] = {"test.message", "test.forward", "test.forward",
+                        "test.packed", "test.packed"};
+  for (int i = 0; i < 5; i++) {
+    EXPECT_EQ(tags[i], msgs[i]->tag());
+    EXPECT_EQ(1514633395 + i, msgs[i]->ts());
+    EXPECT_EQ(i, msgs[i]->get("seq").as<fluent::Message::Fixnum>().val());
+    delete msgs[i];
+  }
+}
+
+TEST(ForwardServer, emitter) {
+  fluent::MsgThreadQueue q;
+  q.set_limit(10000);
+  fluent::ForwardServer server;
+  ASSERT_TRUE(server.listen("127.0.0.1"));
+  server.set_queue(&q);
+  ASSERT_TRUE(server.start());
+
+  fluent::Logger *logger = new fluent::Logger();
+  logger->new_forward("127.0.0.1", server.port());
+  for (int i = 0; i < 1000; i++) {
+    fluent::Message *msg = logger->retain_message("test.inet");
+    msg->set("seq", i);
+    EXPECT_TRUE(logger->emit(msg));
+  }
+  EXPECT_TRUE(logger->flush(3000));
+  delete logger;
+  ASSERT_TRUE(wait_count(server, 1000));
+
+  int seq = 0;
+  fluent::Message *root = q.bulk_pop();
+  for (fluent::Message *msg = root; msg; msg = msg->next()) {
+    EXPECT_EQ("test.inet", msg->tag());
+    EXPECT_EQ(seq++, msg->get("seq").as<fluent::Message::Fixnum>().val());
+  }
+  EXPECT_EQ(1000, seq);
+  delete root;
+}
+
+TEST(ForwardServer, entry_handler) {
+  std::vector<std::string> tags;
+  std::vector<long> nsecs;
+  fluent::ForwardServer server;
+  ASSERT_TRUE(server.listen("127.0.0.1"));
+  server.set_entry_handler([&](const fluent::DumpReader::Entry &e) {
+      tags.push_back(std::string(e.tag, e.tag_len));
+      nsecs.push_back(e.event_time ? e.ts_nsec : -1);
+    });
+  ASSERT_TRUE(server.start());
+
+  fluent::Logger *logger = new fluent::Logger();
+  logger->new_forward("127.0.0.1", server.port());
+  logger->set_event_time(true);
+  for (int i = 0; i < 10; i++) {
+    fluent::Message *msg = logger->retain_message("test.entry");
+    msg->set_ts(1514633395, i * 1000);
+    EXPECT_TRUE(logger->emit(msg));
+  }
+  EXPECT_TRUE(logger->flush(3000));
+  delete logger;
+  ASSERT_TRUE(wait_count(server, 10));
+  server.stop();
+
+  ASSERT_EQ(10, tags.size());
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ("test.entry", tags[i]);
+    EXPECT_EQ(i * 1000, nsecs[i]);
+  }
+}
+
+TEST(ForwardServer, broken) {
+  fluent::ForwardServer server;
+  ASSERT_TRUE(server.listen("127.0.0.1"));
+  // No handler, entries are only counted.
+  ASSERT_TRUE(server.start());
+
+  // Broken data closes the connection.
+  int sock = connect_server(server.port());
+  ASSERT_LE(0, sock);
+  const char garbage[] = "\x93\xc1\x00\x00";
+  ASSERT_EQ(4, ::write(sock, garbage, 4));
+  char c;
+  EXPECT_EQ(0, ::read(sock, &c, 1));
+  ::close(sock);
+
+  // So does compressed PackedForward.
+  msgpack::sbuffer buf;
+  msgpack::packer<msgpack::sbuffer> pk(&buf);
+  pk.pack_array(3);
+  pk.pack(std::string("test.gzip"));
+  pk.pack_bin(4);
+  pk.pack_bin_body("\x1f\x8b\x08\x00", 4);
+  pk.pack_map(1);
+  pk.pack(std::string("compressed"));
+  pk.pack(std::string("gzip"));
+  sock = connect_server(server.port());
+  ASSERT_LE(0, sock);
+  ASSERT_EQ(static_cast<ssize_t>(buf.size()),
+            ::write(sock, buf.data(), buf.size()));
+  EXPECT_EQ(0, ::read(sock, &c, 1));
+  ::close(sock);
+
+  // Other connections are not affected.
+  buf.clear();
+  pk.pack_array(3);
+  pk.pack(std::string("test.ok"));
+  pk.pack(1514633395);
+  pack_record(&pk, 0);
+  sock = connect_server(server.port());
+  ASSERT_LE(0, sock);
+  ASSERT_EQ(static_cast<ssize_t>(buf.size()),
+            ::write(sock, buf.data(), buf.size()));
+  EXPECT_TRUE(wait_count(server, 1));
+  ::close(sock);
+  server.stop();
+  EXPECT_EQ(2, server.broken());
+  EXPECT_EQ("compressed entries are not supported", server.errmsg());
+}
@@ -0,0 +1,399 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <math.h>
+#include <limits.h>
+#include <float.h>
+#include <string.h>
+#include <random>
+#include "./gtest.h"
+#include "../src/fluent/text.hpp"
+#include "../src/fluent/template.hpp"
+#include "../src/fluent/reader.hpp"
+#include "../src/debug.h"
+
+static const double POW10_TEST[] = {
+  1, 10, 100, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+};
+
+static std::string to_text(const fluent::Message::Object &obj) {
+  fluent::TextEncoder enc;
+  enc.encode(obj);
+  return std::string(enc.data(), enc.size());
+}
+
+TEST(TextEncoder, number) {
+  fluent::Message::Array arr;
+  arr.push(0);
+  arr.push(-1);
+  arr.push(1234567890);
+  arr.push(LLONG_MIN);
+  arr.push(ULLONG_MAX);
+  EXPECT_EQ("[0, -1, 1234567890, -9223372036854775808, "
+            "18446744073709551615]", to_text(arr));
+
+  fluent::Message::Array dbl;
+  dbl.push(0.1);
+  dbl.push(1.5);
+  dbl.push(3.0);
+  dbl.push(-2.5e-7);
+  dbl.push(1e300);
+  dbl.push(1.0 / 3.0);
+  dbl.push(DBL_MAX);
+  dbl.push(NAN);
+  dbl.push(-INFINITY);
+  EXPECT_EQ("[0.1, 1.5, 3.0, -2.5e-07, 1e+300, 0.3333333333333333, "
+            "1.7976931348623157e+308, null, null]", to_text(dbl));
+
+  // Shortest decimals reading back to the same value.
+  fluent::Message::Array fixed;
+  fixed.push(-0.0);
+  fixed.push(0.05);
+  fixed.push(-123456.789);
+  fixed.push(0.0001);
+  fixed.push(1e14 + 0.5);
+  fixed.push(0.1 + 0.2);
+  fixed.push(99999999999999.98);
+  fixed.push(1e15);
+  EXPECT_EQ("[-0.0, 0.05, -123456.789, 0.0001, 100000000000000.5, "
+            "0.30000000000000004, 99999999999999.98, 1e+15]",
+            to_text(fixed));
+
+  // Any value reads back.
+  std::mt19937_64 rand(1);
+  for (int i = 0; i < 100000; i++) {
+    uint64_t u = rand();
+    double v;
+    if (i % 2 == 0) {
+      memcpy(&v, &u, sizeof(v));
+    } else {
+      // Values of fixed notation.
+      v = static_cast<double>(u % 100000000) / POW10_TEST[i % 10];
+    }
+    if (isnan(v) || isinf(v)) {
+      continue;
+    }
+    fluent::Message::Float f(v);
+    std::string text = to_text(f);
+    ASSERT_EQ(v, strtod(text.c_str(), nullptr)) << text;
+  }
+}
+
+TEST(TextEncoder, string) {
+  fluent::Message::Map map;
+  map.set("plain", "Hello, world");
+  map.set("quote", "say \"hi\" \\ bye");
+  map.set("ctrl", std::string("\b\f\n\r\t\x01\x1f\x00\x7f", 9));
+  map.set("utf8", "\xe3\x81\x82/\xf0\x9f\x8d\xa3");
+  map.set("new\nkey", true);
+  EXPECT_EQ("{\"ctrl\": \"\\b\\f\\n\\r\\t\\u0001\\u001f\\u0000\x7f\", "
+            "\"new\\nkey\": true, "
+            "\"plain\": \"Hello, world\", "
+            "\"quote\": \"say \\\"hi\\\" \\\\ bye\", "
+            "\"utf8\": \"\xe3\x81\x82/\xf0\x9f\x8d\xa3\"}", to_text(map));
+}
+
+TEST(TextEncoder, nested) {
+  const char bin[] = {'a', 0x00, 'b'};
+  fluent::Message::Map map;
+  map.set("b", false);
+  map.set_nil("n");
+  map.set_bin("bin", bin, sizeof(bin));
+  map.set_ext("ext", 1, "xy", 2);
+  fluent::Message::Array *arr = map.retain_array("a");
+  arr->push("x");
+  arr->retain_map()->set("k", 1);
+  arr->retain_array();
+  map.retain_map("m");
+  EXPECT_EQ("{\"a\": [\"x\", {\"k\": 1}, []], \"b\": false, "
+            "\"bin\": \"a\\u0000b\", \"ext\": \"xy\", \"m\": {}, "
+            "\"n\": null}", to_text(map));
+}
+
+TEST(TextEncoder, message) {
+  fluent::TextEncoder enc;
+  fluent::Message msg("test.text");
+  msg.set_ts(1514633395);
+  msg.set("num", 1);
+  enc.encode(msg);
+  msg.set_ts(946684800, 5000);
+  msg.set_event_time(true);
+  enc.encode(msg);
+  EXPECT_EQ("2017-12-30T11:29:55+00:00\ttest.text\t{\"num\": 1}\n"
+            "2000-01-01T00:00:00.000005000+00:00\ttest.text\t{\"num\": 1}\n",
+            std::string(enc.data(), enc.size()));
+
+  // Buffer is reused after clear().
+  const char *data = enc.data();
+  enc.clear();
+  EXPECT_EQ(0, enc.size());
+  enc.encode(msg);
+  EXPECT_EQ(data, enc.data());
+
+  // Time out of 4 digits of year, and the first encode of time -1.
+  fluent::TextEncoder enc2;
+  msg.set_event_time(false);
+  const time_t times[] = {-1, 253402300800LL, -62167219201LL,
+                          LLONG_MAX};
+  for (time_t ts : times) {
+    msg.set_ts(ts);
+    enc2.encode(msg);
+  }
+  EXPECT_EQ("1969-12-31T23:59:59+00:00\ttest.text\t{\"num\": 1}\n"
+            "10000-01-01T00:00:00+00:00\ttest.text\t{\"num\": 1}\n"
+            "-1-12-31T23:59:59+00:00\ttest.text\t{\"num\": 1}\n"
+            "9223372036854775807+00:00\ttest.text\t{\"num\": 1}\n",
+            std::string(enc2.data(), enc2.size()));
+}
+
+TEST(TextEncoder, packed) {
+  // Fields of template and builder are transcoded from msgpack.
+  fluent::Message base("base");
+  base.set("host", "web01");
+  base.set("neg", -300);
+  base.set("big", 4000000000U);
+  base.set("f", 0.25);
+  fluent::Message::Map *m = base.retain_map("m");
+  m->set("t", true);
+  m->set_nil("n");
+  m->retain_array("a")->push(std::string(40, 'z'));
+  fluent::Template *tmpl = new fluent::Template(base);
+
+  fluent::Message msg("test.packed");
+  msg.set_ts(1514633395);
+  msg.set_template(tmpl);
+  fluent::Template::release(tmpl);
+  fluent::Message::Builder(&msg).set("status", 200).set("url", "/\"x\"");
+  msg.set("latency", 1.5);
+
+  fluent::TextEncoder enc;
+  enc.encode(msg);
+  EXPECT_EQ("2017-12-30T11:29:55+00:00\ttest.packed\t"
+            "{\"big\": 4000000000, \"f\": 0.25, \"host\": \"web01\", "
+            "\"m\": {\"a\": [\"" + std::string(40, 'z') + "\"], "
+            "\"n\": null, \"t\": true}, \"neg\": -300, "
+            "\"status\": 200, \"url\": \"/\\\"x\\\"\", \"latency\": 1.5}\n",
+            std::string(enc.data(), enc.size()));
+}
+
+TEST(TextEncoder, packed_keys) {
+  // {1: "a", "k": {true: 2}} as raw fields.
+  const char record[] = "\x82\x01\xa1" "a" "\xa1" "k" "\x81\xc3\x02";
+  fluent::DumpReader::Entry e;
+  e.record = record;
+  e.record_len = sizeof(record) - 1;
+  e.ts = 1514633395;
+  e.ts_nsec = 0;
+  e.event_time = false;
+  fluent::Message msg("test.keys");
+  fluent::DumpReader::load(e, &msg);
+
+  fluent::TextEncoder enc;
+  EXPECT_TRUE(enc.encode_json(msg));
+  EXPECT_EQ("{\"tag\": \"test.keys\", "
+            "\"time\": \"2017-12-30T11:29:55+00:00\", "
+            "\"record\": {\"1\": \"a\", \"k\": {\"true\": 2}}}\n",
+            std::string(enc.data(), enc.size()));
+
+  // Truncated fields do not leave a partial line.
+  fluent::Message broken("test.keys");
+  e.record_len -= 1;
+  fluent::DumpReader::load(e, &broken);
+  enc.clear();
+  EXPECT_FALSE(enc.encode(broken));
+  EXPECT_FALSE(enc.encode_json(broken));
+  EXPECT_FALSE(enc.encode_ltsv(broken));
+  EXPECT_EQ(0, enc.size());
+}
+
+TEST(TextEncoder, packed_types) {
+  const char record[] =
+    "\x88"
+    "\xa1" "f" "\xca\x3f\xc0\x00\x00"          // float 32
+    "\xa1" "i" "\xd1\xff\xfe"                    // int 16
+    "\xa1" "u" "\xce\x00\x01\x11\x70"            // uint 32
+    "\xa1" "e" "\xd4\x01" "x"                     // fixext 1
+    "\xa1" "b" "\xc4\x01" "y"                     // bin 8
+    "\xa1" "n" "\xc0"
+    "\xa1" "t" "\xc3"
+    "\xa1" "a" "\xdc\x00\x02\xff\xc2";           // array 16
+  fluent::DumpReader::Entry e;
+  e.record = record;
+  e.record_len = sizeof(record) - 1;
+  e.ts = 1514633395;
+  e.ts_nsec = 0;
+  e.event_time = false;
+  fluent::Message msg("test.types");
+  fluent::DumpReader::load(e, &msg);
+
+  fluent::TextEncoder enc;
+  EXPECT_TRUE(enc.encode(msg));
+  EXPECT_EQ("2017-12-30T11:29:55+00:00\ttest.types\t"
+            "{\"f\": 1.5, \"i\": -2, \"u\": 70000, \"e\": \"x\", "
+            "\"b\": \"y\", \"n\": null, \"t\": true, \"a\": [-1, false]}\n",
+            std::string(enc.data(), enc.size()));
+}
+
+TEST(TextEncoder, json) {
+  fluent::Message msg("test.\"json\"");
+  msg.set_ts(1514633395);
+  fluent::Message::Builder(&msg).set("status", 200);
+  msg.set("url", "/a\tb");
+  msg.retain_array("a")->push(1);
+
+  fluent::TextEncoder enc;
+  enc.encode_json(msg);
+  msg.set_ts(946684800, 5000);
+  msg.set_event_time(true);
+  enc.encode_json(msg);
+  EXPECT_EQ("{\"tag\": \"test.\\\"json\\\"\", "
+            "\"time\": \"2017-12-30T11:29:55+00:00\", "
+            "\"record\": {\"status\": 200, \"a\": [1], \"url\": \"/a\\tb\"}}\n"
+            "{\"tag\": \"test.\\\"json\\\"\", "
+            "\"time\": \"2000-01-01T00:00:00.000005000+00:00\", "
+            "\"record\": {\"status\": 200, \"a\": [1], \"url\": \"/a\\tb\"}}\n",
+            std::string(enc.data(), enc.size()));
+}
+
+TEST(TextEncoder, ltsv) {
+  fluent::Message base("base");
+  base.set("host", "web01");
+  base.set("bin", std::string("x\ny", 3));
+  base.set("a:b", "c:d");
+  fluent::Template *tmpl = new fluent::Template(base);
+
+  fluent::Message msg("test.ltsv");
+  msg.set_ts(1514633395);
+  msg.set_template(tmpl);
+  fluent::Template::release(tmpl);
+  fluent::Message::Builder(&msg).set("status", 200).set("url", "/a\tb\\c");
+  msg.set("latency", 1.5);
+  msg.set("label\r", "line\nbreak");
+  msg.set_nil("none");
+  fluent::Message::Map *m = msg.retain_map("m");
+  m->set("s", "\t");
+  msg.set("x:y", 2);
+
+  fluent::TextEncoder enc;
+  enc.encode_ltsv(msg);
+  EXPECT_EQ("time:2017-12-30T11:29:55+00:00\ttag:test.ltsv\t"
+            "a_b:c:d\tbin:x\\ny\thost:web01\t"
+            "status:200\turl:/a\\tb\\\\c\t"
+            "label\\r:line\\nbreak\tlatency:1.5\tm:{\"s\": \"\\t\"}\t"
+            "none:null\tx_y:2\n",
+            std::string(enc.data(), enc.size()));
+}
+
+static std::string escape(const std::string &s) {
+  fluent::Message::String str(s);
+  return to_text(str);
+}
+
+TEST(TextEncoder, utf8) {
+  const fluent::TextEncoder::Scanner orig = fluent::TextEncoder::scanner();
+  const fluent::TextEncoder::Scanner scanners[] = {
+    fluent::TextEncoder::ScalarScanner,
+    fluent::TextEncoder::SSE2Scanner,
+    fluent::TextEncoder::AVX2Scanner,
+  };
+  for (auto scanner : scanners) {
+    if (!fluent::TextEncoder::set_scanner(scanner)) {
+      continue;
+    }
+    EXPECT_EQ(scanner, fluent::TextEncoder::scanner());
+    // Valid sequences of 2, 3 and 4 bytes.
+    EXPECT_EQ("\"\xc3\xa9t\xc3\xa9 \xe3\x81\x82 \xf0\x9f\x8d\xa3 "
+              "\xef\xbf\xbf \xf4\x8f\xbf\xbf\"",
+              escape("\xc3\xa9t\xc3\xa9 \xe3\x81\x82 \xf0\x9f\x8d\xa3 "
+                     "\xef\xbf\xbf \xf4\x8f\xbf\xbf"));
+    // Lone continuation, overlong, surrogate, over U+10FFFF, truncated
+    // and invalid lead byte.
+    EXPECT_EQ("\"a\\ufffdb\"", escape("a\x80" "b"));
+    EXPECT_EQ("\"\\ufffd\\ufffd\"", escape("\xc0\xaf"));
+    EXPECT_EQ("\"\\ufffd\\ufffd\\ufffd\"", escape("\xed\xa0\x80"));
+    EXPECT_EQ("\"\\ufffd\\ufffd\\ufffd\\ufffd\"", escape("\xf4\x90\x80\x80"));
+    EXPECT_EQ("\"x\\ufffd\\ufffd\"", escape("x\xe3\x81"));
+    EXPECT_EQ("\"\\ufffd \"", escape("\xff "));
+
+    // Special byte at any position of blocks, compared with byte by byte
+    // escaping.
+    const char specials[] = {'"', '\\', '\n', 0x01, 0x1f};
+    for (size_t len = 1; len < 80; len++) {
+      for (size_t pos = 0; pos < len; pos++) {
+        for (char c : specials) {
+          std::string s(len, 'a');
+          s[pos] = c;
+          std::string expected = "\"" + std::string(pos, 'a') +
+            escape(std::string(1, c)).substr(1);
+          expected.insert(expected.size() - 1, len - pos - 1, 'a');
+          ASSERT_EQ(expected, escape(s)) << scanner << " " << len << " "
+                                         << pos;
+        }
+        // Non-ASCII one.
+        std::string s(len, 'a');
+        s.replace(pos, 1, "\xc3\xa9");
+        ASSERT_EQ("\"" + s + "\"", escape(s));
+      }
+    }
+  }
+  fluent::TextEncoder::set_scanner(orig);
+}
+
+TEST(TextEncoder, scanner_random) {
+  // Strings of ASCII, valid and invalid UTF-8 pieces over blocks are
+  // encoded the same by all scanners.
+  const char *pieces[] = {
+    "a", "abcdefghijklmnop", "\"", "\\", "\n", "\x01", "\x7f",
+    "\xc3\xa9", "\xe3\x81\x82", "\xf0\x9f\x8d\xa3", "\xed\x9f\xbf",
+    "\xee\x80\x80", "\xf4\x8f\xbf\xbf",
+    "\x80", "\xbf", "\xc0\x80", "\xc1\xbf", "\xe0\x80\x80",
+    "\xed\xa0\x80", "\xf0\x80\x80\x80", "\xf4\x90\x80\x80",
+    "\xf5\x80\x80\x80", "\xff", "\xe3\x81", "\xf0\x9f\x8d",
+  };
+  const size_t npieces = sizeof(pieces) / sizeof(pieces[0]);
+  const fluent::TextEncoder::Scanner orig = fluent::TextEncoder::scanner();
+  std::mt19937 rand(1);
+  for (int i = 0; i < 20000; i++) {
+    std::string s;
+    size_t n = rand() % 40;
+    // Mostly valid pieces, sometimes an invalid one.
+    bool invalid = (i % 4 == 0);
+    for (size_t k = 0; k < n; k++) {
+      size_t idx = rand() % (invalid ? npieces : 13);
+      s += pieces[idx];
+    }
+    ASSERT_TRUE(fluent::TextEncoder::set_scanner(
+        fluent::TextEncoder::ScalarScanner));
+    const std::string expected = escape(s);
+    if (fluent::TextEncoder::set_scanner(fluent::TextEncoder::SSE2Scanner)) {
+      ASSERT_EQ(expected, escape(s));
+    }
+    if (fluent::TextEncoder::set_scanner(fluent::TextEncoder::AVX2Scanner)) {
+      ASSERT_EQ(expected, escape(s));
+    }
+  }
+  fluent::TextEncoder::set_scanner(orig);
+}
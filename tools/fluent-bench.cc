@@ -25,64 +25,756 @@
  */
 
 #include <iostream>
+#include <iomanip>
+#include <sstream>
 #include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <new>
 #include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/time.h>
 #include <unistd.h>
-#include <iostream>
-#include "../src/fluent.hpp"
+#include <msgpack.hpp>
+#include "../src/fluent/message.hpp"
+#include "../src/fluent/schema.hpp"
+#include "../src/fluent/logger.hpp"
+#include "../src/fluent/template.hpp"
+#include "../src/fluent/text.hpp"
+#include "../src/fluent/queue.hpp"
+#include "../src/fluent/reader.hpp"
+#include "../src/fluent/server.hpp"
 
-int main(int argc, char *argv[]) {
-  if (argc != 4) {
-    std::cerr << "syntax) fluent-bench <host> <port> <msg/sec>" << std::endl;
-    exit(EXIT_FAILURE);
+// Benchmarks of libfluent. message_* cases build one event of
+// {latency_us, status, url}, encode it into msgpack and delete it.
+// map_* cases work on Map with 16 keys, wide_* cases build Map with 128
+// keys. str_* cases set string values that producer owns. clock_* cases
+// read clocks, clock_message is the one used by Message constructor.
+// context_* cases build and encode an event of 15 static fields and 3
+// dynamic fields. text_* cases format an event of 10 fields as a line of
+// text, by stringstream and ostream operators as former FileEmitter Text
+// format, and by TextEncoder as text, JSON and LTSV lines. escape_* and
+// utf8_* cases encode a 1 KiB string of ASCII and of mixed UTF-8 by each
+// scanner of TextEncoder, and fall back to scalar if CPU does not support
+// it. dump_* cases read the event of text_* cases from dumpfile data in
+// memory by DumpReader, as a view and as Message. queue_* cases push
+// messages to MsgThreadQueue from 1 to 8 producer threads and pop them by
+// a consumer thread. logger_* cases emit events to /dev/null through
+// Logger, with and without message pool, and with time index of every
+// 1000 entries. forward_* cases emit them by InetEmitter to ForwardServer
+// in process, that counts entries only or decodes them into Message as
+// well.
+//
+// ns/op is wall time, allocs/op and bytes/op count heap allocations by
+// operator new, including ones of worker threads.
+//
+// usage: fluent-bench [-n count] [-j] [filter]
+//   -n  operations of each case (default 1000000)
+//   -j  print results as JSON for regression tracking
+// Run cases whose name contains filter if given.
+
+static std::atomic<size_t> alloc_count(0);
+static std::atomic<size_t> alloc_bytes(0);
+
+void* operator new(size_t size) {
+  alloc_count.fetch_add(1, std::memory_order_relaxed);
+  alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+  void *p = malloc(size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
   }
+  return p;
+}
+void operator delete(void *p) noexcept {
+  free(p);
+}
 
-  std::string host(argv[1]);
-  int port = std::stoi(argv[2]);
-  int mps  = std::stoi(argv[3]);
+static const std::string URL = "/api/v1/users/1234/profile";
 
-  fluent::Logger *logger = new fluent::Logger();
-  logger->new_forward(host, port);
-
-  int wait = 1000000 / mps;
-  time_t last_ts = time(nullptr);
-  size_t msg_count = 0;
-
-  std::cout << "wait: " << wait << "usec" << std::endl;
-  
-  while (true) {
-    fluent::Message *msg = logger->retain_message("test.bench");
-    msg->set("this", "test");
-    if (!logger->emit(msg)) {
-      std::cerr << "emit error: " << logger->errmsg() << std::endl;
-      break;
+static void by_set(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  fluent::Message *msg = new fluent::Message("bench.event");
+  msg->set("latency_us", 1.5 * i);
+  msg->set("status", 200);
+  msg->set("url", URL);
+  msg->to_msgpack(pk);
+  delete msg;
+}
+
+static void by_builder(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  fluent::Message *msg = new fluent::Message("bench.event");
+  fluent::Message::Builder b(msg);
+  b.set("latency_us", 1.5 * i).set("status", 200).set("url", URL);
+  msg->to_msgpack(pk);
+  delete msg;
+}
+
+static const fluent::Schema<double, int, std::string> schema("latency_us",
+                                                             "status", "url");
+
+static void by_schema(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  fluent::Message *msg = new fluent::Message("bench.event");
+  schema.encode(msg, 1.5 * i, 200, URL);
+  msg->to_msgpack(pk);
+  delete msg;
+}
+
+// Map with 16 keys, built in shuffled order.
+static const char *const MAP_KEYS[] = {
+  "user_agent", "host", "method", "status", "bytes", "referer", "path",
+  "remote_addr", "latency_us", "protocol", "request_id", "upstream",
+  "cache", "country", "session", "time_local",
+};
+static const size_t MAP_KEY_NUM = sizeof(MAP_KEYS) / sizeof(MAP_KEYS[0]);
+
+static void build_map(fluent::Message::Map *map, size_t i) {
+  for (size_t k = 0; k < MAP_KEY_NUM; k++) {
+    map->set(MAP_KEYS[k], static_cast<int>(i + k));
+  }
+}
+
+static void map_build(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  fluent::Message::Map *map = new fluent::Message::Map();
+  build_map(map, i);
+  delete map;
+}
+
+static const fluent::Message::Key *const *map_keys() {
+  static const fluent::Message::Key *keys[MAP_KEY_NUM];
+  for (size_t k = 0; k < MAP_KEY_NUM; k++) {
+    keys[k] = new fluent::Message::Key(MAP_KEYS[k]);
+  }
+  return keys;
+}
+
+static void map_build_key(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static const fluent::Message::Key *const *keys = map_keys();
+  fluent::Message::Map *map = new fluent::Message::Map();
+  for (size_t k = 0; k < MAP_KEY_NUM; k++) {
+    map->set(*keys[k], static_cast<int>(i + k));
+  }
+  delete map;
+}
+
+static void map_encode_key(msgpack::packer<msgpack::sbuffer> *pk,
+                           size_t i) {
+  static const fluent::Message::Key *const *keys = map_keys();
+  static fluent::Message::Map *map = nullptr;
+  if (map == nullptr) {
+    map = new fluent::Message::Map();
+    for (size_t k = 0; k < MAP_KEY_NUM; k++) {
+      map->set(*keys[k], static_cast<int>(k));
+    }
+  }
+  map->to_msgpack(pk);
+}
+
+static void map_lookup(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static fluent::Message::Map *map = nullptr;
+  static std::vector<std::string> keys(MAP_KEYS, MAP_KEYS + MAP_KEY_NUM);
+  if (map == nullptr) {
+    map = new fluent::Message::Map();
+    build_map(map, 0);
+  }
+  const std::string &key = keys[i % MAP_KEY_NUM];
+  if (!map->has_key(key) || map->get(key).is_nil()) {
+    abort();
+  }
+}
+
+// Consumer inspects all values with is() and as().
+static void map_inspect(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static fluent::Message::Map *map = nullptr;
+  static std::vector<std::string> keys(MAP_KEYS, MAP_KEYS + MAP_KEY_NUM);
+  if (map == nullptr) {
+    map = new fluent::Message::Map();
+    build_map(map, 0);
+  }
+  int64_t sum = 0;
+  for (size_t k = 0; k < MAP_KEY_NUM; k++) {
+    const fluent::Message::Object &obj = map->get(keys[k]);
+    if (obj.is<fluent::Message::Fixnum>()) {
+      sum += obj.as<fluent::Message::Fixnum>().val();
     }
-    msg_count++;
-    
-    time_t now_ts = time(nullptr);
-    if (now_ts > last_ts) {
-      last_ts = now_ts;
-      std::cout << last_ts << ": " << msg_count << " mps" << std::endl;
-      // double mps_real   = 1000000 / static_cast<double>(msg_count);
-      // double mps_adjust = mps_target / msg_real;
-      int diff = (mps > msg_count) ? mps - msg_count : msg_count - mps;
-      double ratio = static_cast<double>(diff) / static_cast<double>(mps);
-      int adjust = static_cast<int>(static_cast<double>(wait) * ratio);
-      if (adjust == 0) {
-        adjust = 1;
+  }
+  if (sum == 0) {
+    abort();
+  }
+}
+
+static void map_encode(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static fluent::Message::Map *map = nullptr;
+  if (map == nullptr) {
+    map = new fluent::Message::Map();
+    build_map(map, 0);
+  }
+  map->to_msgpack(pk);
+}
+
+// Wide record like request-context dumps, 128 keys.
+static std::vector<std::string> wide_keys() {
+  std::vector<std::string> keys;
+  for (size_t k = 0; k < 128; k++) {
+    keys.push_back("ctx." + std::to_string((k * 7919) % 1000) + ".field");
+  }
+  return keys;
+}
+static const std::vector<std::string> WIDE_KEYS = wide_keys();
+
+static void build_wide(fluent::Message::KeyOrder order, size_t i) {
+  fluent::Message::Map *map = new fluent::Message::Map(order);
+  for (size_t k = 0; k < WIDE_KEYS.size(); k++) {
+    map->set(WIDE_KEYS[k], static_cast<int>(i + k));
+  }
+  delete map;
+}
+
+static void wide_build_sorted(msgpack::packer<msgpack::sbuffer> *pk,
+                              size_t i) {
+  build_wide(fluent::Message::SortedKeys, i);
+}
+
+static void wide_build_insertion(msgpack::packer<msgpack::sbuffer> *pk,
+                                 size_t i) {
+  build_wide(fluent::Message::InsertionOrder, i);
+}
+
+// Request path and user agent read into producer's buffer.
+static const char REQ_BUF[] =
+  "/api/v1/users/1234/profile/settings/notifications?lang=en"
+  "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36";
+static const size_t PATH_LEN = 57;
+
+static void str_copy(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  fluent::Message *msg = new fluent::Message("bench.event");
+  std::string path(REQ_BUF, PATH_LEN), agent(REQ_BUF + PATH_LEN);
+  msg->set("path", path);
+  msg->set("agent", agent);
+  msg->set("method", "GET");
+  delete msg;
+}
+
+static void str_move(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  fluent::Message *msg = new fluent::Message("bench.event");
+  std::string path(REQ_BUF, PATH_LEN), agent(REQ_BUF + PATH_LEN);
+  msg->set("path", std::move(path));
+  msg->set("agent", std::move(agent));
+  msg->set("method", "GET");
+  delete msg;
+}
+
+static void str_view(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  fluent::Message *msg = new fluent::Message("bench.event");
+  msg->set("path", REQ_BUF, PATH_LEN);
+  msg->set("agent", REQ_BUF + PATH_LEN, sizeof(REQ_BUF) - 1 - PATH_LEN);
+  msg->set("method", "GET", 3);
+  delete msg;
+}
+
+// Stamp per-request fields on a clone of base context with 50 fields.
+static fluent::Message* base_context() {
+  fluent::Message *base = new fluent::Message("bench.context");
+  for (int k = 0; k < 50; k++) {
+    base->set("context_field_" + std::to_string(k), "value of the field");
+  }
+  return base;
+}
+
+static void message_stamp(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static fluent::Message *base = base_context();
+  fluent::Message *msg = base->clone();
+  msg->set("request_id", static_cast<int>(i));
+  msg->set("status", 200);
+  msg->set("latency_us", 1.5);
+  delete msg;
+}
+
+static fluent::Message* base_context_key() {
+  fluent::Message *base = new fluent::Message("bench.context");
+  for (int k = 0; k < 50; k++) {
+    // Keys are never deleted as Message refers them.
+    fluent::Message::Key *key = new fluent::Message::Key(
+        "context_field_" + std::to_string(k));
+    base->set(*key, "value of the field");
+  }
+  return base;
+}
+
+static void message_stamp_key(msgpack::packer<msgpack::sbuffer> *pk,
+                              size_t i) {
+  static const fluent::Message::Key REQUEST_ID("request_id"),
+    STATUS("status"), LATENCY("latency_us");
+  static fluent::Message *base = base_context_key();
+  fluent::Message *msg = base->clone();
+  msg->set(REQUEST_ID, static_cast<int>(i));
+  msg->set(STATUS, 200);
+  msg->set(LATENCY, 1.5);
+  delete msg;
+}
+
+static void message_clone(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static fluent::Message *base = base_context();
+  fluent::Message *msg = base->clone();
+  delete msg;
+}
+
+static void set_context(fluent::Message *msg) {
+  static const char *keys[] = {
+    "host", "region", "zone", "build", "pod", "namespace", "node",
+    "service", "version", "commit", "cluster", "env", "team", "owner", "app",
+  };
+  for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+    msg->set(keys[k], "static value of the field");
+  }
+}
+
+static void context_build(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  fluent::Message *msg = new fluent::Message("bench.context");
+  set_context(msg);
+  msg->set("request_id", static_cast<int>(i));
+  msg->set("status", 200);
+  msg->set("latency_us", 1.5);
+  msg->to_msgpack(pk);
+  delete msg;
+}
+
+static fluent::Template* new_context_template() {
+  fluent::Message base("bench.context");
+  set_context(&base);
+  return new fluent::Template(base);
+}
+
+static void context_template(msgpack::packer<msgpack::sbuffer> *pk,
+                             size_t i) {
+  static fluent::Template *tmpl = new_context_template();
+  fluent::Message *msg = new fluent::Message("bench.context");
+  msg->set_template(tmpl);
+  msg->set("request_id", static_cast<int>(i));
+  msg->set("status", 200);
+  msg->set("latency_us", 1.5);
+  msg->to_msgpack(pk);
+  delete msg;
+}
+
+static fluent::Message* text_event() {
+  fluent::Message *msg = new fluent::Message("bench.text");
+  msg->set("host", "web01.example.com");
+  msg->set("method", "GET");
+  msg->set("url", "/api/v1/items?id=12345&sort=desc");
+  msg->set("agent", "Mozilla/5.0 (X11; Linux x86_64) \"bench\"");
+  msg->set("status", 200);
+  msg->set("bytes", 1234567);
+  msg->set("request_id", 9876543210LL);
+  msg->set("latency_ms", 12.345);
+  msg->set("ratio", 0.1);
+  msg->set("cached", true);
+  return msg;
+}
+
+static void text_ostream(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static fluent::Message *msg = text_event();
+  std::stringstream ss;
+  time_t ts = msg->ts();
+  struct tm tm;
+  gmtime_r(&ts, &tm);
+  char buf[128];
+  strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S+00:00", &tm);
+  ss << buf << "\t" << msg->tag() << "\t";
+  ss << "{";
+  static const char *keys[] = {
+    "agent", "bytes", "cached", "host", "latency_ms", "method", "ratio",
+    "request_id", "status", "url",
+  };
+  for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+    ss << (k > 0 ? ", " : "") << "\"" << keys[k] << "\": ";
+    msg->get(keys[k]).to_ostream(ss);
+  }
+  ss << "}\n";
+  const std::string &s = ss.str();
+  pk->pack_str_body(s.data(), s.size());
+}
+
+static void text_encoder(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static fluent::Message *msg = text_event();
+  static fluent::TextEncoder enc;
+  enc.clear();
+  enc.encode(*msg);
+  pk->pack_str_body(enc.data(), enc.size());
+}
+
+static void text_json(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static fluent::Message *msg = text_event();
+  static fluent::TextEncoder enc;
+  enc.clear();
+  enc.encode_json(*msg);
+  pk->pack_str_body(enc.data(), enc.size());
+}
+
+static void text_ltsv(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static fluent::Message *msg = text_event();
+  static fluent::TextEncoder enc;
+  enc.clear();
+  enc.encode_ltsv(*msg);
+  pk->pack_str_body(enc.data(), enc.size());
+}
+
+static std::string long_ascii() {
+  std::string s;
+  while (s.size() < 1024) {
+    s += "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+      "/api/v1/items?id=12345&sort=desc ";
+  }
+  s.resize(1024);
+  return s;
+}
+
+static std::string long_utf8() {
+  std::string s;
+  while (s.size() < 1024) {
+    s += "caf\xc3\xa9 \xe3\x81\x82\xe3\x81\x84\xe3\x81\x86 "
+      "/search?q=sushi\xf0\x9f\x8d\xa3 ";
+  }
+  s.resize(1000);
+  return s;
+}
+
+static void encode_string(msgpack::packer<msgpack::sbuffer> *pk,
+                          fluent::TextEncoder::Scanner scanner,
+                          const fluent::Message::String &str) {
+  static fluent::TextEncoder enc;
+  fluent::TextEncoder::Scanner orig = fluent::TextEncoder::scanner();
+  fluent::TextEncoder::set_scanner(scanner);
+  enc.clear();
+  enc.encode(str);
+  pk->pack_str_body(enc.data(), enc.size());
+  fluent::TextEncoder::set_scanner(orig);
+}
+
+static void escape_scalar(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static const fluent::Message::String str(long_ascii());
+  encode_string(pk, fluent::TextEncoder::ScalarScanner, str);
+}
+
+static void escape_sse2(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static const fluent::Message::String str(long_ascii());
+  encode_string(pk, fluent::TextEncoder::SSE2Scanner, str);
+}
+
+static void escape_avx2(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static const fluent::Message::String str(long_ascii());
+  encode_string(pk, fluent::TextEncoder::AVX2Scanner, str);
+}
+
+static void utf8_scalar(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static const fluent::Message::String str(long_utf8());
+  encode_string(pk, fluent::TextEncoder::ScalarScanner, str);
+}
+
+static void utf8_sse2(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static const fluent::Message::String str(long_utf8());
+  encode_string(pk, fluent::TextEncoder::SSE2Scanner, str);
+}
+
+static void utf8_avx2(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static const fluent::Message::String str(long_utf8());
+  encode_string(pk, fluent::TextEncoder::AVX2Scanner, str);
+}
+
+// Clock sources for Message timestamp.
+static volatile long clock_sink = 0;
+
+static void clock_time(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  clock_sink += time(nullptr);
+}
+
+static void clock_realtime(msgpack::packer<msgpack::sbuffer> *pk,
+                           size_t i) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  clock_sink += ts.tv_nsec;
+}
+
+static void clock_message(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  time_t sec;
+  long nsec;
+  fluent::Message::now(&sec, &nsec);
+  clock_sink += nsec;
+}
+
+static void message_new(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  fluent::Message *msg = new fluent::Message("bench.event");
+  clock_sink += msg->ts_nsec();
+  delete msg;
+}
+
+// Emit one event and wait for worker every 64 events, so that drained
+// messages return to the pool.
+static void dump_read(msgpack::packer<msgpack::sbuffer> *pk,
+                      bool decode) {
+  static msgpack::sbuffer *data = nullptr;
+  static fluent::DumpReader reader;
+  if (data == nullptr) {
+    data = new msgpack::sbuffer();
+    msgpack::packer<msgpack::sbuffer> dpk(data);
+    fluent::Message *msg = text_event();
+    for (size_t i = 0; i < 4096; i++) {
+      msg->to_msgpack(&dpk);
+    }
+    delete msg;
+  }
+
+  for (int retry = 0; retry < 2; retry++) {
+    if (decode) {
+      fluent::Message *msg = reader.next_message();
+      if (msg) {
+        pk->pack(msg->ts());
+        delete msg;
+        return;
       }
-      
-      if (mps < msg_count) {
-        wait += adjust;
-      } else if (mps > msg_count) {
-        wait -= adjust;
-        if (wait <= 0) {
-          wait = 1;
+    } else {
+      fluent::DumpReader::Entry e;
+      if (reader.next(&e)) {
+        pk->pack(e.size);
+        return;
+      }
+    }
+    reader.open(data->data(), data->size());
+  }
+}
+
+static void dump_scan(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  dump_read(pk, false);
+}
+
+static void dump_message(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  dump_read(pk, true);
+}
+
+static void queue_run(size_t count, size_t producers) {
+  fluent::MsgThreadQueue q;
+  q.set_limit(100000);
+  std::thread consumer([&q] {
+      fluent::Message *root;
+      while (nullptr != (root = q.bulk_pop())) {
+        delete root;
+      }
+    });
+  std::vector<std::thread> th;
+  for (size_t p = 0; p < producers; p++) {
+    size_t n = count / producers + (p < count % producers ? 1 : 0);
+    th.push_back(std::thread([&q, n] {
+          for (size_t i = 0; i < n; i++) {
+            fluent::Message *msg = new fluent::Message("bench.queue");
+            while (!q.push(msg)) {
+              // queue is full, wait for consumer.
+              sched_yield();
+            }
+          }
+        }));
+  }
+  for (auto &t : th) {
+    t.join();
+  }
+  q.term(true);
+  consumer.join();
+}
+
+static void queue_1p(size_t count) { queue_run(count, 1); }
+static void queue_2p(size_t count) { queue_run(count, 2); }
+static void queue_4p(size_t count) { queue_run(count, 4); }
+static void queue_8p(size_t count) { queue_run(count, 8); }
+
+static fluent::Logger* new_logger(size_t pool_size) {
+  fluent::Logger *logger = new fluent::Logger();
+  logger->new_dumpfile("/dev/null");
+  if (pool_size > 0) {
+    logger->set_pool_size(pool_size);
+  }
+  return logger;
+}
+
+static void log_event(fluent::Logger *logger, size_t i) {
+  fluent::Message *msg = logger->retain_message("bench.event");
+  msg->set("request_id", static_cast<int>(i));
+  msg->set("status", 200);
+  msg->set("latency_us", 1.5);
+  logger->emit(msg);
+  if (i % 64 == 0) {
+    logger->flush(1000);
+  }
+}
+
+static void logger_plain(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static fluent::Logger *logger = new_logger(0);
+  log_event(logger, i);
+}
+
+static void logger_pool(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static fluent::Logger *logger = new_logger(128);
+  log_event(logger, i);
+}
+
+static void logger_index(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static fluent::Logger *logger = nullptr;
+  if (logger == nullptr) {
+    const std::string index_fname = "/tmp/fluent-microbench.idx";
+    unlink(index_fname.c_str());
+    logger = new fluent::Logger();
+    logger->new_dumpfile("/dev/null", index_fname);
+  }
+  log_event(logger, i);
+}
+
+static fluent::Logger* new_forward_logger(bool decode) {
+  fluent::ForwardServer *server = new fluent::ForwardServer();
+  if (decode) {
+    server->set_handler([](fluent::Message *msg) { delete msg; });
+  }
+  if (!server->listen("127.0.0.1") || !server->start()) {
+    std::cerr << "server error: " << server->errmsg() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  fluent::Logger *logger = new fluent::Logger();
+  logger->new_forward("127.0.0.1", server->port());
+  return logger;
+}
+
+static void forward_sink(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static fluent::Logger *logger = new_forward_logger(false);
+  log_event(logger, i);
+}
+
+static void forward_decode(msgpack::packer<msgpack::sbuffer> *pk, size_t i) {
+  static fluent::Logger *logger = new_forward_logger(true);
+  log_event(logger, i);
+}
+
+struct Case {
+  const char *name;
+  void (*func)(msgpack::packer<msgpack::sbuffer> *pk, size_t i);
+  // Run all operations at once instead of func, for cases of threads.
+  void (*run)(size_t count);
+};
+
+static const Case cases[] = {
+  {"message_set", by_set},
+  {"message_builder", by_builder},
+  {"message_schema", by_schema},
+  {"map_build", map_build},
+  {"map_build_key", map_build_key},
+  {"map_lookup", map_lookup},
+  {"map_inspect", map_inspect},
+  {"map_encode", map_encode},
+  {"map_encode_key", map_encode_key},
+  {"wide_build_sorted", wide_build_sorted},
+  {"wide_build_insertion", wide_build_insertion},
+  {"str_copy", str_copy},
+  {"str_move", str_move},
+  {"str_view", str_view},
+  {"clock_time", clock_time},
+  {"clock_realtime", clock_realtime},
+  {"clock_message", clock_message},
+  {"message_new", message_new},
+  {"message_clone", message_clone},
+  {"message_stamp", message_stamp},
+  {"message_stamp_key", message_stamp_key},
+  {"context_build", context_build},
+  {"context_template", context_template},
+  {"text_ostream", text_ostream},
+  {"text_encoder", text_encoder},
+  {"text_json", text_json},
+  {"text_ltsv", text_ltsv},
+  {"escape_scalar", escape_scalar},
+  {"escape_sse2", escape_sse2},
+  {"escape_avx2", escape_avx2},
+  {"utf8_scalar", utf8_scalar},
+  {"utf8_sse2", utf8_sse2},
+  {"utf8_avx2", utf8_avx2},
+  {"dump_scan", dump_scan},
+  {"dump_message", dump_message},
+  {"queue_1p", nullptr, queue_1p},
+  {"queue_2p", nullptr, queue_2p},
+  {"queue_4p", nullptr, queue_4p},
+  {"queue_8p", nullptr, queue_8p},
+  {"logger_plain", logger_plain},
+  {"logger_pool", logger_pool},
+  {"logger_index", logger_index},
+  {"forward_sink", forward_sink},
+  {"forward_decode", forward_decode},
+};
+
+static double now_sec() {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char *argv[]) {
+  size_t count = 1000000;
+  bool json = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:j")) != -1) {
+    switch (opt) {
+      case 'n': count = std::stoul(optarg); break;
+      case 'j': json = true; break;
+      default:
+        std::cerr << "usage: fluent-bench [-n count] [-j] [filter]"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+  }
+  const std::string filter = (optind < argc) ? argv[optind] : "";
+
+  if (json) {
+    std::cout << "{\"count\": " << count << ", \"cases\": [";
+  }
+  bool first = true;
+  for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    if (std::string(cases[c].name).find(filter) == std::string::npos) {
+      continue;
+    }
+
+    msgpack::sbuffer buf;
+    msgpack::packer<msgpack::sbuffer> pk(&buf);
+    if (cases[c].func) {
+      // Warm up static data of the case.
+      cases[c].func(&pk, 0);
+    }
+    size_t count_start = alloc_count, bytes_start = alloc_bytes;
+    double start = now_sec();
+    if (cases[c].run) {
+      cases[c].run(count);
+    } else {
+      for (size_t i = 0; i < count; i++) {
+        cases[c].func(&pk, i);
+        if (buf.size() > 65536) {
+          buf.clear();
         }
-      }      
-      msg_count = 0;
+      }
     }
-    usleep(wait);
+    double elapsed = now_sec() - start;
+    double ns = elapsed * 1e9 / count;
+    double allocs = static_cast<double>(alloc_count - count_start) / count;
+    double bytes = static_cast<double>(alloc_bytes - bytes_start) / count;
+
+    if (json) {
+      std::cout << (first ? "\n" : ",\n") << std::fixed
+                << std::setprecision(1) << "  {\"name\": \""
+                << cases[c].name << "\", \"ns_per_op\": " << ns
+                << ", \"allocs_per_op\": " << allocs
+                << ", \"bytes_per_op\": " << bytes << "}";
+    } else {
+      std::cout << std::setw(20) << std::left << cases[c].name << std::right
+                << std::setw(12) << std::fixed << std::setprecision(1)
+                << ns << " ns/op"
+                << std::setw(8) << allocs << " allocs/op"
+                << std::setw(10) << bytes << " bytes/op" << std::endl;
+    }
+    first = false;
+  }
+  if (json) {
+    std::cout << "\n]}" << std::endl;
   }
   return 0;
 }
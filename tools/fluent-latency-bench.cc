@@ -0,0 +1,283 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/fluent.hpp"
+#include "../src/fluent/server.hpp"
+
+// End-to-end latency of events from Logger::emit() to receipt by
+// ForwardServer in process, through InetEmitter and loopback TCP. Events
+// carry the time of emit as EventTime of CLOCK_MONOTONIC, and the sink
+// records the difference into a histogram. An event is stamped with its
+// scheduled time if the producer is behind the schedule, so that delay of
+// a blocked producer is not hidden (coordinated omission), unless -a is
+// given. Percentiles of the last second are reported to stderr every
+// second, and of the whole run at the end.
+
+static void usage() {
+  std::cerr <<
+    "syntax) fluent-latency-bench [options]\n"
+    "  -s shape        constant (default), bursty or ramp\n"
+    "  -r events/sec   average rate, peak rate of ramp (default 100000)\n"
+    "  -d sec          duration (default 10)\n"
+    "  -b count        events of a burst for bursty (default 1000)\n"
+    "  -p bytes        payload string of an event (default 100)\n"
+    "  -q limit        queue limit (default 1000)\n"
+    "  -l usec         linger of emitter (default 0)\n"
+    "  -c count        batch count of linger (default 0)\n"
+    "  -B bytes        batch bytes of emitter (default 0)\n"
+    "  -S spin         spin of queue (default 0)\n"
+    "  -a              stamp actual time of emit instead of schedule\n"
+    "  -j              print the result as JSON\n"
+    "  constant emits evenly, bursty emits -b events at once in each\n"
+    "  interval of the same average rate, ramp raises the rate linearly\n"
+    "  from 0 to -r.\n";
+  exit(EXIT_FAILURE);
+}
+
+static uint64_t now_nsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Log-linear histogram as HdrHistogram. Values below 512 are exact, and
+// larger ones fall into 256 buckets for each power of 2, within 0.4% of
+// error.
+class Histogram {
+private:
+  static const int SUB_BITS = 8;
+  static const uint64_t SUB = 1 << SUB_BITS;
+  std::vector<uint64_t> counts_;
+  uint64_t total_;
+  uint64_t max_;
+
+  static size_t index(uint64_t v) {
+    if (v < 2 * SUB) {
+      return v;
+    }
+    int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+    return 2 * SUB + (shift - 1) * SUB + ((v >> shift) - SUB);
+  }
+  // Largest value of the bucket.
+  static uint64_t upper(size_t idx) {
+    if (idx < 2 * SUB) {
+      return idx;
+    }
+    int shift = (idx - 2 * SUB) / SUB + 1;
+    uint64_t sub = (idx - 2 * SUB) % SUB + SUB;
+    return ((sub + 1) << shift) - 1;
+  }
+
+public:
+  Histogram() : counts_((64 - SUB_BITS) * SUB, 0), total_(0), max_(0) {}
+  void record(uint64_t v) {
+    this->counts_[index(v)]++;
+    this->total_++;
+    this->max_ = std::max(this->max_, v);
+  }
+  void reset() {
+    std::fill(this->counts_.begin(), this->counts_.end(), 0);
+    this->total_ = this->max_ = 0;
+  }
+  uint64_t total() const { return this->total_; }
+  uint64_t max() const { return this->max_; }
+  // p in percent.
+  uint64_t percentile(double p) const {
+    uint64_t rank = static_cast<uint64_t>(ceil(this->total_ * p / 100));
+    rank = std::max(rank, static_cast<uint64_t>(1));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < this->counts_.size(); i++) {
+      seen += this->counts_[i];
+      if (seen >= rank) {
+        return std::min(upper(i), this->max_);
+      }
+    }
+    return this->max_;
+  }
+};
+
+static const double PERCENTILES[] = {50, 90, 99, 99.9};
+static const char *const PERCENTILE_NAMES[] = {"p50", "p90", "p99",
+                                               "p999"};
+
+static void print_percentiles(std::ostream &os, const Histogram &h) {
+  os << std::fixed << std::setprecision(1);
+  for (size_t i = 0; i < 4; i++) {
+    os << "  " << PERCENTILE_NAMES[i] << " " << std::setw(9)
+       << h.percentile(PERCENTILES[i]) / 1e3;
+  }
+  os << "  max " << std::setw(9) << h.max() / 1e3 << " usec";
+}
+
+int main(int argc, char *argv[]) {
+  std::string shape = "constant";
+  double rate = 100000, duration = 10;
+  size_t burst = 1000, payload_size = 100, queue_limit = 1000;
+  int linger_usec = 0;
+  size_t batch_count = 0, batch_bytes = 0, spin = 0;
+  bool actual = false, json = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:r:d:b:p:q:l:c:B:S:aj")) != -1) {
+    switch (opt) {
+      case 's': shape = optarg; break;
+      case 'r': rate = atof(optarg); break;
+      case 'd': duration = atof(optarg); break;
+      case 'b': burst = std::stoul(optarg); break;
+      case 'p': payload_size = std::stoul(optarg); break;
+      case 'q': queue_limit = std::stoul(optarg); break;
+      case 'l': linger_usec = atoi(optarg); break;
+      case 'c': batch_count = std::stoul(optarg); break;
+      case 'B': batch_bytes = std::stoul(optarg); break;
+      case 'S': spin = std::stoul(optarg); break;
+      case 'a': actual = true; break;
+      case 'j': json = true; break;
+      default: usage();
+    }
+  }
+  if ((shape != "constant" && shape != "bursty" && shape != "ramp") ||
+      rate <= 0 || duration <= 0 || burst == 0) {
+    usage();
+  }
+
+  // Latency is recorded on the server thread, and the last second is
+  // taken by the main thread.
+  std::mutex mutex;
+  Histogram total, interval;
+  fluent::ForwardServer server;
+  server.set_entry_handler([&](const fluent::DumpReader::Entry &e) {
+      uint64_t now = now_nsec();
+      uint64_t stamp = static_cast<uint64_t>(e.ts) * 1000000000 + e.ts_nsec;
+      uint64_t latency = (now > stamp) ? now - stamp : 0;
+      std::lock_guard<std::mutex> lock(mutex);
+      total.record(latency);
+      interval.record(latency);
+    });
+  if (!server.listen("127.0.0.1") || !server.start()) {
+    std::cerr << "server error: " << server.errmsg() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  fluent::Logger *logger = new fluent::Logger();
+  logger->new_forward("127.0.0.1", server.port());
+  logger->set_event_time(true);
+  logger->set_queue_limit(queue_limit);
+  logger->set_linger(linger_usec, batch_count, batch_bytes);
+  logger->set_spin(spin);
+  const std::string payload(payload_size, 'x');
+
+  // Schedule of i-th event in nsec from start.
+  const size_t events = static_cast<size_t>(
+    (shape == "ramp") ? rate * duration / 2 : rate * duration);
+  auto schedule = [&](size_t i) -> uint64_t {
+    double sec;
+    if (shape == "bursty") {
+      sec = (i / burst) * burst / rate;
+    } else if (shape == "ramp") {
+      // Rate at t is rate * t / duration.
+      sec = sqrt(2 * duration * i / rate);
+    } else {
+      sec = i / rate;
+    }
+    return static_cast<uint64_t>(sec * 1e9);
+  };
+
+  uint64_t start = now_nsec(), report = start + 1000000000;
+  for (size_t i = 0; i < events; i++) {
+    uint64_t target = start + schedule(i);
+    uint64_t now = now_nsec();
+    if (target > now + 50000) {
+      usleep((target - now) / 1000);
+      now = now_nsec();
+    }
+    uint64_t stamp = actual ? now : std::min(now, target);
+
+    fluent::Message *msg = logger->retain_message("bench.latency");
+    msg->set_ts(stamp / 1000000000, stamp % 1000000000);
+    msg->set("seq", static_cast<unsigned long>(i));
+    msg->set("payload", payload);
+    // Drops by full queue are counted by Logger::lost().
+    logger->emit(msg);
+
+    if (now >= report && !json) {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::cerr << std::setw(4) << (report - start) / 1000000000 << "s "
+                << std::setw(9) << interval.total() << " events";
+      print_percentiles(std::cerr, interval);
+      std::cerr << std::endl;
+      interval.reset();
+      report += 1000000000;
+    }
+  }
+  double elapsed = (now_nsec() - start) / 1e9;
+
+  logger->flush(10000);
+  size_t lost = logger->lost();
+  delete logger;
+  for (int i = 0; i < 1000 && server.count() + lost < events; i++) {
+    usleep(10000);
+  }
+  server.stop();
+
+  if (json) {
+    std::cout << std::fixed << std::setprecision(1)
+              << "{\"shape\": \"" << shape << "\", \"rate\": " << rate
+              << ", \"duration\": " << duration << ", \"burst\": " << burst
+              << ", \"payload\": " << payload_size
+              << ", \"queue_limit\": " << queue_limit
+              << ", \"linger_usec\": " << linger_usec
+              << ", \"batch_count\": " << batch_count
+              << ", \"batch_bytes\": " << batch_bytes
+              << ", \"spin\": " << spin << ", \"events\": " << events
+              << ", \"lost\": " << lost
+              << ", \"received\": " << total.total()
+              << ", \"elapsed\": " << elapsed;
+    for (size_t i = 0; i < 4; i++) {
+      std::cout << ", \"" << PERCENTILE_NAMES[i] << "_usec\": "
+                << total.percentile(PERCENTILES[i]) / 1e3;
+    }
+    std::cout << ", \"max_usec\": " << total.max() / 1e3 << "}"
+              << std::endl;
+  } else {
+    std::cout << shape << " " << events << " events in " << std::fixed
+              << std::setprecision(1) << elapsed << " sec, lost " << lost
+              << ", received " << total.total() << std::endl;
+    print_percentiles(std::cout, total);
+    std::cout << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,124 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "../src/fluent/queue.hpp"
+
+// Measure wakeup cost of MsgThreadQueue with several spin budgets.
+// signals and parks are pthread_cond_signal/wait calls, i.e. futex
+// syscalls of the queue itself. ctxsw counts voluntary context switches
+// of the process including mutex contention.
+
+struct Producer {
+  fluent::MsgThreadQueue *q;
+  size_t events;
+};
+
+static void* produce(void *obj) {
+  Producer *p = static_cast<Producer*>(obj);
+  for (size_t i = 0; i < p->events; i++) {
+    fluent::Message *msg = new fluent::Message("bench.queue");
+    while (!p->q->push(msg)) {
+      // queue is full, wait for consumer.
+      sched_yield();
+    }
+  }
+  return nullptr;
+}
+
+static void* consume(void *obj) {
+  fluent::MsgThreadQueue *q = static_cast<fluent::MsgThreadQueue*>(obj);
+  fluent::Message *root;
+  while (nullptr != (root = q->bulk_pop())) {
+    delete root;
+  }
+  return nullptr;
+}
+
+static double now_sec() {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char *argv[]) {
+  size_t events    = (argc > 1) ? std::stoul(argv[1]) : 1000000;
+  size_t producers = (argc > 2) ? std::stoul(argv[2]) : 1;
+  const size_t spins[] = {0, 100, 1000, 10000, 100000};
+
+  std::cout << "events: " << events << ", producers: " << producers
+            << std::endl;
+  std::cout << std::setw(8) << "spin" << std::setw(12) << "ns/event"
+            << std::setw(14) << "signals/1M" << std::setw(12) << "parks/1M"
+            << std::setw(12) << "ctxsw/1M" << std::endl;
+
+  for (size_t s = 0; s < sizeof(spins) / sizeof(spins[0]); s++) {
+    fluent::MsgThreadQueue q;
+    q.set_limit(100000);
+    q.set_spin(spins[s]);
+
+    struct rusage ru_start, ru_end;
+    getrusage(RUSAGE_SELF, &ru_start);
+    double start = now_sec();
+
+    pthread_t consumer;
+    pthread_create(&consumer, nullptr, consume, &q);
+    std::vector<pthread_t> th(producers);
+    std::vector<Producer> prod(producers);
+    for (size_t i = 0; i < producers; i++) {
+      prod[i].q = &q;
+      prod[i].events = events / producers;
+      pthread_create(&th[i], nullptr, produce, &prod[i]);
+    }
+    for (size_t i = 0; i < producers; i++) {
+      pthread_join(th[i], nullptr);
+    }
+    q.term();
+    pthread_join(consumer, nullptr);
+
+    double elapsed = now_sec() - start;
+    getrusage(RUSAGE_SELF, &ru_end);
+    double per_m = 1000000.0 / static_cast<double>(events);
+    long ctxsw = ru_end.ru_nvcsw - ru_start.ru_nvcsw;
+
+    std::cout << std::setw(8) << spins[s]
+              << std::setw(12) << std::fixed << std::setprecision(1)
+              << elapsed * 1e9 / events
+              << std::setw(14) << std::setprecision(0)
+              << q.signal_count() * per_m
+              << std::setw(12) << q.park_count() * per_m
+              << std::setw(12) << ctxsw * per_m << std::endl;
+  }
+  return 0;
+}
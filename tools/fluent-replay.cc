@@ -0,0 +1,255 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include "../src/fluent.hpp"
+#include "../src/fluent/reader.hpp"
+
+// Replay msgpack dumpfile written by Logger::new_dumpfile() into fluentd
+// or a file, e.g. to send events saved during an outage. Records are sent
+// as they are, without decoding. Throughput and lag are reported to
+// stderr every second. Lag is the age of the event being sent, and behind
+// is how late sending is against -r rate.
+
+static void usage() {
+  std::cerr <<
+    "syntax) fluent-replay [options] <dumpfile|->\n"
+    "  -f host[:port]  forward to fluentd (default localhost:24224)\n"
+    "  -o path         write to file instead, in format of -F\n"
+    "  -F format       msgpack (default), text, json or ltsv\n"
+    "  -r events/sec   replay rate, 0 is as fast as possible (default)\n"
+    "  -t pattern      replay only tags matching shell pattern, can be\n"
+    "                  given more than once\n"
+    "  -s time         replay events at or after time\n"
+    "  -e time         replay events before time\n"
+    "  -b count        wait for output every count events (default 10000),\n"
+    "                  0 never waits and may drop events\n"
+    "  time is unix seconds or YYYY-MM-DDTHH:MM:SS in UTC\n";
+  exit(EXIT_FAILURE);
+}
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool parse_time(const char *s, time_t *ts) {
+  char *end;
+  long long v = strtoll(s, &end, 10);
+  if (*s != '\0' && *end == '\0') {
+    *ts = static_cast<time_t>(v);
+    return true;
+  }
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  end = strptime(s, "%Y-%m-%dT%H:%M:%S", &tm);
+  if (end == nullptr || *end != '\0') {
+    return false;
+  }
+  *ts = timegm(&tm);
+  return true;
+}
+
+static bool match_tag(const std::vector<std::string> &patterns,
+                      const std::string &tag) {
+  if (patterns.empty()) {
+    return true;
+  }
+  for (size_t i = 0; i < patterns.size(); i++) {
+    if (fnmatch(patterns[i].c_str(), tag.c_str(), 0) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char *argv[]) {
+  std::string forward, path, format = "msgpack";
+  std::vector<std::string> patterns;
+  double rate = 0;
+  time_t start_ts = 0, end_ts = 0;
+  bool has_start = false, has_end = false;
+  size_t batch = 10000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:o:F:r:t:s:e:b:")) != -1) {
+    switch (opt) {
+      case 'f': forward = optarg; break;
+      case 'o': path = optarg; break;
+      case 'F': format = optarg; break;
+      case 'r': rate = atof(optarg); break;
+      case 't': patterns.push_back(optarg); break;
+      case 's':
+        if (!parse_time(optarg, &start_ts)) {
+          usage();
+        }
+        has_start = true;
+        break;
+      case 'e':
+        if (!parse_time(optarg, &end_ts)) {
+          usage();
+        }
+        has_end = true;
+        break;
+      case 'b': batch = std::stoul(optarg); break;
+      default: usage();
+    }
+  }
+  if (optind + 1 != argc) {
+    usage();
+  }
+  const std::string fname(argv[optind]);
+
+  fluent::DumpReader reader;
+  bool opened = (fname == "-") ? reader.open(STDIN_FILENO) :
+    reader.open(fname);
+  if (!opened) {
+    std::cerr << fname << ": " << reader.errmsg() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  fluent::Logger *logger = new fluent::Logger();
+  if (!path.empty()) {
+    if (format == "msgpack") {
+      logger->new_dumpfile(path);
+    } else if (format == "text") {
+      logger->new_textfile(path);
+    } else if (format == "json") {
+      logger->new_jsonfile(path);
+    } else if (format == "ltsv") {
+      logger->new_ltsvfile(path);
+    } else {
+      usage();
+    }
+  }
+  if (!forward.empty() || path.empty()) {
+    std::string host = forward.empty() ? "localhost" : forward;
+    std::string port = "24224";
+    size_t colon = host.rfind(':');
+    if (colon != std::string::npos) {
+      port = host.substr(colon + 1);
+      host = host.substr(0, colon);
+    }
+    logger->new_forward(host, port);
+  }
+  // Queue holds events sent between waits, so that none is dropped.
+  if (batch > 0) {
+    logger->set_queue_limit(batch);
+  }
+
+  size_t sent = 0, skipped = 0, failed = 0;
+  size_t last_sent = 0;
+  uint64_t last_offset = 0;
+  double start = now_sec(), last_report = start, behind = 0;
+  time_t event_ts = 0;
+  fluent::DumpReader::Entry e;
+
+  while (reader.next(&e)) {
+    if ((has_start && e.ts < start_ts) || (has_end && e.ts >= end_ts)) {
+      skipped++;
+      continue;
+    }
+    std::string tag(e.tag, e.tag_len);
+    if (!match_tag(patterns, tag)) {
+      skipped++;
+      continue;
+    }
+
+    double now = now_sec();
+    if (rate > 0) {
+      // Sleep only when ahead by 1 msec or more, events after that catch
+      // up with the schedule.
+      double due = start + sent / rate;
+      if (due - now >= 0.001) {
+        usleep(static_cast<useconds_t>((due - now) * 1e6));
+      }
+      behind = (now > due) ? now - due : 0;
+    }
+
+    fluent::Message *msg = logger->retain_message(tag);
+    fluent::DumpReader::load(e, msg);
+    if (!logger->emit(msg)) {
+      failed++;
+    }
+    sent++;
+    event_ts = e.ts;
+    if (batch > 0 && sent % batch == 0) {
+      logger->flush(60000);
+    }
+
+    now = now_sec();
+    if (now - last_report >= 1.0) {
+      double elapsed = now - last_report;
+      std::cerr << std::fixed << std::setprecision(1)
+                << (now - start) << "s: sent " << sent << " ("
+                << (sent - last_sent) / elapsed << " events/sec, "
+                << (reader.offset() - last_offset) / elapsed / 1e6
+                << " MB/sec), skipped " << skipped
+                << ", lag " << (time(nullptr) - event_ts) << "s";
+      if (rate > 0) {
+        std::cerr << ", behind " << std::setprecision(3) << behind << "s";
+      }
+      std::cerr << std::endl;
+      last_report = now;
+      last_sent = sent;
+      last_offset = reader.offset();
+    }
+  }
+
+  int rc = EXIT_SUCCESS;
+  if (!reader.errmsg().empty()) {
+    std::cerr << fname << ": " << reader.errmsg() << std::endl;
+    rc = EXIT_FAILURE;
+  } else if (reader.truncated()) {
+    std::cerr << fname << ": truncated entry at offset " << reader.offset()
+              << " is ignored" << std::endl;
+  }
+
+  size_t lost = 0;
+  if (!logger->flush(60000, &lost)) {
+    std::cerr << "timeout to flush output" << std::endl;
+    rc = EXIT_FAILURE;
+  }
+  double elapsed = now_sec() - start;
+  std::cerr << std::fixed << std::setprecision(1)
+            << "sent " << sent << " events in " << elapsed << "s ("
+            << sent / elapsed << " events/sec), skipped " << skipped
+            << ", lost " << lost << std::endl;
+  if (failed > 0 || lost > 0) {
+    rc = EXIT_FAILURE;
+  }
+  delete logger;
+  return rc;
+}
@@ -0,0 +1,129 @@
+/*-
+ * Copyright (c) 2015 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "../src/fluent.hpp"
+#include "../src/fluent/reader.hpp"
+
+// Scan throughput of dumpfile by DumpReader and by DumpScanner with
+// 1, 2, 4, ... threads up to the number of CPUs or argv[3]. The file is created with
+// synthetic events of about 220 bytes if it does not exist. scan cases
+// only find entries, decode cases also decode them into Message.
+
+static double now_sec() {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void generate(const std::string &fname, size_t size) {
+  fluent::Logger *logger = new fluent::Logger();
+  logger->new_dumpfile(fname);
+  logger->set_queue_limit(10000);
+  size_t written = 0;
+  for (size_t i = 0; written < size; i++) {
+    fluent::Message *msg = logger->retain_message("bench.scan");
+    msg->set("host", "web01.example.com");
+    msg->set("method", "GET");
+    msg->set("url", "/api/v1/items?id=12345&sort=desc");
+    msg->set("agent", "Mozilla/5.0 (X11; Linux x86_64) \"bench\"");
+    msg->set("status", 200);
+    msg->set("bytes", static_cast<int>(i % 1000000));
+    msg->set("request_id", static_cast<long long>(i));
+    msg->set("latency_ms", (i % 1000) / 10.0);
+    msg->set("cached", i % 2 == 0);
+    logger->emit(msg);
+    written += 220;
+    if (i % 10000 == 9999) {
+      logger->flush(60000);
+    }
+  }
+  delete logger;
+}
+
+static void report(const std::string &name, size_t threads, size_t count,
+                   size_t bytes, double elapsed) {
+  std::cout << std::setw(10) << std::left << name << std::right
+            << std::setw(4) << threads << " threads"
+            << std::setw(12) << count << " entries"
+            << std::setw(10) << std::fixed << std::setprecision(3)
+            << bytes / elapsed / 1e9 << " GB/sec" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "syntax) fluent-scan-bench <dumpfile> [MB to create] "
+              << "[max threads]" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  const std::string fname(argv[1]);
+  size_t mb = (argc > 2) ? std::stoul(argv[2]) : 2048;
+
+  struct stat st;
+  if (::stat(fname.c_str(), &st) != 0) {
+    std::cout << "creating " << fname << " of " << mb << " MB" << std::endl;
+    generate(fname, mb * 1024 * 1024);
+    ::stat(fname.c_str(), &st);
+  }
+  size_t size = st.st_size;
+
+  fluent::DumpReader reader;
+  fluent::DumpReader::Entry e;
+  double start = now_sec();
+  reader.open(fname);
+  size_t count = 0;
+  while (reader.next(&e)) {
+    count++;
+  }
+  report("reader", 1, count, size, now_sec() - start);
+
+  size_t max_threads = (argc > 3) ? std::stoul(argv[3]) :
+    std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  for (size_t threads = 1; threads <= max_threads;
+       threads *= 2) {
+    fluent::DumpScanner scanner(threads);
+    scanner.open(fname);
+    start = now_sec();
+    scanner.scan([](const fluent::DumpReader::Entry &e) {});
+    report("scan", threads, scanner.count(), size, now_sec() - start);
+
+    std::atomic<size_t> fields(0);
+    start = now_sec();
+    scanner.scan_ordered([&](fluent::Message *msg) {
+        fields += msg->has_key("status");
+        delete msg;
+      });
+    report("decode", threads, scanner.count(), size, now_sec() - start);
+  }
+  return 0;
+}